@@ -0,0 +1,300 @@
+// Runs lispy workloads and reports their median wall time, peak RSS and heap
+// allocations as tab separated values, one line per workload.
+//
+//  bench [--lispy=PATH] [--runs=N] [--save=FILE] [--baseline=FILE]
+//        [--threshold=PERCENT] workload.lisp...
+//  bench --generate=FILE [--size=BYTES]
+//
+// With --baseline the results are compared against a file written by --save,
+// and the exit status is 1 if any workload got slower, bigger or allocated
+// more than the threshold (10% by default) allows.
+#define _DEFAULT_SOURCE
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+typedef struct {
+    char    Name[256];
+    size_t  Runs;
+    double  MedianMs;
+    double  MinMs;
+    long    MaxRssKb;
+    long    Allocs;
+    bool    Failed;
+} bresult;
+
+typedef struct {
+    size_t      Count;
+    bresult*    Results;
+} bresults;
+
+char* lispy = "./lispy";
+size_t runs = 5;
+double threshold = 10.0;
+
+double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+int compare_double(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+
+    return (x > y) - (x < y);
+}
+
+// Runs the workload once. Its output is scanned for the counters printed by
+// --stats and for errors, which fail the workload.
+bool run_once(char* workload, double* ms, long* rss_kb, long* allocs) {
+    int fds[2];
+    if (pipe(fds) < 0) return false;
+
+    double start = now_ms();
+
+    pid_t pid = fork();
+    if (pid < 0) return false;
+
+    if (pid == 0) {
+        dup2(fds[1], STDOUT_FILENO);
+        dup2(fds[1], STDERR_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+
+        execl(lispy, lispy, "--stats", workload, (char*)NULL);
+        perror(lispy);
+        _exit(127);
+    }
+
+    close(fds[1]);
+
+    FILE* out = fdopen(fds[0], "r");
+    char line[4096];
+    bool ok = true;
+
+    while (fgets(line, sizeof(line), out)) {
+        if (strncmp(line, "allocs=", 7) == 0) {
+            *allocs = strtol(line + 7, NULL, 10);
+        } else if (strncmp(line, "Error:", 6) == 0) {
+            fprintf(stderr, "%s: %s", workload, line);
+            ok = false;
+        }
+    }
+
+    fclose(out);
+
+    int status = 0;
+    struct rusage usage;
+    wait4(pid, &status, 0, &usage);
+
+    *ms = now_ms() - start;
+    *rss_kb = usage.ru_maxrss;
+
+    return ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+bresult run_workload(char* workload) {
+    bresult r = { .Allocs = -1 };
+    snprintf(r.Name, sizeof(r.Name), "%s", workload);
+
+    double* times = calloc(runs, sizeof(double));
+
+    // NOTE(daniel): stop at the first failure, its timings are meaningless.
+    for (r.Runs = 0; r.Runs < runs && !r.Failed; ++r.Runs) {
+        long rss_kb = 0;
+
+        if (!run_once(workload, &times[r.Runs], &rss_kb, &r.Allocs)) r.Failed = true;
+        if (rss_kb > r.MaxRssKb) r.MaxRssKb = rss_kb;
+    }
+
+    size_t n = r.Runs;
+    qsort(times, n, sizeof(double), compare_double);
+    r.MedianMs = (n % 2) ? times[n / 2] : (times[n / 2 - 1] + times[n / 2]) / 2;
+    r.MinMs = times[0];
+
+    free(times);
+
+    return r;
+}
+
+void print_header(FILE* f) {
+    fputs("workload\truns\tmedian_ms\tmin_ms\tmax_rss_kb\tallocs", f);
+}
+
+void print_result(FILE* f, bresult* r) {
+    fprintf(f, "%s\t%zu\t%.2f\t%.2f\t%ld\t%ld",
+        r->Name, r->Runs, r->MedianMs, r->MinMs, r->MaxRssKb, r->Allocs);
+}
+
+bresults load_results(char* path) {
+    bresults rs = { 0 };
+
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        exit(2);
+    }
+
+    char line[4096];
+
+    // Skip the header
+    if (!fgets(line, sizeof(line), f)) {
+        fclose(f);
+        return rs;
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        bresult r = { 0 };
+
+        if (sscanf(line, "%255[^\t]\t%zu\t%lf\t%lf\t%ld\t%ld",
+                r.Name, &r.Runs, &r.MedianMs, &r.MinMs, &r.MaxRssKb, &r.Allocs) != 6) {
+            continue;
+        }
+
+        rs.Results = realloc(rs.Results, sizeof(bresult) * (rs.Count + 1));
+        rs.Results[rs.Count++] = r;
+    }
+
+    fclose(f);
+
+    return rs;
+}
+
+bresult* find_result(bresults* rs, char* name) {
+    for (size_t i = 0; i < rs->Count; ++i) {
+        if (strcmp(rs->Results[i].Name, name) == 0) return &rs->Results[i];
+    }
+
+    return NULL;
+}
+
+double ratio(double x, double base) {
+    return base > 0 ? x / base : 1.0;
+}
+
+// Writes a reproducible source file of about `size` bytes for the reader.
+// It only holds Q-Expressions, so loading it costs little more than reading.
+int generate(char* path, size_t size) {
+    FILE* f = fopen(path, "w");
+    if (!f) {
+        perror(path);
+        return 1;
+    }
+
+    size_t written = 0;
+    for (size_t i = 0; written < size; ++i) {
+        int n = fprintf(f,
+            "{sym-%zu %zu \"a string with \\n an escape\" (nested list of-symbols -%zu)} ; comment\n",
+            i % 5000, i * 7919, i);
+
+        if (n < 0) break;
+
+        written += n;
+    }
+
+    fclose(f);
+
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    char* save = NULL;
+    char* baseline = NULL;
+    char* generate_path = NULL;
+    size_t generate_size = 32 << 20;
+    int workloads = 0;
+
+    for (int i = 1; i < argc; ++i) {
+        if (strncmp(argv[i], "--lispy=", 8) == 0) {
+            lispy = argv[i] + 8;
+        } else if (strncmp(argv[i], "--runs=", 7) == 0) {
+            runs = strtoul(argv[i] + 7, NULL, 10);
+        } else if (strncmp(argv[i], "--save=", 7) == 0) {
+            save = argv[i] + 7;
+        } else if (strncmp(argv[i], "--baseline=", 11) == 0) {
+            baseline = argv[i] + 11;
+        } else if (strncmp(argv[i], "--threshold=", 12) == 0) {
+            threshold = strtod(argv[i] + 12, NULL);
+        } else if (strncmp(argv[i], "--generate=", 11) == 0) {
+            generate_path = argv[i] + 11;
+        } else if (strncmp(argv[i], "--size=", 7) == 0) {
+            generate_size = strtoul(argv[i] + 7, NULL, 10);
+        } else if (strncmp(argv[i], "--", 2) == 0) {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            return 2;
+        } else {
+            argv[workloads++] = argv[i];
+        }
+    }
+
+    if (generate_path) return generate(generate_path, generate_size);
+
+    if (runs == 0) runs = 1;
+
+    bresults base = { 0 };
+    if (baseline) base = load_results(baseline);
+
+    FILE* out = save ? fopen(save, "w") : NULL;
+    if (save && !out) {
+        perror(save);
+        return 2;
+    }
+
+    print_header(stdout);
+    if (baseline) fputs("\tbase_ms\ttime_ratio\tbase_rss_kb\trss_ratio\tbase_allocs\tallocs_ratio\tstatus", stdout);
+    putchar('\n');
+
+    if (out) {
+        print_header(out);
+        fputc('\n', out);
+    }
+
+    int status = 0;
+
+    for (int i = 0; i < workloads; ++i) {
+        bresult r = run_workload(argv[i]);
+
+        print_result(stdout, &r);
+
+        if (out) {
+            print_result(out, &r);
+            fputc('\n', out);
+        }
+
+        if (r.Failed) status = 1;
+
+        bresult* b = baseline ? find_result(&base, r.Name) : NULL;
+
+        if (b) {
+            double limit = 1.0 + threshold / 100.0;
+            double time_ratio = ratio(r.MedianMs, b->MedianMs);
+            double rss_ratio = ratio(r.MaxRssKb, b->MaxRssKb);
+            double allocs_ratio = ratio(r.Allocs, b->Allocs);
+
+            bool regressed = time_ratio > limit || rss_ratio > limit || allocs_ratio > limit;
+            if (regressed) status = 1;
+
+            printf("\t%.2f\t%.3f\t%ld\t%.3f\t%ld\t%.3f\t%s",
+                b->MedianMs, time_ratio, b->MaxRssKb, rss_ratio, b->Allocs, allocs_ratio,
+                r.Failed ? "failed" : regressed ? "regressed" : "ok");
+        } else if (baseline) {
+            printf("\t\t\t\t\t\t\t%s", r.Failed ? "failed" : "new");
+        }
+
+        putchar('\n');
+        fflush(stdout);
+    }
+
+    if (out) fclose(out);
+
+    return status;
+}
@@ -0,0 +1,13 @@
+; Deep non-tail recursion, and a long tail recursive loop.
+(fun {depth n}
+     {if (== n 0)
+        {0}
+        {+ 1 (depth (- n 1))}})
+
+(fun {count n acc}
+     {if (== n 0)
+        {acc}
+        {count (- n 1) (+ acc 1)}})
+
+(print (depth 1000000))
+(print (count 3000000 0))
@@ -0,0 +1,3 @@
+; Recursive Fibonacci from the examples, mostly lambda calls and arithmetic.
+(load "examples/fibonacci.lisp")
+(print (fib 23))
@@ -0,0 +1,21 @@
+; map, filter and foldl over lists of 10k to 1M elements.
+(fun {iota n}
+     {iota-grow {0} n})
+(fun {iota-grow l n}
+     {if (>= (len l) n)
+        {take n l}
+        {iota-grow (join l (map (\ {x} {+ x (len l)}) l)) n}})
+
+(fun {even x}
+     {== x (* 2 (/ x 2))})
+(fun {work l}
+     {foldl + 0 (map (\ {x} {* x 3}) (filter even l))})
+
+(fun {repeat n l}
+     {if (== n 0)
+        {0}
+        {+ (work l) (repeat (- n 1) l)}})
+
+(print (repeat 100 (iota 10000)))
+(print (repeat 10 (iota 100000)))
+(print (work (iota 1000000)))
@@ -0,0 +1,22 @@
+; Hash map churn: insert 100k keys, look them all up, then delete half of them
+; and fold over what is left.
+(fun {fill n acc}
+     {if (== n 0)
+        {acc}
+        {fill (- n 1) (map-put acc n (* n 3))}})
+
+(fun {lookup n m acc}
+     {if (== n 0)
+        {acc}
+        {lookup (- n 1) m (+ acc (map-get m n))}})
+
+(fun {drain n acc}
+     {if (== n 0)
+        {acc}
+        {drain (- n 1) (map-del acc (* n 2))}})
+
+(def {m} (fill 100000 (hash-map nil)))
+(def {h} (drain 50000 m))
+
+(print (map-len m) (lookup 100000 m 0))
+(print (map-len h) (map-fold (\ {z k v} {+ z v}) 0 h))
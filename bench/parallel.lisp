@@ -0,0 +1,8 @@
+; Recursive Fibonacci over a list, with pmap and preduce. Runs on every
+; processor by default, compare with --threads=1.
+(load "examples/fibonacci.lisp")
+
+(def {ns} (vlist (v+ 12 (v- (vrange 64) (v* 8 (v/ (vrange 64) 8))))))
+
+(print (preduce + 0 (pmap fib ns)))
+(print (len (pfilter (\ {n} {> (fib n) 100}) ns)))
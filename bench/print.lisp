@@ -0,0 +1,11 @@
+; Printing: a 1M element vector, 10k lists of strings that need escaping, and
+; their printed forms as strings.
+(print (vrange 1000000))
+
+(fun {lines n}
+     {if (== n 0)
+        {()}
+        {do (print {n "a\tquoted \"line\"\n" -42 {nested {list}}}) (lines (- n 1))}})
+
+(lines 10000)
+(print (len (map show (vlist (vrange 100000)))))
@@ -0,0 +1,2 @@
+; Reader throughput, on a file generated by `bench --generate`.
+(load "bench/data/reader.lisp")
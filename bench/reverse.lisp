@@ -0,0 +1,11 @@
+; The reverse from the examples, on a large list.
+(load "examples/reverse.lisp")
+
+(fun {iota n}
+     {iota-grow {0} n})
+(fun {iota-grow l n}
+     {if (>= (len l) n)
+        {take n l}
+        {iota-grow (join l (map (\ {x} {+ x (len l)}) l)) n}})
+
+(print (len (reverse (iota 1000000))))
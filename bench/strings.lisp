@@ -0,0 +1,13 @@
+; Text processing: build a 100k word line with concat, then split it, join it
+; back and sum the numbers in it.
+(fun {words n acc}
+     {if (== n 0)
+        {acc}
+        {words (- n 1) (concat acc (show (* n 7)) " ")}})
+
+(def {line} (words 100000 ""))
+(def {parts} (str-split line " "))
+
+(print (str-len line) (len parts))
+(print (str-len (str-join parts ",")))
+(print (sum (map str->num (take 100000 parts))))
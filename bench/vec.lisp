@@ -0,0 +1,15 @@
+; The lists workload again, on packed vectors of 10k to 10M elements.
+(fun {even v}
+     {v== v (v* 2 (v/ v 2))})
+(fun {work v}
+     {vdot (even v) (v* v 3)})
+
+(fun {repeat n v}
+     {if (== n 0)
+        {0}
+        {+ (work v) (repeat (- n 1) v)}})
+
+(print (repeat 100 (vrange 10000)))
+(print (repeat 10 (vrange 100000)))
+(print (work (vrange 1000000)))
+(print (vsum (vscan (vrange 10000000))))
@@ -0,0 +1,58 @@
+#ifndef LISPY_H
+#define LISPY_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+// NOTE(daniel): the library is built with hidden visibility, and its hidden
+// symbols made local, so only the functions declared here are exported.
+#if defined(__GNUC__) || defined(__clang__)
+#define LISPY_API __attribute__((visibility("default")))
+#else
+#define LISPY_API
+#endif
+
+// An interpreter. Interpreters share no mutable state (the builtin table they
+// all read is filled once, by the first lispy_new), so any number of them can
+// run at the same time, each on its own thread. A single interpreter must
+// not be used by two threads at once.
+typedef struct lispy lispy;
+
+// Creates an interpreter with the builtins bound in its root environment.
+// The standard library is not loaded, see lispy_load.
+LISPY_API lispy* lispy_new(void);
+
+// Frees the interpreter and everything it allocated.
+LISPY_API void lispy_free(lispy* l);
+
+// Sets the stream that print and errors in loaded files are written to,
+// stdout by default.
+LISPY_API void lispy_output(lispy* l, FILE* out);
+
+// Loads and evaluates the file at `path`. Returns 0, or -1 if the file could
+// not be read.
+LISPY_API int lispy_load(lispy* l, const char* path);
+
+// Makes lispy_load and the load builtin keep the forms read from each file
+// in a cache, which is used instead of reading the file again as long as it
+// doesn't change. Caches are written into the directory `dir`, or next to the
+// files if it is empty. NULL turns caching off, which is the default.
+LISPY_API void lispy_load_cache(lispy* l, const char* dir);
+
+// Loads the `count` files in `paths` like lispy_load, from the image at
+// `image` if it was made from the same files as they are now. Otherwise the
+// files are loaded and the image is written anew. What the files print is
+// not replayed when the image is used. Returns 0, or -1 if a file could not
+// be read.
+LISPY_API int lispy_load_image(lispy* l, const char* image, const char** paths, size_t count);
+
+// Evaluates the expressions in the `length` characters at `src`, which need
+// not be NUL terminated, stopping at the first error. Returns 0, or -1 if the
+// result is an error.
+LISPY_API int lispy_eval(lispy* l, const char* src, size_t length);
+
+// Returns the printed form of the result of the last lispy_load or
+// lispy_eval. It is owned by the interpreter and valid until the next call.
+LISPY_API const char* lispy_result(lispy* l);
+
+#endif
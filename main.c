@@ -1,10 +1,23 @@
+#define _DEFAULT_SOURCE
+
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stddef.h>
 #include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <threads.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+
+#include "lispy.h"
 
+#ifndef LISPY_LIBRARY
 #ifdef _WIN32
 #include <string.h>
 
@@ -31,6 +44,14 @@ void add_history(char* unused) { (void)unused; }
 #include <editline/readline.h>
 #include <editline/history.h>
 
+#endif
+#endif
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
 #endif
 
 typedef enum {
@@ -41,6 +62,8 @@ typedef enum {
     LVAL_FUN,
     LVAL_SEXPR,
     LVAL_QEXPR,
+    LVAL_VEC,
+    LVAL_MAP,
 } lval_type;
 
 char *lval_type_name(lval_type t) {
@@ -52,1196 +75,7585 @@ char *lval_type_name(lval_type t) {
         case LVAL_FUN: return "Function";
         case LVAL_SEXPR: return "S-Expression";
         case LVAL_QEXPR: return "Q-Expression";
+        case LVAL_VEC: return "Vector";
+        case LVAL_MAP: return "Map";
         default: return "Unknown";
     }
 }
 
 typedef struct lval lval;
 typedef struct lenv lenv;
+typedef struct lcode lcode;
+typedef struct lbuf lbuf;
+typedef struct lstrbuf lstrbuf;
+typedef struct lmemo lmemo;
+typedef struct lvec lvec;
+typedef struct lhamt lhamt;
+typedef struct lpar lpar;
+typedef struct limage limage;
+typedef struct lload lload;
 typedef lval* (*lbuiltin)(lenv*, lval*);
 
 void lval_print(lval* v);
+void lval_fprint(FILE* f, lval* v);
 lval* lval_eval_sexpr(lenv* e, lval* v);
 void lval_free(lval* v);
+void lbuf_free(lbuf* b);
+size_t lbuf_size(size_t capacity);
+void lstrbuf_free(lstrbuf* b);
+size_t lvec_size(size_t count);
 lval* lval_copy(lval *v);
+lval* lval_unshare(lval* v);
+lval* lval_clone(lval* v);
 lval* lval_err(char* fmt, ...);
 lval* lval_sym(char* s);
+lval* lval_sexpr(void);
+lval* lval_qexpr(void);
+lval* lval_add(lval* v, lval* x);
+lval* lval_read_all(char* s, size_t length);
+lload* lload_open(char* path);
+lval* lload_next(lload* ld);
+void lload_close(lload* ld);
 lval* lval_fun(char* s, lbuiltin fun);
-lval* lval_read_expr(char* s, int* i, char end);
-
-// NOTE(daniel): Syms and Vals are parallel arrays.
+void lval_builtins_init(void);
+lcode* lcode_compile(lval* formals, lval* body);
+void lcode_free(lcode* c);
+void lmemo_free(lmemo* m);
+void lhamt_free(lhamt* n);
+size_t lhamt_size(size_t count);
+size_t lhamt_hash(lhamt* n);
+bool lhamt_subset(lhamt* x, lhamt* y);
+lval* lvm_run(lval* f, lenv* e);
+lval* lval_call(lenv* e, lval* f, lval* a);
+void limage_mark(void);
+
+#define LENV_INLINE_SLOTS 4
+
+// NOTE(daniel): the formals of a lambda live in Slots, in the order of the
+// Params Q-Expression, so compiled code can read them by index. Slots that
+// are not bound yet are NULL.
+//
+// Any other binding goes into Syms and Vals, parallel arrays forming an
+// open-addressed hash table. Syms are interned, so keys are compared by
+// pointer and a NULL key marks an empty slot. Capacity is always zero or a
+// power of two.
+//
+// The root environment is special: its bindings live in the symbols
+// themselves, see lsym.
 struct lenv {
     lenv*   Parent;
+    bool    Root;
+
+    lval*   Params;
+    lval**  Slots;
+    lval*   Inline[LENV_INLINE_SLOTS];
 
     size_t  Count;
+    size_t  Capacity;
     char**  Syms;
     lval**  Vals;
 };
 
+// NOTE(daniel): lvals are shared. Refs counts the owners of a value, so
+// lval_copy is O(1) and values must be treated as immutable unless Refs is 1.
+// Use lval_unshare to get a private copy before mutating a value in place.
+//
+// Each type only uses its own variant of the union. Numbers, errors, symbols
+// and vectors are atoms, which are allocated with just enough room for their
+// one field (LVAL_ATOM_SIZE), so never assign a whole struct lval to one.
+#define LVAL_INLINE_CELLS 4
+
 struct lval {
     lval_type       Type;
+    uint32_t        Refs;
+
+    union {
+        long            Num;
+        char*           Err;
+        lvec*           Vec;
+
+        // Maps, see lhamt. The empty map has no trie.
+        struct {
+            lhamt*          Hamt;
+            size_t          Size;
+        };
+
+        // Strings, see lstrbuf
+        struct {
+            lstrbuf*        StrBuf;
+            char*           Str;
+            size_t          Length;
+        };
+
+        // Symbols use Sym only, functions use it for their name
+        struct {
+            char*           Sym;
+            lval*           Formals;
+            lval*           Body;
+            lcode*          Code;
+            lval*           Args;
+            lmemo*          Memo;
+        };
+
+        // Expressions, see lbuf. Short ones keep their cells in Inline
+        // instead, then Buf is NULL.
+        struct {
+            lbuf*           Buf;
+            size_t          Count;
+            struct lval**   Cell;
+            struct lval*    Inline[LVAL_INLINE_CELLS];
+        };
+    };
+};
 
-    // Basic values
-    long            Num;
-    char*           Err;
-    char*           Sym;
-    char*           Str;
-
-    // Functions
-    lbuiltin        Builtin;
-    lenv*           Env;
-    lval*           Formals;
-    lval*           Body;
-
-    // Expressions
+#define LVAL_ATOM_SIZE (offsetof(lval, Num) + sizeof(void*))
+
+// NOTE(daniel): while the parallel builtins run, everything the workers can
+// reach is frozen: its count is replaced by LVAL_FROZEN plus the index of the
+// real count in a side table, see lpar_freeze. Copying or freeing a frozen
+// value does nothing, so all threads can share it. Buffers, code and caches
+// are frozen the same way with LREFS_FROZEN.
+#define LVAL_FROZEN     (UINT32_MAX / 2 + 1)
+#define LREFS_FROZEN    (SIZE_MAX / 2 + 1)
+
+// Values mapped from an image never change or die, see limage. Their counts
+// are also above the frozen ones, so they're treated as frozen for good.
+#define LVAL_STATIC     UINT32_MAX
+#define LREFS_STATIC    SIZE_MAX
+
+// NOTE(daniel): small integers and builtins are immediates, they never touch
+// the heap. Heap objects are at least 8 byte aligned, so the low bits of a
+// real lval pointer are always zero; an immediate is tagged in those bits and
+// carries its value in the rest of the pointer. A fixnum holds the number
+// itself, a builtin its index in the builtin table. Numbers that don't fit
+// are boxed in a heap LVAL_NUM as before.
+//
+// Only lval_type_of, lval_num_of and lval_builtin_of may look at a value that
+// could be an immediate; lval_copy and lval_free ignore them.
+#define LVAL_TAG_BITS       2
+#define LVAL_TAG_MASK       ((uintptr_t)3)
+#define LVAL_TAG_NUM        ((uintptr_t)1)
+#define LVAL_TAG_BUILTIN    ((uintptr_t)2)
+
+#define LVAL_FIX_MIN        (LONG_MIN >> LVAL_TAG_BITS)
+#define LVAL_FIX_MAX        (LONG_MAX >> LVAL_TAG_BITS)
+
+typedef struct {
+    char*       Name;
+    lbuiltin    Fun;
+} lbuiltin_entry;
+
+// NOTE(daniel): the builtin table is shared by all interpreters. It is filled
+// once, from lbuiltin_list, before the first interpreter binds its builtins,
+// and only read after that, so it needs no locking.
+typedef struct {
+    once_flag       Once;
     size_t          Count;
-    struct lval**   Cell;
-};
+    lbuiltin_entry* Entries;
+} lbuiltin_table;
 
-lenv* lenv_new(void) {
-    lenv* e = malloc(sizeof(lenv));
+lbuiltin_table lval_builtins = { .Once = ONCE_FLAG_INIT };
 
-    *e = (lenv) {
-        .Parent = NULL,
-        .Count  = 0,
-        .Syms   = NULL,
-        .Vals   = NULL,
-    };
+bool lval_is_imm(lval* v) {
+    return ((uintptr_t)v & LVAL_TAG_MASK) != 0;
+}
 
-    return e;
+lval_type lval_type_of(lval* v) {
+    switch ((uintptr_t)v & LVAL_TAG_MASK) {
+        case LVAL_TAG_NUM: return LVAL_NUM;
+        case LVAL_TAG_BUILTIN: return LVAL_FUN;
+        default: return v->Type;
+    }
 }
 
-void lenv_free(lenv* e) {
-    for (size_t i = 0; i < e->Count; ++i) {
-        free(e->Syms[i]);
-        lval_free(e->Vals[i]);
+long lval_num_of(lval* v) {
+    if (((uintptr_t)v & LVAL_TAG_MASK) == LVAL_TAG_NUM) {
+        return (long)((intptr_t)v >> LVAL_TAG_BITS);
     }
 
-    // NOTE(daniel): don't free the Parent, it's not owned by this environment.
-    free(e->Syms);
-    free(e->Vals);
-    free(e);
+    return v->Num;
 }
 
-lenv* lenv_copy(lenv* e) {
-    lenv* n = malloc(sizeof(lenv));
+lbuiltin_entry* lval_builtin_entry(lval* v) {
+    if (((uintptr_t)v & LVAL_TAG_MASK) != LVAL_TAG_BUILTIN) return NULL;
 
-    *n = (lenv) {
-        .Parent = e->Parent,
-        .Count  = e->Count,
-        .Syms   = malloc(sizeof(char*) * e->Count),
-        .Vals   = malloc(sizeof(lval*) * e->Count),
-    };
+    return &lval_builtins.Entries[(uintptr_t)v >> LVAL_TAG_BITS];
+}
 
-    for (size_t i = 0; i < e->Count; ++i) {
-        n->Syms[i] = malloc(strlen(e->Syms[i]) + 1);
-        strcpy(n->Syms[i], e->Syms[i]);
-        n->Vals[i] = lval_copy(e->Vals[i]);
-    }
+// Returns the builtin `v` refers to, or NULL for any other value.
+lbuiltin lval_builtin_of(lval* v) {
+    lbuiltin_entry* entry = lval_builtin_entry(v);
 
-    return n;
+    return entry ? entry->Fun : NULL;
 }
 
-lval* lenv_get(lenv* e, lval* k) {
-    for (size_t i = 0; i < e->Count; ++i) {
-        if (strcmp(e->Syms[i], k->Sym) == 0) {
-            return lval_copy(e->Vals[i]);
-        }
-    }
+// NOTE(daniel): the cells of an expression live in a buffer that can be shared
+// by many expressions, each one a view of Count cells starting at Cell. The
+// buffer owns a reference to all of its cells, including those outside any
+// view (or NULL, see lval_pop), so slicing (head, tail, take, drop) is O(1).
+// A shared buffer is immutable; see lval_reserve and lval_own_cells before
+// writing to one.
+//
+// Expressions of up to LVAL_INLINE_CELLS cells, which is most code, don't get
+// a buffer: Cell points into their own Inline array, which is never shared,
+// and they only own the cells in their view.
+struct lbuf {
+    size_t          Refs;
+    size_t          Count;
+    size_t          Capacity;
+    struct lval*    Cells[];
+};
 
-    if (e->Parent) {
-        return lenv_get(e->Parent, k);
-    } else {
-        return lval_err("Unbound symbol '%s'", k->Sym);
-    }
-}
+// NOTE(daniel): the characters of a string live in a buffer that can be
+// shared by many strings, each one a view of Length characters starting at
+// Str, so slicing (substr, str-split) is O(1). Views aren't NUL terminated,
+// but the buffer always is. The Length characters of a buffer never change;
+// the room after them is for appending, see lval_str_extend.
+struct lstrbuf {
+    size_t          Refs;
+    size_t          Length;
+    size_t          Capacity;
+    char            Data[];
+};
 
-void lenv_put(lenv* e, lval* k, lval* v) {
-    // NOTE(daniel): if the symbol already exists, free the old value and replace it.
-    for (size_t i = 0; i < e->Count; ++i) {
-        if (strcmp(e->Syms[i], k->Sym) == 0) {
-            lval_free(e->Vals[i]);
-            e->Vals[i] = lval_copy(v);
+// NOTE(daniel): a vector packs 64 bit integers, for numeric work that would
+// otherwise need lists of numbers. Its data belongs to the one value, the
+// vector builtins always return new vectors.
+struct lvec {
+    size_t          Count;
+    int64_t         Data[];
+};
 
-            return;
-        }
-    }
+// NOTE(daniel): a map is a hash array mapped trie. A node has a slot for each
+// set bit of Bitmap, picked by the next LHAMT_BITS bits of the hash of a key,
+// so it only allocates the slots it uses. A slot holds a key and its value,
+// or a child node for the keys that share the bits so far. Keys whose hashes
+// are equal all the way down share a collision node, which has no Bitmap and
+// is searched in order.
+//
+// Nodes are counted and never change once made. An update copies the nodes
+// on the path to the key and shares all the others with the old map, so maps
+// are persistent and an update costs O(log n).
+#define LHAMT_BITS      5
+#define LHAMT_MASK      ((1u << LHAMT_BITS) - 1)
+#define LHAMT_LEVELS    ((64 + LHAMT_BITS - 1) / LHAMT_BITS)
+
+typedef struct {
+    size_t          Hash;
+    struct lval*    Key;        // NULL for a child node
+    union {
+        struct lval*    Val;
+        lhamt*          Node;
+    };
+} lhamt_slot;
+
+struct lhamt {
+    size_t          Refs;
+    uint32_t        Bitmap;
+    uint32_t        Count;
+    lhamt_slot      Slots[];
+};
+
+// NOTE(daniel): lambda bodies are compiled to bytecode for a small stack
+// machine, see lcode_compile and lvm_run.
+typedef enum {
+    OP_CONST,           // push Consts[Arg]
+    OP_LOAD_LOCAL,      // push the formal in slot Arg of the frame
+    OP_LOAD_GLOBAL,     // push the value of free symbol Consts[Arg]
+    OP_CALL,            // evaluate the S-Expression made of the top Arg values
+    OP_TAIL_CALL,       // same as OP_CALL, but reuses the frame for lambdas
+    OP_IF,              // the builtin 'if' is being called, else jump to Arg
+    OP_JUMP_IF_NOT,     // pop the condition, jump to Arg if it is false
+    OP_JUMP,            // jump to Arg
+    OP_RETURN,          // return the top of the stack
+} lop;
+
+typedef struct {
+    uint32_t    Op;
+    uint32_t    Arg;
+} linstr;
+
+// NOTE(daniel): compiled code is immutable and shared between all copies of
+// a lambda, so it is reference counted on its own.
+struct lcode {
+    size_t      Refs;
+
+    size_t      Count;
+    size_t      Capacity;
+    linstr*     Instrs;
+
+    size_t      ConstCount;
+    size_t      ConstCapacity;
+    lval**      Consts;
+};
+
+// NOTE(daniel): one activation of a compiled lambda. Fun is the (shared)
+// lambda being run and Env the activation frame made by lval_bind, both owned
+// by the frame. Kept counts the callers replaced by tail calls whose frames
+// are still visible, they are the next Kept parents of Env. Profiled counts
+// the profiler entries the frame has open, see lprof_tail_call.
+typedef struct {
+    lval*   Fun;
+    lenv*   Env;
+    size_t  Pc;
+    size_t  Kept;
+    size_t  Profiled;
+} lframe;
+
+typedef struct {
+    size_t  Count;
+    size_t  Capacity;
+    lval**  Stack;
+
+    size_t  FrameCount;
+    size_t  FrameCapacity;
+    lframe* Frames;
+} lvm;
+
+// The stack machine of this thread, see lthread.
+_Thread_local lvm* vm = NULL;
+
+// NOTE(daniel): the cache of a lambda wrapped by 'memo', shared by all copies
+// of the wrapper. Results are keyed by the argument list, in a chained hash
+// table (see lval_hash) whose entries are also linked from most to least
+// recently used. With a Limit, the least recently used entry is evicted to
+// make room.
+typedef struct lmemo_entry lmemo_entry;
+
+struct lmemo_entry {
+    size_t          Hash;
+    lval*           Key;
+    lval*           Val;
+    lmemo_entry*    Chain;
+    lmemo_entry*    Newer;
+    lmemo_entry*    Older;
+};
+
+struct lmemo {
+    size_t          Refs;
+    lval*           Fun;
+    size_t          Limit;
 
-    // NOTE(daniel): otherwise, create a new entry
-    ++e->Count;
-    e->Syms = realloc(e->Syms, sizeof(char*) * e->Count);
-    e->Vals = realloc(e->Vals, sizeof(lval*) * e->Count);
+    size_t          Count;
+    size_t          Capacity;
+    lmemo_entry**   Buckets;
+    lmemo_entry*    Newest;
+    lmemo_entry*    Oldest;
+
+    size_t          Hits;
+    size_t          Misses;
+};
 
-    e->Syms[e->Count - 1] = malloc(strlen(k->Sym) + 1);
-    strcpy(e->Syms[e->Count - 1], k->Sym);
+// NOTE(daniel): every symbol name is stored exactly once in the intern table,
+// so two symbols are equal if and only if their Sym pointers are equal.
+//
+// The name is the tail of an lsym, which doubles as the symbol's binding in
+// the root environment. Shadow counts the bindings of the symbol in all other
+// live environments; while it is zero a lookup can go straight to Global
+// instead of walking the (dynamic) chain of frames. Shared is the last
+// parallel job whose workers were given Global, see lpar_share.
+typedef struct {
+    size_t          Shadow;
+    lval*           Global;
+    atomic_size_t   Shared;
+    char            Name[];
+} lsym;
+
+// NOTE(daniel): each interpreter has its own intern table, and with it its
+// own root environment.
+typedef struct {
+    size_t  Count;
+    size_t  Capacity;
+    char**  Names;
+    mtx_t   Lock;
+
+    // Symbols the evaluator looks for itself, interned up front
+    char*   Amp;
+    char*   If;
+} lsymtab;
+
+// The intern table of the interpreter running on this thread, see lthread.
+_Thread_local lsymtab* lsym_table = NULL;
+
+// NOTE(daniel): set on the worker threads of the parallel builtins, which
+// share a frozen environment with the main thread, see lpar. Workers intern
+// under the table's Lock and count the bindings in their own frames apart
+// from Shadow, see lenv_shadow. The shared environment is lpar_env and its
+// parents.
+_Thread_local bool lpar_worker = false;
+_Thread_local lenv* lpar_env = NULL;
+
+// Set on the threads of the worker pool only, not on a thread running chunks
+// itself, see lpar_run.
+_Thread_local bool lpar_pooled = false;
+
+lval* lpar_share(lsym* sym);
+
+size_t lsym_hash_str(char* s, size_t len) {
+    // FNV-1a
+    size_t h = 14695981039346656037ULL;
+
+    for (size_t i = 0; i < len; ++i) {
+        h ^= (unsigned char)s[i];
+        h *= 1099511628211ULL;
+    }
 
-    e->Vals[e->Count - 1] = lval_copy(v);
+    return h;
 }
 
-void lenv_def(lenv* e, lval* k, lval* v) {
-    // NOTE(daniel): go up the parent chain to the root environment.
-    while (e->Parent) e = e->Parent;
+// NOTE(daniel): interned names are never moved or freed, so the address itself
+// is a good hash key. Mix the bits since the low ones are always zero.
+size_t lsym_hash(char* sym) {
+    size_t h = (size_t)sym;
 
-    lenv_put(e, k, v);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+
+    return h;
 }
 
-void lenv_add_builtin(lenv* e, char* name, lbuiltin fun) {
-    lval* k = lval_sym(name);
-    lval* v = lval_fun(name, fun);
+// A map from addresses to numbers, which the writers of images and load
+// caches use to find what they've already written.
+typedef struct {
+    size_t      Count;
+    size_t      Capacity;
+    void**      Keys;
+    uint64_t*   Values;
+} lptrmap;
 
-    lenv_put(e, k, v);
-    lval_free(k);
-    lval_free(v);
+size_t lptrmap_slot(lptrmap* m, void* p) {
+    size_t mask = m->Capacity - 1;
+    size_t i = lsym_hash((char*)p) & mask;
+
+    while (m->Keys[i] && m->Keys[i] != p) i = (i + 1) & mask;
+
+    return i;
 }
 
-lval* lval_num(long x) {
-    lval* v = malloc(sizeof(lval));
+// Returns the number stored for `p`, or 0 if there is none.
+uint64_t lptrmap_get(lptrmap* m, void* p) {
+    if (!m->Count) return 0;
 
-    *v = (lval) { 
-        .Type = LVAL_NUM, 
-        .Num = x,
-    };
+    size_t i = lptrmap_slot(m, p);
 
-    return v;
+    return m->Keys[i] ? m->Values[i] : 0;
 }
 
-lval* lval_err(char* fmt, ...) {
-    lval* v = malloc(sizeof(lval));
+void lptrmap_put(lptrmap* m, void* p, uint64_t value) {
+    // NOTE(daniel): keep the load factor below 1/2.
+    if ((m->Count + 1) * 2 > m->Capacity) {
+        lptrmap old = *m;
 
-    va_list va;
-    va_start(va, fmt);
+        m->Capacity = old.Capacity ? old.Capacity * 2 : 1024;
+        m->Keys = calloc(m->Capacity, sizeof(void*));
+        m->Values = malloc(sizeof(uint64_t) * m->Capacity);
 
-    // should be enough for anybody ;-)
-    char *msg = malloc(512);
+        for (size_t i = 0; i < old.Capacity; ++i) {
+            if (!old.Keys[i]) continue;
 
-    vsnprintf(msg, 511, fmt, va);
+            size_t j = lptrmap_slot(m, old.Keys[i]);
+            m->Keys[j] = old.Keys[i];
+            m->Values[j] = old.Values[i];
+        }
 
-    *v = (lval) {
-        .Type = LVAL_ERR,
-        .Err = realloc(msg, strlen(msg) + 1),
-    };
+        free(old.Keys);
+        free(old.Values);
+    }
 
-    va_end(va);
+    size_t i = lptrmap_slot(m, p);
+    if (!m->Keys[i]) ++m->Count;
 
-    return v;
+    m->Keys[i] = p;
+    m->Values[i] = value;
 }
 
-lval* lval_sym(char* s) {
-    lval* v = malloc(sizeof(lval));
+void lptrmap_free(lptrmap* m) {
+    free(m->Keys);
+    free(m->Values);
+}
 
-    char* sym = malloc(strlen(s) + 1);
-    strcpy(sym, s);
+// A growable run of bytes.
+typedef struct {
+    char*   Data;
+    size_t  Length;
+    size_t  Capacity;
+} lbytes;
+
+// Returns room for `n` more bytes at the end of `b`, for the caller to fill.
+char* lbytes_extend(lbytes* b, size_t n) {
+    if (b->Length + n > b->Capacity) {
+        while (b->Length + n > b->Capacity) b->Capacity = b->Capacity ? b->Capacity * 2 : 4096;
+        b->Data = realloc(b->Data, b->Capacity);
+    }
 
-    *v = (lval) {
-        .Type = LVAL_SYM,
-        .Sym = sym,
-    };
+    char* p = b->Data + b->Length;
+    b->Length += n;
 
-    return v;
+    return p;
 }
 
-lval* lval_str(char* s) {
-    lval* v = malloc(sizeof(lval));
+void lbytes_put(lbytes* b, void* data, size_t n) {
+    memcpy(lbytes_extend(b, n), data, n);
+}
 
-    char* str = malloc(strlen(s) + 1);
-    strcpy(str, s);
+void lbytes_putc(lbytes* b, char c) {
+    *lbytes_extend(b, 1) = c;
+}
 
-    *v = (lval) {
-        .Type = LVAL_STR,
-        .Str = str,
-    };
+void lbytes_puts(lbytes* b, const char* s) {
+    lbytes_put(b, (void*)s, strlen(s));
+}
 
-    return v;
+// Writes `n` in decimal.
+void lbytes_put_num(lbytes* b, int64_t n) {
+    char digits[20];
+    size_t i = sizeof(digits);
+
+    uint64_t u = n < 0 ? -(uint64_t)n : (uint64_t)n;
+
+    do {
+        digits[--i] = '0' + u % 10;
+        u /= 10;
+    } while (u);
+
+    if (n < 0) lbytes_putc(b, '-');
+    lbytes_put(b, digits + i, sizeof(digits) - i);
 }
 
-lval* lval_fun(char* s, lbuiltin fun) {
-    lval* v = malloc(sizeof(lval));
+// The output buffer of this thread, see lthread and lval_fprint.
+_Thread_local lbytes* lout = NULL;
 
-    char* sym = malloc(strlen(s) + 1);
-    strcpy(sym, s);
+void lsym_grow(lsymtab* t) {
+    size_t capacity = t->Capacity ? t->Capacity * 2 : 256;
+    char** names = calloc(capacity, sizeof(char*));
 
-    *v = (lval) {
-        .Type = LVAL_FUN,
-        .Sym = sym,
-        .Builtin = fun,
-    };
+    for (size_t i = 0; i < t->Capacity; ++i) {
+        char* name = t->Names[i];
+        if (!name) continue;
 
-    return v;
+        size_t j = lsym_hash_str(name, strlen(name)) & (capacity - 1);
+        while (names[j]) j = (j + 1) & (capacity - 1);
+
+        names[j] = name;
+    }
+
+    free(t->Names);
+    t->Names = names;
+    t->Capacity = capacity;
 }
 
-lval* lval_lambda(lval* formals, lval* body) {
-    lval* v = malloc(sizeof(lval));
+char* lsym_find_or_add(lsymtab* t, char* s, size_t len) {
+    // NOTE(daniel): keep the load factor below 1/2.
+    if ((t->Count + 1) * 2 > t->Capacity) lsym_grow(t);
 
-    *v = (lval) {
-        .Type = LVAL_FUN,
-        .Builtin = NULL,
-        .Env = lenv_new(),
-        .Formals = formals,
-        .Body = body,
-    };
+    size_t mask = t->Capacity - 1;
+    size_t j = lsym_hash_str(s, len) & mask;
 
-    return v;
+    while (t->Names[j]) {
+        char* name = t->Names[j];
+        if (strncmp(name, s, len) == 0 && name[len] == '\0') return name;
+
+        j = (j + 1) & mask;
+    }
+
+    lsym* sym = malloc(sizeof(lsym) + len + 1);
+    sym->Shadow = 0;
+    sym->Global = NULL;
+    atomic_init(&sym->Shared, 0);
+    memcpy(sym->Name, s, len);
+    sym->Name[len] = '\0';
+
+    t->Names[j] = sym->Name;
+    ++t->Count;
+
+    return sym->Name;
 }
 
-lval* lval_sexpr(void) {
-    lval* v = malloc(sizeof(lval));
+// Interns the `len` characters at `s`, which need not be NUL terminated.
+char* lsym_intern_n(char* s, size_t len) {
+    if (!lpar_worker) return lsym_find_or_add(lsym_table, s, len);
 
-    *v = (lval) {
-        .Type = LVAL_SEXPR,
-        .Count = 0,
-        .Cell = NULL,
-    };
+    mtx_lock(&lsym_table->Lock);
+    char* name = lsym_find_or_add(lsym_table, s, len);
+    mtx_unlock(&lsym_table->Lock);
 
-    return v;
+    return name;
 }
 
-lval* lval_qexpr(void) {
-    lval* v = malloc(sizeof(lval));
+char* lsym_intern(char* s) {
+    return lsym_intern_n(s, strlen(s));
+}
 
-    *v = (lval) {
-        .Type = LVAL_QEXPR,
-        .Count = 0,
-        .Cell = NULL,
-    };
+void lsym_init(lsymtab* t) {
+    mtx_init(&t->Lock, mtx_plain);
 
-    return v;
+    t->Amp = lsym_find_or_add(t, "&", 1);
+    t->If = lsym_find_or_add(t, "if", 2);
 }
 
-void lval_free(lval* v) {
-    switch (v->Type) {
-        case LVAL_NUM: {
-            // nothing to do
-        } break;
-        case LVAL_ERR: {
-            free(v->Err); 
-        } break;
-        case LVAL_FUN: {
-            if (v->Builtin) {
-                free(v->Sym); 
-            } else {
-                lenv_free(v->Env);
-                lval_free(v->Formals);
-                lval_free(v->Body);
-            }
-        } break;
-        case LVAL_SYM: {
-            free(v->Sym); 
-        } break;
-        case LVAL_STR: {
-            free(v->Str);
-        } break;
-        case LVAL_SEXPR: case LVAL_QEXPR: {
-            for (size_t i = 0; i < v->Count; ++i) {
-                lval_free(v->Cell[i]);
-            }
+lsym* lsym_of(char* sym) {
+    return (lsym*)(sym - offsetof(lsym, Name));
+}
 
-            free(v->Cell);
-        } break;
+void lsym_free(lsymtab* t) {
+    for (size_t i = 0; i < t->Capacity; ++i) {
+        if (t->Names[i]) free(lsym_of(t->Names[i]));
     }
 
-    free(v);
+    free(t->Names);
+    mtx_destroy(&t->Lock);
 }
 
-lval* lval_copy(lval *v) {
-    lval* x = malloc(sizeof(lval));
-    x->Type = v->Type;
-
-    switch (v->Type) {
-        case LVAL_NUM: {
-            x->Num = v->Num; 
-        } break;
-        case LVAL_FUN: {
-            if (v->Builtin) {
-                x->Sym = malloc(strlen(v->Sym) + 1);
-                strcpy(x->Sym, v->Sym);
+// NOTE(daniel): lvals and lenvs are allocated from a managed heap. Each type
+// has its own pool of fixed size slabs, and free objects are threaded onto a
+// free list, so allocation is a pointer pop. Slabs are aligned to their size,
+// which lets us find the slab (and its bitmaps) from any object pointer.
+//
+// Reference counting reclaims almost everything as soon as it dies. The
+// tracing collector below is the backstop for whatever it misses (leaked
+// references, cycles); it marks from the root environment and the root
+// stack and sweeps every slab.
+//
+// Each thread allocates from a heap of its own, and an object always goes
+// back to the pool of the slab it came from.
+#define LHEAP_SLAB_SIZE     (64 * 1024)
+#define LHEAP_SLAB_OBJECTS  (LHEAP_SLAB_SIZE / 16)
+#define LHEAP_SLAB_WORDS    (LHEAP_SLAB_OBJECTS / 64)
+
+typedef struct lslab lslab;
+
+typedef struct {
+    size_t  Size;
+    size_t  PerSlab;
+    lslab*  Slabs;
+    void*   Free;
+    size_t  Live;
+    size_t  Allocs;
+} lpool;
+
+struct lslab {
+    lslab*      Next;
+    lpool*      Pool;
+    uint64_t    Used[LHEAP_SLAB_WORDS];
+    uint64_t    Marked[LHEAP_SLAB_WORDS];
+    char*       Objects;
+};
 
-                x->Builtin = v->Builtin;
-            } else {
-                x->Builtin = NULL;
-                x->Env = lenv_copy(v->Env);
-                x->Formals = lval_copy(v->Formals);
-                x->Body = lval_copy(v->Body);
-            }
-        } break;
-        case LVAL_ERR: {
-            x->Err = malloc(strlen(v->Err) + 1);
-            strcpy(x->Err, v->Err);
-        } break;
-        case LVAL_SYM: {
-            x->Sym = malloc(strlen(v->Sym) + 1);
-            strcpy(x->Sym, v->Sym);
-        } break;
-        case LVAL_STR: {
-            x->Str = malloc(strlen(v->Str) + 1);
-            strcpy(x->Str, v->Str);
-        }break;
-        case LVAL_SEXPR: case LVAL_QEXPR: {
-            x->Count = v->Count;
-            x->Cell = malloc(sizeof(lval*) * x->Count);
+typedef struct {
+    lpool   Atoms;
+    lpool   Lvals;
+    lpool   Lenvs;
+
+    // Collection is triggered once Threshold objects have been allocated
+    // since the last one. It only runs at safe points, see lheap_safepoint.
+    size_t  Threshold;
+    size_t  Allocated;
+    size_t  Collections;
+
+    // The explicit root stack and the number of builtins being called. A
+    // safe point is only safe when no builtin is in flight on the C stack.
+    size_t  Depth;
+    size_t  RootCount;
+    size_t  RootCapacity;
+    lval**  Roots;
+} lheap;
+
+// The heap of this thread, see lthread.
+_Thread_local lheap* heap = NULL;
+
+#define LVAL_TYPES (LVAL_MAP + 1)
+
+// NOTE(daniel): counters are always on, they're plain increments. Bytes are
+// those held by lvals, lenvs, expression buffers and strings.
+typedef struct {
+    size_t  Allocs[LVAL_TYPES];
+    size_t  Copies[LVAL_TYPES];
+    size_t  Frees[LVAL_TYPES];
+    size_t  Frames;
+    size_t  CellAllocs;
+    size_t  Bytes;
+    size_t  PeakBytes;
+    size_t  Evals;
+    size_t  Calls;
+    size_t  CacheHits;
+    size_t  CacheMisses;
+} lstats;
+
+// The counters of this thread, see lthread.
+_Thread_local lstats* stats = NULL;
+
+void lstats_alloc(size_t bytes) {
+    stats->Bytes += bytes;
+    if (stats->Bytes > stats->PeakBytes) stats->PeakBytes = stats->Bytes;
+}
 
-            for (size_t i = 0; i < x->Count; ++i) {
-                x->Cell[i] = lval_copy(v->Cell[i]);
-            }
-        } break;
-    }
-    
-    return x;
+void lstats_free(size_t bytes) {
+    stats->Bytes -= bytes;
 }
 
-int lval_eq(lval* x, lval* y) {
-    if (x->Type != y->Type) return 0;
+lslab* lslab_of(void* x) {
+    return (lslab*)((uintptr_t)x & ~(uintptr_t)(LHEAP_SLAB_SIZE - 1));
+}
 
-    switch (x->Type) {
-        case LVAL_NUM: 
-            return x->Num == y->Num;
+size_t lslab_index(lslab* s, void* x) {
+    return ((char*)x - s->Objects) / s->Pool->Size;
+}
 
-        case LVAL_ERR: 
-            return strcmp(x->Err, y->Err) == 0;
-        case LVAL_SYM: 
-            return strcmp(x->Sym, y->Sym) == 0;
-        case LVAL_STR:
-            return strcmp(x->Str, y->Str) == 0;
+void lpool_grow(lpool* p) {
+    lslab* s = aligned_alloc(LHEAP_SLAB_SIZE, LHEAP_SLAB_SIZE);
 
-        case LVAL_FUN: {
-            if (x->Builtin || y->Builtin) {
-                return x->Builtin == y->Builtin;
-            } else {
-                return lval_eq(x->Formals, y->Formals) && lval_eq(x->Body, y->Body);
-            }
-        }
+    if (!s) {
+        fputs("lispy: out of memory\n", stderr);
+        exit(1);
+    }
 
-        case LVAL_SEXPR: case LVAL_QEXPR: {
-            if (x->Count != y->Count) return 0;
+    memset(s, 0, sizeof(lslab));
+    s->Pool = p;
+    s->Objects = (char*)s + ((sizeof(lslab) + 15) & ~(size_t)15);
 
-            for (size_t i = 0; i < x->Count; ++i) {
-                if (!lval_eq(x->Cell[i], y->Cell[i])) return 0;
-            }
+    p->PerSlab = (LHEAP_SLAB_SIZE - (s->Objects - (char*)s)) / p->Size;
+    if (p->PerSlab > LHEAP_SLAB_OBJECTS) p->PerSlab = LHEAP_SLAB_OBJECTS;
 
-            return 1;
-        }
+    // NOTE(daniel): thread the free list so the lowest addresses come first.
+    for (size_t i = p->PerSlab; i-- > 0;) {
+        void* x = s->Objects + i * p->Size;
+        *(void**)x = p->Free;
+        p->Free = x;
     }
 
-    return 0;
+    s->Next = p->Slabs;
+    p->Slabs = s;
 }
 
-lval* lval_add(lval* v, lval* x) {
-    ++v->Count;
-    v->Cell = realloc(v->Cell, sizeof(lval*) * v->Count);
-    v->Cell[v->Count - 1] = x;
+void* lpool_alloc(lpool* p) {
+    if (!p->Free) lpool_grow(p);
 
-    return v;
+    void* x = p->Free;
+    p->Free = *(void**)x;
+
+    lslab* s = lslab_of(x);
+    size_t i = lslab_index(s, x);
+    s->Used[i / 64] |= (uint64_t)1 << (i % 64);
+
+    ++p->Live;
+    ++p->Allocs;
+    ++heap->Allocated;
+    lstats_alloc(p->Size);
+
+    return x;
 }
 
-void lval_expr_print(lval* v, char open, char close) {
-    putchar(open);
+void lpool_free(lpool* p, void* x) {
+    lslab* s = lslab_of(x);
+    size_t i = lslab_index(s, x);
+    s->Used[i / 64] &= ~((uint64_t)1 << (i % 64));
 
-    for (size_t i = 0; i < v->Count; ++i) {
-        lval_print(v->Cell[i]);
+    *(void**)x = p->Free;
+    p->Free = x;
 
-        if (i != (v->Count - 1)) {
-            putchar(' ');
-        }
+    --p->Live;
+    lstats_free(p->Size);
+}
+
+// Reserves at least `bytes` of lval slabs up front.
+void lheap_reserve(size_t bytes) {
+    size_t slabs = (bytes + LHEAP_SLAB_SIZE - 1) / LHEAP_SLAB_SIZE;
+
+    for (size_t i = 0; i < slabs; ++i) lpool_grow(&heap->Lvals);
+}
+
+void lheap_push_root(lval* v) {
+    if (heap->RootCount == heap->RootCapacity) {
+        heap->RootCapacity = heap->RootCapacity ? heap->RootCapacity * 2 : 16;
+        heap->Roots = realloc(heap->Roots, sizeof(lval*) * heap->RootCapacity);
     }
 
-    putchar(close);
+    heap->Roots[heap->RootCount++] = v;
 }
 
-// Possible unescapable characters 
-char* lval_str_unescapable = "abfnrtv\\\'\"";
+void lheap_pop_root(void) {
+    --heap->RootCount;
+}
 
-char lval_str_unescape(char x) {
-    switch (x) {
-        case 'a' : return '\a';
-        case 'b' : return '\b';
-        case 'f' : return '\f';
-        case 'n' : return '\n';
-        case 'r' : return '\r';
-        case 't' : return '\t';
-        case 'v' : return '\v';
-        case '\\': return '\\';
-        case '\'': return '\'';
-        case '\"': return '\"';
-        default  : return '\0';
-    }
+bool lheap_marked(void* x) {
+    lslab* s = lslab_of(x);
+    size_t i = lslab_index(s, x);
+
+    return s->Marked[i / 64] & ((uint64_t)1 << (i % 64));
+}
+
+// Returns true if `x` was not marked before.
+bool lheap_mark(void* x) {
+    lslab* s = lslab_of(x);
+    size_t i = lslab_index(s, x);
+    uint64_t bit = (uint64_t)1 << (i % 64);
+
+    if (s->Marked[i / 64] & bit) return false;
+    s->Marked[i / 64] |= bit;
+
+    return true;
 }
 
-// Possible escapable characters
-char* lval_str_escapable = "\a\b\f\n\r\t\v\\\'\"";
+void lheap_mark_lenv(lenv* e);
+void lheap_mark_lval(lval* v);
+
+void lheap_mark_memo(lmemo* m) {
+    lheap_mark_lval(m->Fun);
 
-char* lval_str_escape(char x) {
-    switch(x) {
-        case '\a': return "\\a";
-        case '\b': return "\\b";
-        case '\f': return "\\f";
-        case '\n': return "\\n";
-        case '\r': return "\\r";
-        case '\t': return "\\t";
-        case '\v': return "\\v";
-        case '\\': return "\\\\";
-        case '\'': return "\\\'";
-        case '\"': return "\\\"";
-        default  : return "";
+    for (lmemo_entry* x = m->Newest; x; x = x->Older) {
+        lheap_mark_lval(x->Key);
+        lheap_mark_lval(x->Val);
     }
 }
 
-void lval_str_print(lval* v) {
-    putchar('"');
+void lheap_mark_hamt(lhamt* n) {
+    if (n->Refs == LREFS_STATIC) return;
 
-    for (size_t i = 0; i < strlen(v->Str); ++i) {
-        if (strchr(lval_str_escapable, v->Str[i])) {
-            printf("%s", lval_str_escape(v->Str[i]));
+    for (uint32_t i = 0; i < n->Count; ++i) {
+        lhamt_slot* s = &n->Slots[i];
+
+        if (s->Key) {
+            lheap_mark_lval(s->Key);
+            lheap_mark_lval(s->Val);
         } else {
-            putchar(v->Str[i]);
+            lheap_mark_hamt(s->Node);
         }
     }
-
-    putchar('"');
 }
 
-void lval_print(lval* v) {
+void lheap_mark_lval(lval* v) {
+    if (lval_is_imm(v) || v->Refs == LVAL_STATIC || !lheap_mark(v)) return;
+
     switch (v->Type) {
-        case LVAL_NUM: {
-            printf("%li", v->Num); 
+        case LVAL_FUN: {
+            lheap_mark_lval(v->Formals);
+            lheap_mark_lval(v->Body);
+            if (v->Args) lheap_mark_lval(v->Args);
+
+            if (v->Code) {
+                for (size_t i = 0; i < v->Code->ConstCount; ++i) {
+                    lheap_mark_lval(v->Code->Consts[i]);
+                }
+            }
+
+            if (v->Memo) lheap_mark_memo(v->Memo);
         } break;
-        case LVAL_ERR: {
-            printf("Error: %s", v->Err);
+        case LVAL_SEXPR: case LVAL_QEXPR: {
+            // NOTE(daniel): the buffer owns the cells outside of the view too.
+            if (v->Buf) {
+                for (size_t i = 0; i < v->Buf->Count; ++i) {
+                    if (v->Buf->Cells[i]) lheap_mark_lval(v->Buf->Cells[i]);
+                }
+            } else {
+                for (size_t i = 0; i < v->Count; ++i) lheap_mark_lval(v->Cell[i]);
+            }
         } break;
-        case LVAL_SYM: {
-            printf("%s", v->Sym);
-        } break;
-        case LVAL_STR: {
-            lval_str_print(v);
+        case LVAL_MAP: {
+            if (v->Hamt) lheap_mark_hamt(v->Hamt);
         } break;
+        default: break;
+    }
+}
+
+// NOTE(daniel): the Parent is not owned by the environment, so it is not
+// traced. At a safe point every live frame is reachable through its owner.
+void lheap_mark_lenv(lenv* e) {
+    if (!lheap_mark(e)) return;
+
+    if (e->Root) {
+        for (size_t i = 0; i < lsym_table->Capacity; ++i) {
+            char* name = lsym_table->Names[i];
+
+            if (name && lsym_of(name)->Global) lheap_mark_lval(lsym_of(name)->Global);
+        }
+    }
+
+    if (e->Params) {
+        lheap_mark_lval(e->Params);
+
+        for (size_t i = 0; i < e->Params->Count; ++i) {
+            if (e->Slots[i]) lheap_mark_lval(e->Slots[i]);
+        }
+    }
+
+    for (size_t i = 0; i < e->Capacity; ++i) {
+        if (e->Syms[i]) lheap_mark_lval(e->Vals[i]);
+    }
+}
+
+// Calls `fun` for every allocated but unmarked object in the pool.
+void lpool_each_garbage(lpool* p, void (*fun)(void*)) {
+    for (lslab* s = p->Slabs; s; s = s->Next) {
+        for (size_t w = 0; w < LHEAP_SLAB_WORDS; ++w) {
+            uint64_t garbage = s->Used[w] & ~s->Marked[w];
+
+            while (garbage) {
+                size_t i = w * 64 + __builtin_ctzll(garbage);
+                garbage &= garbage - 1;
+
+                fun(s->Objects + i * p->Size);
+            }
+        }
+    }
+}
+
+// A live value loses the reference held by a dead one.
+void lheap_unref(lval* v) {
+    if (!lval_is_imm(v) && v->Refs != LVAL_STATIC && lheap_marked(v)) --v->Refs;
+}
+
+// NOTE(daniel): a node dies with its last owner, dead or alive.
+void lheap_unref_hamt(lhamt* n) {
+    if (n->Refs == LREFS_STATIC || --n->Refs > 0) return;
+
+    for (uint32_t i = 0; i < n->Count; ++i) {
+        lhamt_slot* s = &n->Slots[i];
+
+        if (s->Key) {
+            lheap_unref(s->Key);
+            lheap_unref(s->Val);
+        } else {
+            lheap_unref_hamt(s->Node);
+        }
+    }
+
+    lstats_free(lhamt_size(n->Count));
+    free(n);
+}
+
+void lheap_unref_lval(void* x) {
+    lval* v = x;
+
+    switch (v->Type) {
         case LVAL_FUN: {
-            if (v->Builtin) {
-                printf("<builtin '%s'>", v->Sym);
-            } else {
-                printf("(\\ "); 
-                lval_print(v->Formals);
-                putchar(' ');
-                lval_print(v->Body);
-                putchar(')');
+            lheap_unref(v->Formals);
+            lheap_unref(v->Body);
+            if (v->Args) lheap_unref(v->Args);
+
+            // NOTE(daniel): the code dies with its last owner, dead or alive.
+            if (v->Code && v->Code->Refs != LREFS_STATIC && --v->Code->Refs == 0) {
+                for (size_t i = 0; i < v->Code->ConstCount; ++i) {
+                    lheap_unref(v->Code->Consts[i]);
+                }
+
+                free(v->Code->Instrs);
+                free(v->Code->Consts);
+                free(v->Code);
+            }
+
+            // NOTE(daniel): and so does the cache.
+            if (v->Memo && v->Memo->Refs != LREFS_STATIC && --v->Memo->Refs == 0) {
+                lheap_unref(v->Memo->Fun);
+
+                for (lmemo_entry* m = v->Memo->Newest; m;) {
+                    lmemo_entry* older = m->Older;
+
+                    lheap_unref(m->Key);
+                    lheap_unref(m->Val);
+                    lstats_free(sizeof(lmemo_entry));
+                    free(m);
+
+                    m = older;
+                }
+
+                free(v->Memo->Buckets);
+                free(v->Memo);
             }
         } break;
-        case LVAL_SEXPR: {
-            lval_expr_print(v, '(', ')');
+        case LVAL_SEXPR: case LVAL_QEXPR: {
+            // NOTE(daniel): the buffer dies with its last view, dead or alive.
+            if (v->Buf) {
+                if (v->Buf->Refs == LREFS_STATIC || --v->Buf->Refs > 0) break;
+
+                for (size_t i = 0; i < v->Buf->Count; ++i) {
+                    if (v->Buf->Cells[i]) lheap_unref(v->Buf->Cells[i]);
+                }
+
+                lstats_free(lbuf_size(v->Buf->Capacity));
+                free(v->Buf);
+            } else {
+                for (size_t i = 0; i < v->Count; ++i) lheap_unref(v->Cell[i]);
+            }
         } break;
-        case LVAL_QEXPR: {
-            lval_expr_print(v, '{', '}');
+        case LVAL_MAP: {
+            if (v->Hamt) lheap_unref_hamt(v->Hamt);
         } break;
+        default: break;
     }
 }
 
-void lval_println(lval* v) {
-    lval_print(v);
-    putchar('\n');
+void lheap_unref_lenv(void* x) {
+    lenv* e = x;
+
+    if (e->Params) {
+        for (size_t i = 0; i < e->Params->Count; ++i) {
+            if (!e->Slots[i]) continue;
+
+            --lsym_of(e->Params->Cell[i]->Sym)->Shadow;
+            lheap_unref(e->Slots[i]);
+        }
+
+        lheap_unref(e->Params);
+    }
+
+    for (size_t i = 0; i < e->Capacity; ++i) {
+        if (!e->Syms[i]) continue;
+
+        --lsym_of(e->Syms[i])->Shadow;
+        lheap_unref(e->Vals[i]);
+    }
 }
 
-lval* lval_eval(lenv* e, lval* v) {
+void lheap_sweep_lval(void* x) {
+    lval* v = x;
+
     switch (v->Type) {
-        case LVAL_SYM: {
-            lval* x = lenv_get(e, v);
-            lval_free(v);
+        case LVAL_ERR: lstats_free(strlen(v->Err) + 1); free(v->Err); break;
+        case LVAL_STR: lstrbuf_free(v->StrBuf); break;
+        case LVAL_VEC: lstats_free(lvec_size(v->Vec->Count)); free(v->Vec); break;
+        default: break;
+    }
 
-            return x;
+    ++stats->Frees[v->Type];
+    lpool_free(lslab_of(v)->Pool, v);
+}
+
+void lheap_sweep_lenv(void* x) {
+    lenv* e = x;
+
+    if (e->Params && e->Slots != e->Inline) free(e->Slots);
+    free(e->Syms);
+    free(e->Vals);
+
+    lpool_free(&heap->Lenvs, e);
+}
+
+void lheap_collect(lenv* root) {
+    lpool* pools[] = { &heap->Atoms, &heap->Lvals, &heap->Lenvs };
+
+    for (size_t i = 0; i < 3; ++i) {
+        for (lslab* s = pools[i]->Slabs; s; s = s->Next) {
+            memset(s->Marked, 0, sizeof(s->Marked));
         }
-        case LVAL_SEXPR: 
-            return lval_eval_sexpr(e, v);
-        case LVAL_NUM: case LVAL_ERR: case LVAL_FUN: case LVAL_QEXPR: 
-        default:
-            return v;
     }
+
+    lheap_mark_lenv(root);
+    limage_mark();
+
+    for (size_t i = 0; i < heap->RootCount; ++i) {
+        lheap_mark_lval(heap->Roots[i]);
+    }
+
+    // NOTE(daniel): first drop the references dead objects hold on live ones,
+    // then release the dead objects without following their children, since
+    // those are either live or dead themselves.
+    lpool_each_garbage(&heap->Lvals, lheap_unref_lval);
+    lpool_each_garbage(&heap->Lenvs, lheap_unref_lenv);
+    lpool_each_garbage(&heap->Atoms, lheap_sweep_lval);
+    lpool_each_garbage(&heap->Lvals, lheap_sweep_lval);
+    lpool_each_garbage(&heap->Lenvs, lheap_sweep_lenv);
+
+    heap->Allocated = 0;
+    ++heap->Collections;
 }
 
-lval* lval_pop(lval* v, int i) {
-    lval* result = v->Cell[i];
+// Called between top level expressions. Only collects when the threshold has
+// been reached and nothing is being evaluated.
+void lheap_safepoint(lenv* root) {
+    if (heap->Depth == 0 && heap->Threshold && heap->Allocated >= heap->Threshold) {
+        lheap_collect(root);
+    }
+}
 
-    // Shift the memory after the item at "i" over the top
-    memmove(&v->Cell[i], &v->Cell[i+1], sizeof(lval*) * (v->Count-i-1));
+typedef struct {
+    char    Name[32];
+    size_t  Value;
+} lstat_value;
+
+#define LSTATS_MAX (3 * LVAL_TYPES + 16)
+
+// Lists the counters under the names used by --stats and the stats builtin.
+size_t lstats_list(lstat_value* out) {
+    static char* const types[LVAL_TYPES] = { "err", "num", "sym", "str", "fun", "sexpr", "qexpr", "vec", "map" };
+    size_t n = 0;
+
+    #define LSTAT(name, value) out[n++] = (lstat_value) { .Name = name, .Value = value }
+
+    LSTAT("allocs", heap->Atoms.Allocs + heap->Lvals.Allocs + heap->Lenvs.Allocs);
+    LSTAT("lval_allocs", heap->Atoms.Allocs + heap->Lvals.Allocs);
+    LSTAT("lenv_allocs", heap->Lenvs.Allocs);
+    LSTAT("lval_live", heap->Atoms.Live + heap->Lvals.Live);
+    LSTAT("lenv_live", heap->Lenvs.Live);
+    LSTAT("frames", stats->Frames);
+    LSTAT("cell_allocs", stats->CellAllocs);
+    LSTAT("bytes_live", stats->Bytes);
+    LSTAT("bytes_peak", stats->PeakBytes);
+    LSTAT("evals", stats->Evals);
+    LSTAT("calls", stats->Calls);
+    LSTAT("load_cache_hits", stats->CacheHits);
+    LSTAT("load_cache_misses", stats->CacheMisses);
+    LSTAT("collections", heap->Collections);
+
+    #undef LSTAT
+
+    size_t* counts[] = { stats->Allocs, stats->Copies, stats->Frees };
+    char* kinds[] = { "allocs", "copies", "frees" };
+
+    for (size_t k = 0; k < 3; ++k) {
+        for (size_t t = 0; t < LVAL_TYPES; ++t) {
+            snprintf(out[n].Name, sizeof(out[n].Name), "%s_%s", types[t], kinds[k]);
+            out[n++].Value = counts[k][t];
+        }
+    }
 
-    v->Count--;
-    v->Cell = realloc(v->Cell, sizeof(lval*) * v->Count);
+    return n;
+}
 
-    return result;
+// Zeroes the counters, except for what is currently live.
+void lstats_reset(void) {
+    size_t bytes = stats->Bytes;
+
+    *stats = (lstats) { .Bytes = bytes, .PeakBytes = bytes };
+    heap->Atoms.Allocs = 0;
+    heap->Lvals.Allocs = 0;
+    heap->Lenvs.Allocs = 0;
+    heap->Collections = 0;
 }
 
-lval* lval_take(lval* v, int i) {
-    lval* result = lval_pop(v, i);
-    lval_free(v);
+// Prints the counters as name=value lines, for --stats.
+void lstats_print(void) {
+    if (!stats) return;
 
-    return result;
+    lstat_value list[LSTATS_MAX];
+    size_t n = lstats_list(list);
+
+    // Buffered output comes first, or it may end up in the middle of a line
+    fflush(stdout);
+
+    for (size_t i = 0; i < n; ++i) {
+        fprintf(stderr, "%s=%zu\n", list[i].Name, list[i].Value);
+    }
 }
 
-lval* lval_join(lval* x, lval* y) {
-    while (y->Count) {
-        x = lval_add(x, lval_pop(y, 0));
+// NOTE(daniel): the profiler (--profile=FILE) times every call of a lambda or
+// builtin. Lambdas are known by the name they were first defined under, or
+// by their formals when anonymous. Calls are recorded in a call tree, which
+// is written to FILE in collapsed stack format (one line per stack with its
+// self time in nanoseconds) for flame graph tools, and a summary per
+// function is printed at exit. When off, each hook is a single branch. A
+// tail call doesn't end the caller's entry, see lprof_tail_call.
+// Calls made on the worker threads of the parallel builtins aren't profiled.
+typedef struct lprof_node lprof_node;
+
+struct lprof_node {
+    char*       Name;
+    lprof_node* Parent;
+    lprof_node* Child;
+    lprof_node* Next;
+    uint64_t    Self;
+};
+
+typedef struct {
+    char*       Name;
+    size_t      Calls;
+    size_t      Active;
+    uint64_t    Inclusive;
+    uint64_t    Exclusive;
+} lprof_fun;
+
+typedef struct {
+    lprof_fun*  Fun;
+    uint64_t    Start;
+    uint64_t    Children;
+} lprof_entry;
+
+typedef struct {
+    bool            Enabled;
+    char*           Path;
+    lprof_node      Root;
+    lprof_node*     Current;
+    size_t          Count;
+    size_t          Capacity;
+    lprof_entry*    Entries;
+    size_t          FunCount;
+    size_t          FunCapacity;
+    lprof_fun**     Funs;
+} lprof;
+
+// The profile of this thread, see lthread.
+_Thread_local lprof* prof = NULL;
+
+uint64_t lprof_now(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Returns the name `f` is profiled under, interned so it can be compared by
+// address.
+char* lprof_name(lval* f) {
+    if (lval_is_imm(f)) return lsym_intern(lval_builtin_entry(f)->Name);
+    if (f->Sym) return f->Sym;
+
+    char name[256] = "\\ {";
+    lval* params = f->Formals;
+
+    for (size_t i = 0; i < params->Count; ++i) {
+        size_t length = strlen(name);
+        snprintf(name + length, sizeof(name) - length, i ? " %s" : "%s", params->Cell[i]->Sym);
     }
 
-    lval_free(y);
+    size_t length = strlen(name);
+    snprintf(name + length, sizeof(name) - length, "}");
 
-    return x; 
+    return lsym_intern(name);
 }
 
-#define LASSERT(args, cond, ...)            \
-    if (!(cond)) {                          \
-        lval* err = lval_err(__VA_ARGS__);  \
-        lval_free(args);                    \
-        return err;                         \
+// NOTE(daniel): the entries of running calls point at their function, so
+// functions are allocated one by one and only the table of them moves.
+lprof_fun* lprof_fun_of(char* name) {
+    // NOTE(daniel): keep the load factor below 1/2.
+    if ((prof->FunCount + 1) * 2 > prof->FunCapacity) {
+        size_t capacity = prof->FunCapacity ? prof->FunCapacity * 2 : 64;
+        lprof_fun** funs = calloc(capacity, sizeof(lprof_fun*));
+
+        for (size_t i = 0; i < prof->FunCapacity; ++i) {
+            if (!prof->Funs[i]) continue;
+
+            size_t j = lsym_hash(prof->Funs[i]->Name) & (capacity - 1);
+            while (funs[j]) j = (j + 1) & (capacity - 1);
+
+            funs[j] = prof->Funs[i];
+        }
+
+        free(prof->Funs);
+        prof->Funs = funs;
+        prof->FunCapacity = capacity;
     }
 
-#define LASSERT_COUNT(args, name, count)          \
-    LASSERT(args, args->Count == count,           \
-        "Function '%s' passed incorrect number of arguments. Got %i, Expected %i.", \
-        name, args->Count, count);
+    size_t mask = prof->FunCapacity - 1;
+    size_t j = lsym_hash(name) & mask;
 
-#define LASSERT_TYPE(args, name, i, type)         \
-    LASSERT(args, args->Cell[i]->Type == type,    \
-        "Function '%s' passed incorrect type for argument %i. Got %s, Expected %s.", \
-        name, i, lval_type_name(args->Cell[i]->Type), lval_type_name(type));
+    while (prof->Funs[j] && prof->Funs[j]->Name != name) j = (j + 1) & mask;
 
-lval* builtin_head(lenv* e, lval* a) {
-    (void)e;
+    if (!prof->Funs[j]) {
+        prof->Funs[j] = calloc(1, sizeof(lprof_fun));
+        prof->Funs[j]->Name = name;
+        ++prof->FunCount;
+    }
 
-    LASSERT_COUNT(a, "head", 1);
-    LASSERT_TYPE(a, "head", 0, LVAL_QEXPR);
-    LASSERT(a, a->Cell[0]->Count != 0, 
-        "Function 'head' passed {}");
+    return prof->Funs[j];
+}
 
-    lval* result = lval_take(a, 0);
+void lprof_enter(lval* f) {
+    char* name = lprof_name(f);
 
-    while (result->Count > 1) lval_free(lval_pop(result, 1));
+    lprof_node* node = prof->Current->Child;
+    while (node && node->Name != name) node = node->Next;
 
-    return result;
+    if (!node) {
+        node = calloc(1, sizeof(lprof_node));
+        node->Name = name;
+        node->Parent = prof->Current;
+        node->Next = prof->Current->Child;
+        prof->Current->Child = node;
+    }
+
+    prof->Current = node;
+
+    if (prof->Count == prof->Capacity) {
+        prof->Capacity = prof->Capacity ? prof->Capacity * 2 : 64;
+        prof->Entries = realloc(prof->Entries, sizeof(lprof_entry) * prof->Capacity);
+    }
+
+    lprof_fun* fun = lprof_fun_of(name);
+    ++fun->Calls;
+    ++fun->Active;
+
+    prof->Entries[prof->Count++] = (lprof_entry) { .Fun = fun, .Start = lprof_now() };
 }
 
-lval* builtin_tail(lenv* e, lval* a) {
-    (void)e;
+void lprof_exit(void) {
+    lprof_entry* entry = &prof->Entries[--prof->Count];
 
-    LASSERT_COUNT(a, "tail", 1);
-    LASSERT_TYPE(a, "tail", 0, LVAL_QEXPR);
-    LASSERT(a, a->Cell[0]->Count != 0, 
-        "Function 'head' passed {}");
+    uint64_t inclusive = lprof_now() - entry->Start;
+    uint64_t exclusive = inclusive - entry->Children;
 
-    lval* result = lval_take(a, 0);
+    // NOTE(daniel): recursive calls are already part of the outermost one.
+    if (--entry->Fun->Active == 0) entry->Fun->Inclusive += inclusive;
+    entry->Fun->Exclusive += exclusive;
 
-    lval_free(lval_pop(result, 0));
+    if (prof->Count) prof->Entries[prof->Count - 1].Children += inclusive;
 
-    return result;
+    prof->Current->Self += exclusive;
+    prof->Current = prof->Current->Parent;
 }
 
-lval* builtin_list(lenv* e, lval* a) {
-    (void)e;
+// Records a tail call to `f` made by a VM frame with `*open` entries on the
+// profiler stack. The frame is replaced but its entries stay open, so the
+// callee is profiled as a call from the lambda that made the tail call. If
+// `f` already has an entry of the frame (a tail recursive loop), the entries
+// above it are closed and it is counted as called again, so a loop doesn't
+// grow the stack.
+void lprof_tail_call(lval* f, size_t* open) {
+    char* name = lprof_name(f);
+
+    for (size_t i = prof->Count; i > prof->Count - *open; --i) {
+        lprof_entry* entry = &prof->Entries[i - 1];
+        if (entry->Fun->Name != name) continue;
+
+        while (prof->Count > i) {
+            lprof_exit();
+            --*open;
+        }
 
-    a->Type = LVAL_QEXPR;
+        ++entry->Fun->Calls;
+        return;
+    }
 
-    return a;
+    lprof_enter(f);
+    ++*open;
 }
 
-lval* builtin_eval(lenv* e, lval* v) {
-    LASSERT_COUNT(v, "eval", 1);
-    LASSERT_TYPE(v, "eval", 0, LVAL_QEXPR);
+void lprof_write_stacks(FILE* f, lprof_node* node, char* path, size_t length) {
+    for (lprof_node* child = node->Child; child; child = child->Next) {
+        size_t name_length = strlen(child->Name);
+        size_t n = length + (length ? 1 : 0) + name_length;
 
-    lval* x = lval_take(v, 0);
-    x->Type = LVAL_SEXPR;
+        char* child_path = malloc(n + 1);
+        memcpy(child_path, path, length);
+        if (length) child_path[length] = ';';
+        memcpy(child_path + n - name_length, child->Name, name_length + 1);
 
-    return lval_eval(e, x);
+        if (child->Self) fprintf(f, "%s %llu\n", child_path, (unsigned long long)child->Self);
+
+        lprof_write_stacks(f, child, child_path, n);
+        free(child_path);
+    }
 }
 
-lval* builtin_join(lenv* e, lval* a) {
-    (void)e;
+int lprof_compare(const void* a, const void* b) {
+    const lprof_fun* x = a;
+    const lprof_fun* y = b;
 
-    for (size_t i = 0; i < a->Count; ++i) {
-        LASSERT_TYPE(a, "join", i, LVAL_QEXPR);
+    return (x->Exclusive < y->Exclusive) - (x->Exclusive > y->Exclusive);
+}
+
+// Writes the collapsed stacks, and prints the functions by exclusive time.
+void lprof_report(void) {
+    if (!prof) return;
+
+    FILE* f = fopen(prof->Path, "w");
+    if (f) {
+        lprof_write_stacks(f, &prof->Root, "", 0);
+        fclose(f);
+    } else {
+        fprintf(stderr, "Could not write profile %s\n", prof->Path);
     }
 
-    lval* result = lval_pop(a, 0);
+    lprof_fun* funs = malloc(sizeof(lprof_fun) * (prof->FunCount + 1));
+    size_t n = 0;
 
-    while (a->Count) {
-        result = lval_join(result, lval_pop(a, 0));
+    for (size_t i = 0; i < prof->FunCapacity; ++i) {
+        if (prof->Funs[i]) funs[n++] = *prof->Funs[i];
     }
 
-    lval_free(a);
+    qsort(funs, n, sizeof(lprof_fun), lprof_compare);
 
-    return result;
+    fprintf(stderr, "calls\tinclusive_ms\texclusive_ms\tfunction\n");
+    for (size_t i = 0; i < n; ++i) {
+        fprintf(stderr, "%zu\t%.3f\t%.3f\t%s\n",
+            funs[i].Calls, funs[i].Inclusive / 1e6, funs[i].Exclusive / 1e6, funs[i].Name);
+    }
+
+    free(funs);
 }
 
-lval* builtin_var(lenv* e, lval* a, char* fun) {
-    LASSERT_TYPE(a, "def", 0, LVAL_QEXPR);
-    
-    lval* Syms = a->Cell[0];
+void lprof_start(char* path) {
+    prof->Enabled = true;
+    prof->Path = path;
+    prof->Current = &prof->Root;
 
-    for (size_t i = 0; i < Syms->Count; ++i) {
-        LASSERT(a, (Syms->Cell[i]->Type == LVAL_SYM), 
-            "Function 'def' cannot define non-symbol. Got %s, Expected %s.",
-            lval_type_name(Syms->Cell[i]->Type), lval_type_name(LVAL_SYM));
+    atexit(lprof_report);
+}
+
+void lprof_free_node(lprof_node* node) {
+    for (lprof_node* child = node->Child; child;) {
+        lprof_node* next = child->Next;
+
+        lprof_free_node(child);
+        free(child);
+
+        child = next;
     }
+}
 
-    LASSERT(a, Syms->Count == a->Count-1, 
-        "Function 'def' cannot define incorrect number of values. Got %i, Expected %i.",
-        Syms->Count, a->Count-1);
+void lprof_free(lprof* p) {
+    lprof_free_node(&p->Root);
+    free(p->Entries);
 
-    for (size_t i = 0; i < Syms->Count; ++i) {
-        if (strcmp(fun, "def") == 0) {
-            lenv_def(e, Syms->Cell[i], a->Cell[i+1]);
-        } else if (strcmp(fun, "=") == 0) {
-            lenv_put(e, Syms->Cell[i], a->Cell[i+1]);
-        }
+    for (size_t i = 0; i < p->FunCapacity; ++i) free(p->Funs[i]);
+    free(p->Funs);
+}
+
+lenv* lenv_new(void) {
+    lenv* e = lpool_alloc(&heap->Lenvs);
+
+    *e = (lenv) {
+        .Parent   = NULL,
+        .Root     = false,
+        .Params   = NULL,
+        .Slots    = NULL,
+        .Count    = 0,
+        .Capacity = 0,
+        .Syms     = NULL,
+        .Vals     = NULL,
+    };
+
+    return e;
+}
+
+// Returns true if `e` is part of the environment shared by parallel workers.
+bool lenv_shared(lenv* e) {
+    for (lenv* s = lpar_env; s; s = s->Parent) {
+        if (s == e) return true;
     }
 
-    lval_free(a);
+    return false;
+}
 
-    return lval_sexpr();
+lenv* lenv_new_root(void) {
+    lenv* e = lenv_new();
+    e->Root = true;
+
+    return e;
 }
 
-lval* builtin_def(lenv* e, lval* a) {
-    return builtin_var(e, a, "def");
+lval** lenv_alloc_slots(lenv* e, size_t count) {
+    if (count <= LENV_INLINE_SLOTS) return e->Inline;
+
+    return malloc(sizeof(lval*) * count);
 }
 
-lval* builtin_put(lenv* e, lval* a) {
-    return builtin_var(e, a, "=");
+// Creates the activation frame for a call to a lambda with the given formals.
+lenv* lenv_new_frame(lval* params) {
+    lenv* e = lenv_new();
+    ++stats->Frames;
+
+    e->Params = lval_copy(params);
+    e->Slots = lenv_alloc_slots(e, params->Count);
+
+    for (size_t i = 0; i < params->Count; ++i) e->Slots[i] = NULL;
+
+    return e;
 }
 
-lval* builtin_lambda(lenv* e, lval* a) {
-    (void)e;
+size_t lenv_slot_count(lenv* e) {
+    return e->Params ? e->Params->Count : 0;
+}
 
-    LASSERT_COUNT(a, "\\", 2);
-    LASSERT_TYPE(a, "\\", 0, LVAL_QEXPR);
-    LASSERT_TYPE(a, "\\", 1, LVAL_QEXPR);
+char* lenv_slot_sym(lenv* e, size_t i) {
+    return e->Params->Cell[i]->Sym;
+}
 
-    for (size_t i = 0; i < a->Cell[0]->Count; ++i) {
-        LASSERT(a, (a->Cell[0]->Cell[i]->Type == LVAL_SYM), 
-            "Cannot define non-symbol. Got %s, Expected %s.",
-            lval_type_name(a->Cell[0]->Cell[i]->Type), lval_type_name(LVAL_SYM));
+// The Shadow counts of a worker thread, an open-addressed hash table like the
+// bindings of an lenv.
+typedef struct {
+    size_t  Count;
+    size_t  Capacity;
+    char**  Syms;
+    size_t* Shadow;
+} lshadow;
+
+// The Shadow counts of this thread, only used on workers, see lthread.
+_Thread_local lshadow* lpar_shadow = NULL;
+
+size_t lshadow_slot(char* sym) {
+    size_t mask = lpar_shadow->Capacity - 1;
+    size_t i = lsym_hash(sym) & mask;
+
+    while (lpar_shadow->Syms[i] && lpar_shadow->Syms[i] != sym) i = (i + 1) & mask;
+
+    return i;
+}
+
+void lshadow_grow(void) {
+    lshadow old = *lpar_shadow;
+
+    lpar_shadow->Capacity = old.Capacity ? old.Capacity * 2 : 64;
+    lpar_shadow->Syms = calloc(lpar_shadow->Capacity, sizeof(char*));
+    lpar_shadow->Shadow = malloc(sizeof(size_t) * lpar_shadow->Capacity);
+
+    for (size_t i = 0; i < old.Capacity; ++i) {
+        if (!old.Syms[i]) continue;
+
+        size_t j = lshadow_slot(old.Syms[i]);
+        lpar_shadow->Syms[j] = old.Syms[i];
+        lpar_shadow->Shadow[j] = old.Shadow[i];
     }
 
-    lval* formals = lval_pop(a, 0);
-    lval* body = lval_pop(a, 0);
+    free(old.Syms);
+    free(old.Shadow);
+}
 
-    lval_free(a);
+// Counts a binding of `sym` in a frame, `delta` is 1 or -1.
+void lenv_shadow(char* sym, int delta) {
+    if (!lpar_worker) {
+        lsym_of(sym)->Shadow += delta;
+        return;
+    }
+
+    // NOTE(daniel): keep the load factor below 1/2.
+    if ((lpar_shadow->Count + 1) * 2 > lpar_shadow->Capacity) lshadow_grow();
+
+    size_t i = lshadow_slot(sym);
+
+    if (!lpar_shadow->Syms[i]) {
+        lpar_shadow->Syms[i] = sym;
+        lpar_shadow->Shadow[i] = 0;
+        ++lpar_shadow->Count;
+    }
+
+    lpar_shadow->Shadow[i] += delta;
+}
+
+// Returns true if any frame, on this thread or a shared one, binds `sym`.
+bool lenv_shadowed(char* sym) {
+    if (lsym_of(sym)->Shadow) return true;
+    if (!lpar_worker || !lpar_shadow->Count) return false;
+
+    size_t i = lshadow_slot(sym);
+
+    return lpar_shadow->Syms[i] && lpar_shadow->Shadow[i];
+}
+
+// NOTE(daniel): the state of a thread running an interpreter, which is either
+// the thread that called into it or one of the workers of its parallel
+// builtins. Each part is reached through a thread-local pointer (heap, stats,
+// prof, vm, lpar_shadow, lout) set by lthread_enter, along with those to the parts
+// of the interpreter itself (lsym_table, par).
+typedef struct {
+    lispy*  Lispy;
+    lheap   Heap;
+    lstats  Stats;
+    lprof   Prof;
+    lvm     Vm;
+    lshadow Shadow;
+    lbytes  Out;
+} lthread;
+
+// NOTE(daniel): an interpreter owns its intern table, and so its root
+// environment, its worker pool and the state of the thread calling into it.
+// The builtin table is the only thing interpreters share, see lval_builtins.
+struct lispy {
+    lsymtab     Syms;
+    lenv*       Root;
+    lpar*       Par;
+    lthread     Main;
+    limage*     Images;
+
+    bool        TreeWalk;
+    FILE*       Out;
+
+    // Where load caches go: NULL for nowhere, "" for next to the files, see
+    // lcache_read
+    char*       Cache;
+
+    // The printed result of the last API call, see lispy_result
+    char*       Result;
+};
+
+// The interpreter running on this thread, and its worker pool
+_Thread_local lispy* lispy_current = NULL;
+_Thread_local lpar* par = NULL;
+
+void lthread_init(lthread* t, lispy* l) {
+    *t = (lthread) {
+        .Lispy = l,
+        .Heap = {
+            .Atoms = { .Size = LVAL_ATOM_SIZE },
+            .Lvals = { .Size = sizeof(lval) },
+            .Lenvs = { .Size = sizeof(lenv) },
+            .Threshold = 1 << 20,
+        },
+    };
+}
+
+void lthread_enter(lthread* t) {
+    lispy_current = t->Lispy;
+    lsym_table = &t->Lispy->Syms;
+    par = t->Lispy->Par;
+
+    heap = &t->Heap;
+    stats = &t->Stats;
+    prof = &t->Prof;
+    vm = &t->Vm;
+    lpar_shadow = &t->Shadow;
+    lout = &t->Out;
+}
+
+void lthread_leave(void) {
+    lispy_current = NULL;
+    lsym_table = NULL;
+    par = NULL;
+
+    heap = NULL;
+    stats = NULL;
+    prof = NULL;
+    vm = NULL;
+    lpar_shadow = NULL;
+    lout = NULL;
+}
+
+// Frees the slabs of the heap, whatever is left in them, and the buffers of
+// the thread.
+void lthread_free(lthread* t) {
+    lpool* pools[] = { &t->Heap.Atoms, &t->Heap.Lvals, &t->Heap.Lenvs };
+
+    for (size_t i = 0; i < 3; ++i) {
+        for (lslab* s = pools[i]->Slabs; s;) {
+            lslab* next = s->Next;
+            free(s);
+            s = next;
+        }
+    }
+
+    free(t->Heap.Roots);
+    free(t->Out.Data);
+    lprof_free(&t->Prof);
+    free(t->Vm.Stack);
+    free(t->Vm.Frames);
+    free(t->Shadow.Syms);
+    free(t->Shadow.Shadow);
+}
+
+void lenv_free(lenv* e) {
+    for (size_t i = 0; i < lenv_slot_count(e); ++i) {
+        if (!e->Slots[i]) continue;
+
+        lenv_shadow(lenv_slot_sym(e, i), -1);
+        lval_free(e->Slots[i]);
+    }
+
+    for (size_t i = 0; i < e->Capacity; ++i) {
+        if (!e->Syms[i]) continue;
+
+        lenv_shadow(e->Syms[i], -1);
+        lval_free(e->Vals[i]);
+    }
+
+    if (e->Params) {
+        if (e->Slots != e->Inline) free(e->Slots);
+        lval_free(e->Params);
+    }
+
+    // NOTE(daniel): don't free the Parent, it's not owned by this environment.
+    free(e->Syms);
+    free(e->Vals);
+    lpool_free(&heap->Lenvs, e);
+}
+
+// Returns the slot holding `sym`, or the empty slot where it would be inserted.
+size_t lenv_slot(lenv* e, char* sym) {
+    size_t mask = e->Capacity - 1;
+    size_t i = lsym_hash(sym) & mask;
+
+    while (e->Syms[i] && e->Syms[i] != sym) i = (i + 1) & mask;
+
+    return i;
+}
+
+void lenv_grow(lenv* e) {
+    size_t capacity = e->Capacity ? e->Capacity * 2 : 8;
+
+    char** syms = e->Syms;
+    lval** vals = e->Vals;
+    size_t old  = e->Capacity;
+
+    e->Capacity = capacity;
+    e->Syms = calloc(capacity, sizeof(char*));
+    e->Vals = malloc(sizeof(lval*) * capacity);
+
+    for (size_t i = 0; i < old; ++i) {
+        if (!syms[i]) continue;
+
+        size_t j = lenv_slot(e, syms[i]);
+        e->Syms[j] = syms[i];
+        e->Vals[j] = vals[i];
+    }
+
+    free(syms);
+    free(vals);
+}
+
+// Returns the index of the formal `sym`, or -1.
+ptrdiff_t lenv_param(lenv* e, char* sym) {
+    for (size_t i = 0; i < lenv_slot_count(e); ++i) {
+        if (lenv_slot_sym(e, i) == sym) return i;
+    }
+
+    return -1;
+}
+
+// Returns the value bound to `sym` in the root environment, or NULL. On the
+// threads of the worker pool it is frozen first, see lpar_share.
+lval* lsym_global(lsym* sym) {
+    if (lpar_pooled && sym->Global) return lpar_share(sym);
+
+    return sym->Global;
+}
+
+// Returns the value bound to `sym` in this frame only, or NULL.
+lval* lenv_lookup(lenv* e, char* sym) {
+    if (e->Root) return lsym_global(lsym_of(sym));
+
+    ptrdiff_t p = lenv_param(e, sym);
+    if (p >= 0) return e->Slots[p];
+
+    if (e->Count == 0) return NULL;
+
+    size_t i = lenv_slot(e, sym);
+
+    return e->Syms[i] ? e->Vals[i] : NULL;
+}
+
+lval* lenv_get(lenv* e, lval* k) {
+    lsym* sym = lsym_of(k->Sym);
+
+    // NOTE(daniel): nothing but the root binds this symbol, skip the frames.
+    if (!lenv_shadowed(k->Sym)) {
+        lval* v = lsym_global(sym);
+        if (v) return lval_copy(v);
+    } else {
+        for (; e; e = e->Parent) {
+            lval* v = lenv_lookup(e, k->Sym);
+
+            if (v) return lval_copy(v);
+        }
+    }
+
+    return lval_err("Unbound symbol '%s'", k->Sym);
+}
+
+void lenv_put(lenv* e, lval* k, lval* v) {
+    lsym* sym = lsym_of(k->Sym);
+    lval** cell = NULL;
+
+    if (e->Root) {
+        cell = &sym->Global;
+    } else {
+        ptrdiff_t p = lenv_param(e, k->Sym);
+
+        if (p >= 0) {
+            cell = &e->Slots[p];
+        } else {
+            // NOTE(daniel): keep the load factor below 3/4.
+            if ((e->Count + 1) * 4 > e->Capacity * 3) lenv_grow(e);
+
+            size_t i = lenv_slot(e, k->Sym);
+
+            if (!e->Syms[i]) {
+                e->Syms[i] = k->Sym;
+                e->Vals[i] = NULL;
+                ++e->Count;
+            }
+
+            cell = &e->Vals[i];
+        }
+
+        if (!*cell) lenv_shadow(k->Sym, 1);
+    }
+
+    // NOTE(daniel): if the symbol already exists, free the old value and replace it.
+    if (*cell) lval_free(*cell);
+
+    *cell = lval_copy(v);
+}
+
+void lenv_def(lenv* e, lval* k, lval* v) {
+    // NOTE(daniel): go up the parent chain to the root environment.
+    while (e->Parent) e = e->Parent;
+
+    lenv_put(e, k, v);
+}
+
+void lenv_add_builtin(lenv* e, char* name, lbuiltin fun) {
+    lval* k = lval_sym(name);
+    lval* v = lval_fun(name, fun);
+
+    lenv_put(e, k, v);
+    lval_free(k);
+    lval_free(v);
+}
+
+size_t lbuf_size(size_t capacity) {
+    return sizeof(lbuf) + sizeof(lval*) * capacity;
+}
+
+lbuf* lbuf_new(size_t capacity) {
+    lbuf* b = malloc(lbuf_size(capacity));
+
+    ++stats->CellAllocs;
+    lstats_alloc(lbuf_size(capacity));
+
+    b->Refs = 1;
+    b->Count = 0;
+    b->Capacity = capacity;
+
+    return b;
+}
+
+void lbuf_free(lbuf* b) {
+    if (b->Refs >= LREFS_FROZEN || --b->Refs > 0) return;
+
+    for (size_t i = 0; i < b->Count; ++i) {
+        if (b->Cells[i]) lval_free(b->Cells[i]);
+    }
+
+    lstats_free(lbuf_size(b->Capacity));
+    free(b);
+}
+
+// Releases the cells of the expression `v`: its buffer, or its inline cells.
+void lval_free_cells(lval* v) {
+    if (v->Buf) {
+        lbuf_free(v->Buf);
+        return;
+    }
+
+    for (size_t i = 0; i < v->Count; ++i) lval_free(v->Cell[i]);
+}
+
+// Gives `v` a private buffer holding exactly the cells of its view.
+void lval_rebuffer(lval* v, size_t capacity) {
+    lbuf* b = lbuf_new(capacity);
+
+    // NOTE(daniel): inline cells are owned by `v` alone, so they can move.
+    if (v->Buf) {
+        for (size_t i = 0; i < v->Count; ++i) b->Cells[i] = lval_copy(v->Cell[i]);
+
+        lbuf_free(v->Buf);
+    } else if (v->Count) {
+        memcpy(b->Cells, v->Cell, sizeof(lval*) * v->Count);
+    }
+
+    b->Count = v->Count;
+
+    v->Buf = b;
+    v->Cell = b->Cells;
+}
+
+// Makes room to append `n` cells to the (unshared) expression `v`.
+void lval_reserve(lval* v, size_t n) {
+    lbuf* b = v->Buf;
+
+    if (!b && v->Count + n <= LVAL_INLINE_CELLS) {
+        if (v->Cell != v->Inline) {
+            if (v->Count) memmove(v->Inline, v->Cell, sizeof(lval*) * v->Count);
+            v->Cell = v->Inline;
+        }
+
+        return;
+    }
+
+    bool owned = b && b->Refs == 1 && v->Cell + v->Count == b->Cells + b->Count;
+
+    if (owned && b->Count + n <= b->Capacity) return;
+
+    // NOTE(daniel): an expression that already has cells is likely to keep
+    // growing, so leave room to amortize the copies.
+    size_t capacity = v->Count + n;
+    if (b || v->Count) capacity *= 2;
+    if (capacity < 4) capacity = 4;
+
+    if (owned && v->Cell == b->Cells) {
+        ++stats->CellAllocs;
+        lstats_free(lbuf_size(b->Capacity));
+        lstats_alloc(lbuf_size(capacity));
+
+        b = realloc(b, lbuf_size(capacity));
+        b->Capacity = capacity;
+
+        v->Buf = b;
+        v->Cell = b->Cells;
+    } else {
+        lval_rebuffer(v, capacity);
+    }
+}
+
+// Makes sure the cells of the (unshared) expression `v` can be written in place.
+void lval_own_cells(lval* v) {
+    if (v->Buf && v->Buf->Refs > 1) lval_rebuffer(v, v->Count);
+}
+
+// Returns a new expression viewing `count` cells of `v` from `offset`.
+lval* lval_slice(lval* v, size_t offset, size_t count) {
+    if (!v->Buf) {
+        lval* x = v->Type == LVAL_SEXPR ? lval_sexpr() : lval_qexpr();
+
+        for (size_t i = 0; i < count; ++i) x->Inline[i] = lval_copy(v->Cell[offset + i]);
+
+        x->Cell = x->Inline;
+        x->Count = count;
+
+        return x;
+    }
+
+    lval* x = lval_clone(v);
+
+    x->Cell += offset;
+    x->Count = count;
+
+    return x;
+}
+
+lpool* lval_pool(lval_type type) {
+    switch (type) {
+        case LVAL_NUM: case LVAL_ERR: case LVAL_SYM: case LVAL_VEC:
+            return &heap->Atoms;
+        default:
+            return &heap->Lvals;
+    }
+}
+
+lval* lval_alloc(lval_type type) {
+    ++stats->Allocs[type];
+
+    return lpool_alloc(lval_pool(type));
+}
+
+lval* lval_num(long x) {
+    if (x >= LVAL_FIX_MIN && x <= LVAL_FIX_MAX) {
+        return (lval*)(((uintptr_t)x << LVAL_TAG_BITS) | LVAL_TAG_NUM);
+    }
+
+    lval* v = lval_alloc(LVAL_NUM);
+
+    v->Type = LVAL_NUM;
+    v->Refs = 1;
+    v->Num = x;
+
+    return v;
+}
+
+lval* lval_err(char* fmt, ...) {
+    lval* v = lval_alloc(LVAL_ERR);
+
+    va_list va;
+    va_start(va, fmt);
+
+    // NOTE(daniel): format on the stack, so only the message is allocated.
+    // Should be enough for anybody ;-)
+    char buffer[512];
+    vsnprintf(buffer, sizeof(buffer), fmt, va);
+
+    size_t length = strlen(buffer);
+    char* msg = malloc(length + 1);
+    memcpy(msg, buffer, length + 1);
+    lstats_alloc(length + 1);
+
+    v->Type = LVAL_ERR;
+    v->Refs = 1;
+    v->Err = msg;
+
+    va_end(va);
+
+    return v;
+}
+
+// Returns a symbol for the interned name `sym`.
+lval* lval_sym_interned(char* sym) {
+    lval* v = lval_alloc(LVAL_SYM);
+
+    v->Type = LVAL_SYM;
+    v->Refs = 1;
+    v->Sym = sym;
+
+    return v;
+}
+
+lval* lval_sym_n(char* s, size_t len) {
+    return lval_sym_interned(lsym_intern_n(s, len));
+}
+
+lval* lval_sym(char* s) {
+    return lval_sym_n(s, strlen(s));
+}
+
+size_t lstrbuf_size(size_t capacity) {
+    return sizeof(lstrbuf) + capacity + 1;
+}
+
+lstrbuf* lstrbuf_new(size_t capacity) {
+    lstrbuf* b = malloc(lstrbuf_size(capacity));
+    lstats_alloc(lstrbuf_size(capacity));
+
+    b->Refs = 0;
+    b->Length = 0;
+    b->Capacity = capacity;
+    b->Data[0] = '\0';
+
+    return b;
+}
+
+void lstrbuf_free(lstrbuf* b) {
+    if (b->Refs >= LREFS_FROZEN || --b->Refs > 0) return;
+
+    lstats_free(lstrbuf_size(b->Capacity));
+    free(b);
+}
+
+// Returns a string viewing the `len` characters at `s` in the buffer `b`.
+lval* lval_str_view(lstrbuf* b, char* s, size_t len) {
+    lval* v = lval_alloc(LVAL_STR);
+
+    v->Type = LVAL_STR;
+    v->Refs = 1;
+    v->StrBuf = b;
+    v->Str = s;
+    v->Length = len;
+
+    if (b->Refs < LREFS_FROZEN) ++b->Refs;
+
+    return v;
+}
+
+// Returns a new string that starts with the characters of `x` and has room
+// for `n` more at `*tail`, for the caller to fill in. They go into the room
+// after the buffer of `x` if `x` ends where its characters do, so that buffer
+// is shared. Otherwise the result gets a new buffer, with room to spare if
+// `x` isn't empty, which keeps building a string by repeated concat linear.
+lval* lval_str_extend(lval* x, size_t n, char** tail) {
+    lstrbuf* b = x->StrBuf;
+
+    if (!n) {
+        *tail = x->Str + x->Length;
+        return lval_copy(x);
+    }
+
+    // NOTE(daniel): frozen buffers are read by the workers, and images are
+    // read only.
+    bool end = b->Refs < LREFS_FROZEN && x->Str + x->Length == b->Data + b->Length;
+
+    if (!end || b->Length + n > b->Capacity) {
+        size_t capacity = x->Length + n;
+        if (x->Length) capacity *= 2;
+
+        b = lstrbuf_new(capacity);
+        memcpy(b->Data, x->Str, x->Length);
+        b->Length = x->Length;
+    }
+
+    lval* v = lval_str_view(b, b->Data + b->Length - x->Length, x->Length + n);
+
+    *tail = b->Data + b->Length;
+    b->Length += n;
+    b->Data[b->Length] = '\0';
+
+    return v;
+}
+
+lval* lval_str_n(char* s, size_t len) {
+    lstrbuf* b = lstrbuf_new(len);
+
+    memcpy(b->Data, s, len);
+    b->Data[len] = '\0';
+    b->Length = len;
+
+    return lval_str_view(b, b->Data, len);
+}
+
+lval* lval_str(char* s) {
+    return lval_str_n(s, strlen(s));
+}
+
+bool lval_str_is(lval* v, char* s) {
+    size_t length = strlen(s);
+
+    return v->Length == length && memcmp(v->Str, s, length) == 0;
+}
+
+size_t lvec_size(size_t count) {
+    return sizeof(lvec) + sizeof(int64_t) * count;
+}
+
+// Returns a vector of `count` elements, left uninitialized, or an error if
+// there isn't memory for it.
+lval* lval_vec(size_t count) {
+    if (count > (SIZE_MAX - sizeof(lvec)) / sizeof(int64_t)) {
+        return lval_err("Vector of %zu elements is too large.", count);
+    }
+
+    lvec* x = malloc(lvec_size(count));
+    if (!x) return lval_err("Out of memory for a vector of %zu elements.", count);
+
+    lval* v = lval_alloc(LVAL_VEC);
+
+    v->Type = LVAL_VEC;
+    v->Refs = 1;
+    v->Vec = x;
+    v->Vec->Count = count;
+    lstats_alloc(lvec_size(count));
+
+    return v;
+}
+
+// Returns the immediate for the builtin `fun` named `s`.
+lval* lval_fun(char* s, lbuiltin fun) {
+    call_once(&lval_builtins.Once, lval_builtins_init);
+
+    for (size_t i = 0; i < lval_builtins.Count; ++i) {
+        lbuiltin_entry* entry = &lval_builtins.Entries[i];
+
+        if (entry->Fun == fun && strcmp(entry->Name, s) == 0) {
+            return (lval*)((i << LVAL_TAG_BITS) | LVAL_TAG_BUILTIN);
+        }
+    }
+
+    fprintf(stderr, "lispy: %s is not in the builtin table\n", s);
+    exit(1);
+}
+
+// Returns the immediate for the builtin named `s`, or NULL if there is none.
+lval* lval_builtin_named(char* s) {
+    call_once(&lval_builtins.Once, lval_builtins_init);
+
+    for (size_t i = 0; i < lval_builtins.Count; ++i) {
+        if (strcmp(lval_builtins.Entries[i].Name, s) == 0) {
+            return (lval*)((i << LVAL_TAG_BITS) | LVAL_TAG_BUILTIN);
+        }
+    }
+
+    return NULL;
+}
+
+lval* lval_lambda(lval* formals, lval* body) {
+    lval* v = lval_alloc(LVAL_FUN);
+
+    *v = (lval) {
+        .Type = LVAL_FUN,
+        .Refs = 1,
+        .Formals = formals,
+        .Body = body,
+        .Code = lcode_compile(formals, body),
+        .Args = NULL,
+        .Memo = NULL,
+    };
+
+    return v;
+}
+
+lval* lval_sexpr(void) {
+    lval* v = lval_alloc(LVAL_SEXPR);
+
+    *v = (lval) {
+        .Type = LVAL_SEXPR,
+        .Refs = 1,
+        .Buf = NULL,
+        .Count = 0,
+        .Cell = NULL,
+    };
+
+    return v;
+}
+
+lval* lval_qexpr(void) {
+    lval* v = lval_alloc(LVAL_QEXPR);
+
+    *v = (lval) {
+        .Type = LVAL_QEXPR,
+        .Refs = 1,
+        .Buf = NULL,
+        .Count = 0,
+        .Cell = NULL,
+    };
+
+    return v;
+}
+
+void lval_free(lval* v) {
+    // NOTE(daniel): only the last owner actually releases the value.
+    if (lval_is_imm(v) || v->Refs >= LVAL_FROZEN || --v->Refs > 0) return;
+
+    ++stats->Frees[v->Type];
+
+    switch (v->Type) {
+        case LVAL_NUM: {
+            // nothing to do
+        } break;
+        case LVAL_ERR: {
+            lstats_free(strlen(v->Err) + 1);
+            free(v->Err); 
+        } break;
+        case LVAL_FUN: {
+            lval_free(v->Formals);
+            lval_free(v->Body);
+            if (v->Code) lcode_free(v->Code);
+            if (v->Args) lval_free(v->Args);
+            if (v->Memo) lmemo_free(v->Memo);
+        } break;
+        case LVAL_SYM: {
+            // nothing to do, symbols are interned
+        } break;
+        case LVAL_STR: {
+            lstrbuf_free(v->StrBuf);
+        } break;
+        case LVAL_SEXPR: case LVAL_QEXPR: {
+            lval_free_cells(v);
+        } break;
+        case LVAL_VEC: {
+            lstats_free(lvec_size(v->Vec->Count));
+            free(v->Vec);
+        } break;
+        case LVAL_MAP: {
+            if (v->Hamt) lhamt_free(v->Hamt);
+        } break;
+    }
+
+    lpool_free(lslab_of(v)->Pool, v);
+}
+
+lval* lval_copy(lval *v) {
+    if (lval_is_imm(v) || v->Refs >= LVAL_FROZEN) return v;
+
+    ++v->Refs;
+    ++stats->Copies[v->Type];
+
+    return v;
+}
+
+// Makes a private copy of the top level of `v`. Children are shared.
+lval* lval_clone(lval *v) {
+    // NOTE(daniel): immediates are values, there is nothing to share.
+    if (lval_is_imm(v)) return v;
+
+    lval* x = lval_alloc(v->Type);
+    x->Type = v->Type;
+    x->Refs = 1;
+
+    switch (v->Type) {
+        case LVAL_NUM: {
+            x->Num = v->Num; 
+        } break;
+        case LVAL_FUN: {
+            x->Sym = v->Sym;
+            x->Formals = lval_copy(v->Formals);
+            x->Body = lval_copy(v->Body);
+            x->Code = v->Code;
+            x->Args = v->Args ? lval_copy(v->Args) : NULL;
+            x->Memo = v->Memo;
+
+            if (x->Code && x->Code->Refs < LREFS_FROZEN) ++x->Code->Refs;
+            if (x->Memo && x->Memo->Refs < LREFS_FROZEN) ++x->Memo->Refs;
+        } break;
+        case LVAL_ERR: {
+            x->Err = malloc(strlen(v->Err) + 1);
+            strcpy(x->Err, v->Err);
+            lstats_alloc(strlen(x->Err) + 1);
+        } break;
+        case LVAL_SYM: {
+            x->Sym = v->Sym;
+        } break;
+        case LVAL_STR: {
+            x->StrBuf = v->StrBuf;
+            x->Str = v->Str;
+            x->Length = v->Length;
+
+            if (x->StrBuf->Refs < LREFS_FROZEN) ++x->StrBuf->Refs;
+        } break;
+        case LVAL_SEXPR: case LVAL_QEXPR: {
+            x->Buf = v->Buf;
+            x->Count = v->Count;
+            x->Cell = v->Cell;
+
+            if (x->Buf) {
+                if (x->Buf->Refs < LREFS_FROZEN) ++x->Buf->Refs;
+            } else {
+                for (size_t i = 0; i < v->Count; ++i) x->Inline[i] = lval_copy(v->Cell[i]);
+
+                x->Cell = x->Inline;
+            }
+        } break;
+        case LVAL_VEC: {
+            x->Vec = malloc(lvec_size(v->Vec->Count));
+            memcpy(x->Vec, v->Vec, lvec_size(v->Vec->Count));
+            lstats_alloc(lvec_size(v->Vec->Count));
+        } break;
+        case LVAL_MAP: {
+            x->Hamt = v->Hamt;
+            x->Size = v->Size;
+
+            if (x->Hamt && x->Hamt->Refs < LREFS_FROZEN) ++x->Hamt->Refs;
+        } break;
+    }
+    
+    return x;
+}
+
+lval* lval_unshare(lval* v) {
+    if (lval_is_imm(v) || v->Refs == 1) return v;
+
+    lval* x = lval_clone(v);
+    lval_free(v);
+
+    return x;
+}
+
+int lval_eq(lval* x, lval* y) {
+    if (lval_type_of(x) != lval_type_of(y)) return 0;
+
+    switch (lval_type_of(x)) {
+        case LVAL_NUM: 
+            return lval_num_of(x) == lval_num_of(y);
+
+        case LVAL_ERR: 
+            return strcmp(x->Err, y->Err) == 0;
+        case LVAL_SYM: 
+            return x->Sym == y->Sym;
+        case LVAL_STR:
+            return x->Length == y->Length && (x->Str == y->Str || memcmp(x->Str, y->Str, x->Length) == 0);
+
+        case LVAL_FUN: {
+            if (lval_is_imm(x) || lval_is_imm(y)) {
+                return lval_builtin_of(x) == lval_builtin_of(y);
+            } else {
+                if (x->Memo != y->Memo) return 0;
+
+                if (!x->Args || !y->Args) {
+                    if (x->Args != y->Args) return 0;
+                } else if (!lval_eq(x->Args, y->Args)) {
+                    return 0;
+                }
+
+                return lval_eq(x->Formals, y->Formals) && lval_eq(x->Body, y->Body);
+            }
+        }
+
+        case LVAL_SEXPR: case LVAL_QEXPR: {
+            if (x->Count != y->Count) return 0;
+            if (x->Cell == y->Cell) return 1;
+
+            for (size_t i = 0; i < x->Count; ++i) {
+                if (!lval_eq(x->Cell[i], y->Cell[i])) return 0;
+            }
+
+            return 1;
+        }
+
+        case LVAL_VEC:
+            return x->Vec->Count == y->Vec->Count
+                && memcmp(x->Vec->Data, y->Vec->Data, sizeof(int64_t) * x->Vec->Count) == 0;
+
+        case LVAL_MAP:
+            return x->Size == y->Size && lhamt_subset(x->Hamt, y->Hamt);
+    }
+
+    return 0;
+}
+
+size_t lval_hash_mix(size_t h, size_t x) {
+    return h ^ (x + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2));
+}
+
+// Hashes `v` by content, so that values equal under lval_eq hash the same.
+size_t lval_hash(lval* v) {
+    lval_type type = lval_type_of(v);
+    size_t h = type;
+
+    switch (type) {
+        case LVAL_NUM:
+            return lsym_hash((char*)(uintptr_t)lval_num_of(v)) ^ h;
+
+        case LVAL_ERR:
+            return lsym_hash_str(v->Err, strlen(v->Err)) ^ h;
+        case LVAL_SYM:
+            return lsym_hash(v->Sym) ^ h;
+        case LVAL_STR:
+            return lsym_hash_str(v->Str, v->Length) ^ h;
+
+        case LVAL_FUN: {
+            if (lval_is_imm(v)) return lsym_hash((char*)(uintptr_t)lval_builtin_of(v)) ^ h;
+
+            h = lval_hash_mix(h, lval_hash(v->Formals));
+            h = lval_hash_mix(h, lval_hash(v->Body));
+            if (v->Args) h = lval_hash_mix(h, lval_hash(v->Args));
+            if (v->Memo) h = lval_hash_mix(h, lsym_hash((char*)v->Memo));
+
+            return h;
+        }
+
+        case LVAL_SEXPR: case LVAL_QEXPR: {
+            for (size_t i = 0; i < v->Count; ++i) {
+                h = lval_hash_mix(h, lval_hash(v->Cell[i]));
+            }
+
+            return h;
+        }
+
+        case LVAL_VEC:
+            return lsym_hash_str((char*)v->Vec->Data, sizeof(int64_t) * v->Vec->Count) ^ h;
+
+        case LVAL_MAP:
+            return lval_hash_mix(h, lhamt_hash(v->Hamt));
+    }
+
+    return h;
+}
+
+lmemo* lmemo_new(lval* f, size_t limit) {
+    lmemo* m = calloc(1, sizeof(lmemo));
+
+    m->Refs = 1;
+    m->Fun = f;
+    m->Limit = limit;
+
+    return m;
+}
+
+void lmemo_unlink(lmemo* m, lmemo_entry* x) {
+    if (x->Newer) x->Newer->Older = x->Older; else m->Newest = x->Older;
+    if (x->Older) x->Older->Newer = x->Newer; else m->Oldest = x->Newer;
+}
+
+void lmemo_link(lmemo* m, lmemo_entry* x) {
+    x->Newer = NULL;
+    x->Older = m->Newest;
+
+    if (m->Newest) m->Newest->Newer = x; else m->Oldest = x;
+    m->Newest = x;
+}
+
+void lmemo_free_entry(lmemo_entry* x) {
+    lval_free(x->Key);
+    lval_free(x->Val);
+    lstats_free(sizeof(lmemo_entry));
+    free(x);
+}
+
+void lmemo_free(lmemo* m) {
+    if (m->Refs >= LREFS_FROZEN || --m->Refs > 0) return;
+
+    for (lmemo_entry* x = m->Newest; x;) {
+        lmemo_entry* older = x->Older;
+        lmemo_free_entry(x);
+        x = older;
+    }
+
+    lval_free(m->Fun);
+    free(m->Buckets);
+    free(m);
+}
+
+// Returns the cached result for the arguments `a`, or NULL on a miss. A hit
+// becomes the most recently used entry.
+lval* lmemo_get(lmemo* m, lval* a, size_t hash) {
+    if (!m->Capacity) return NULL;
+
+    for (lmemo_entry* x = m->Buckets[hash & (m->Capacity - 1)]; x; x = x->Chain) {
+        if (x->Hash != hash || !lval_eq(x->Key, a)) continue;
+
+        lmemo_unlink(m, x);
+        lmemo_link(m, x);
+
+        return lval_copy(x->Val);
+    }
+
+    return NULL;
+}
+
+void lmemo_remove(lmemo* m, lmemo_entry* x) {
+    lmemo_entry** p = &m->Buckets[x->Hash & (m->Capacity - 1)];
+    while (*p != x) p = &(*p)->Chain;
+
+    *p = x->Chain;
+    lmemo_unlink(m, x);
+    --m->Count;
+
+    lmemo_free_entry(x);
+}
+
+// Caches `val` for the arguments `a`, evicting the least recently used entry
+// when the cache is full. Takes ownership of both.
+void lmemo_put(lmemo* m, lval* a, size_t hash, lval* val) {
+    if (m->Limit && m->Count == m->Limit) lmemo_remove(m, m->Oldest);
+
+    // NOTE(daniel): keep the load factor at most 1.
+    if (m->Count == m->Capacity) {
+        size_t capacity = m->Capacity ? m->Capacity * 2 : 16;
+        lmemo_entry** buckets = calloc(capacity, sizeof(lmemo_entry*));
+
+        for (size_t i = 0; i < m->Capacity; ++i) {
+            for (lmemo_entry* x = m->Buckets[i]; x;) {
+                lmemo_entry* next = x->Chain;
+                size_t j = x->Hash & (capacity - 1);
+
+                x->Chain = buckets[j];
+                buckets[j] = x;
+                x = next;
+            }
+        }
+
+        free(m->Buckets);
+        m->Buckets = buckets;
+        m->Capacity = capacity;
+    }
+
+    lmemo_entry* x = malloc(sizeof(lmemo_entry));
+    lstats_alloc(sizeof(lmemo_entry));
+
+    size_t j = hash & (m->Capacity - 1);
+
+    *x = (lmemo_entry) { .Hash = hash, .Key = a, .Val = val, .Chain = m->Buckets[j] };
+    m->Buckets[j] = x;
+    lmemo_link(m, x);
+    ++m->Count;
+}
+
+size_t lhamt_size(size_t count) {
+    return sizeof(lhamt) + sizeof(lhamt_slot) * count;
+}
+
+lhamt* lhamt_new(uint32_t bitmap, uint32_t count) {
+    lhamt* n = malloc(lhamt_size(count));
+    lstats_alloc(lhamt_size(count));
+
+    n->Refs = 1;
+    n->Bitmap = bitmap;
+    n->Count = count;
+
+    return n;
+}
+
+lhamt* lhamt_share(lhamt* n) {
+    if (n->Refs < LREFS_FROZEN) ++n->Refs;
+
+    return n;
+}
+
+void lhamt_free(lhamt* n) {
+    if (n->Refs >= LREFS_FROZEN || --n->Refs > 0) return;
+
+    for (uint32_t i = 0; i < n->Count; ++i) {
+        lhamt_slot* s = &n->Slots[i];
+
+        if (s->Key) {
+            lval_free(s->Key);
+            lval_free(s->Val);
+        } else {
+            lhamt_free(s->Node);
+        }
+    }
+
+    lstats_free(lhamt_size(n->Count));
+    free(n);
+}
+
+lhamt_slot lhamt_slot_share(lhamt_slot s) {
+    if (s.Key) {
+        lval_copy(s.Key);
+        lval_copy(s.Val);
+    } else {
+        lhamt_share(s.Node);
+    }
+
+    return s;
+}
+
+// Copies `n` with the given bitmap, sharing its slots, except the one at
+// `at`: it is left out (delta -1), left for the caller to fill (delta 0) or
+// a new slot is made room for there (delta 1).
+lhamt* lhamt_copy(lhamt* n, uint32_t bitmap, uint32_t at, int delta) {
+    lhamt* x = lhamt_new(bitmap, n->Count + delta);
+
+    for (uint32_t i = 0; i < at; ++i) x->Slots[i] = lhamt_slot_share(n->Slots[i]);
+
+    for (uint32_t i = at + (delta <= 0), j = at + (delta >= 0); i < n->Count; ++i, ++j) {
+        x->Slots[j] = lhamt_slot_share(n->Slots[i]);
+    }
+
+    return x;
+}
+
+uint32_t lhamt_bit(size_t hash, size_t depth) {
+    return 1u << ((hash >> (depth * LHAMT_BITS)) & LHAMT_MASK);
+}
+
+uint32_t lhamt_index(lhamt* n, uint32_t bit) {
+    return __builtin_popcount(n->Bitmap & (bit - 1));
+}
+
+// Returns the value bound to `key`, which hashes to `hash`, or NULL.
+lval* lhamt_get(lhamt* n, size_t hash, lval* key) {
+    for (size_t depth = 0; n; ++depth) {
+        if (depth == LHAMT_LEVELS) {
+            for (uint32_t i = 0; i < n->Count; ++i) {
+                if (lval_eq(n->Slots[i].Key, key)) return n->Slots[i].Val;
+            }
+
+            return NULL;
+        }
+
+        uint32_t bit = lhamt_bit(hash, depth);
+        if (!(n->Bitmap & bit)) return NULL;
+
+        lhamt_slot* s = &n->Slots[lhamt_index(n, bit)];
+
+        if (s->Key) return s->Hash == hash && lval_eq(s->Key, key) ? s->Val : NULL;
+
+        n = s->Node;
+    }
+
+    return NULL;
+}
+
+// Returns a copy of the node `n` at `depth`, or of the empty node if NULL,
+// with `key` bound to `val`. Takes ownership of both. Sets `added` if the key
+// wasn't bound before.
+lhamt* lhamt_put(lhamt* n, size_t depth, size_t hash, lval* key, lval* val, bool* added) {
+    lhamt_slot slot = { .Hash = hash, .Key = key, .Val = val };
+
+    if (depth == LHAMT_LEVELS) {
+        uint32_t count = n ? n->Count : 0;
+        uint32_t at = 0;
+
+        while (at < count && !lval_eq(n->Slots[at].Key, key)) ++at;
+
+        lhamt* x = !n ? lhamt_new(0, 1) : lhamt_copy(n, 0, at, at == count);
+
+        if (at < count) {
+            slot.Key = lval_copy(n->Slots[at].Key);
+            lval_free(key);
+        } else {
+            *added = true;
+        }
+
+        x->Slots[at] = slot;
+
+        return x;
+    }
+
+    uint32_t bit = lhamt_bit(hash, depth);
+
+    if (!n) {
+        lhamt* x = lhamt_new(bit, 1);
+
+        x->Slots[0] = slot;
+        *added = true;
+
+        return x;
+    }
+
+    if (!(n->Bitmap & bit)) {
+        uint32_t at = lhamt_index(n, bit);
+        lhamt* x = lhamt_copy(n, n->Bitmap | bit, at, 1);
+
+        x->Slots[at] = slot;
+        *added = true;
+
+        return x;
+    }
+
+    uint32_t at = lhamt_index(n, bit);
+    lhamt_slot* s = &n->Slots[at];
+    lhamt* x = lhamt_copy(n, n->Bitmap, at, 0);
+
+    if (!s->Key) {
+        x->Slots[at] = (lhamt_slot) { .Node = lhamt_put(s->Node, depth + 1, hash, key, val, added) };
+    } else if (s->Hash == hash && lval_eq(s->Key, key)) {
+        slot.Key = lval_copy(s->Key);
+        lval_free(key);
+
+        x->Slots[at] = slot;
+    } else {
+        // Move the key that is there down into a new node, next to the new one
+        bool moved = false;
+        lhamt* child = lhamt_put(NULL, depth + 1, s->Hash, lval_copy(s->Key), lval_copy(s->Val), &moved);
+
+        x->Slots[at] = (lhamt_slot) { .Node = lhamt_put(child, depth + 1, hash, key, val, added) };
+        lhamt_free(child);
+    }
+
+    return x;
+}
+
+// Returns a copy of the node `n` at `depth` without `key`, or NULL if that
+// leaves it empty. Sets `removed` if the key was bound, otherwise `n` itself
+// is returned, shared.
+lhamt* lhamt_del(lhamt* n, size_t depth, size_t hash, lval* key, bool* removed) {
+    if (depth == LHAMT_LEVELS) {
+        for (uint32_t i = 0; i < n->Count; ++i) {
+            if (!lval_eq(n->Slots[i].Key, key)) continue;
+
+            *removed = true;
+
+            return n->Count == 1 ? NULL : lhamt_copy(n, 0, i, -1);
+        }
+
+        return lhamt_share(n);
+    }
+
+    uint32_t bit = lhamt_bit(hash, depth);
+    if (!(n->Bitmap & bit)) return lhamt_share(n);
+
+    uint32_t at = lhamt_index(n, bit);
+    lhamt_slot* s = &n->Slots[at];
+    lhamt* child = NULL;
+
+    if (s->Key) {
+        if (s->Hash != hash || !lval_eq(s->Key, key)) return lhamt_share(n);
+
+        *removed = true;
+    } else {
+        child = lhamt_del(s->Node, depth + 1, hash, key, removed);
+
+        if (!*removed) {
+            lhamt_free(child);
+            return lhamt_share(n);
+        }
+    }
+
+    if (!child) return n->Count == 1 ? NULL : lhamt_copy(n, n->Bitmap & ~bit, at, -1);
+
+    // NOTE(daniel): a child left with a single key is replaced by the key, a
+    // lookup finds it by its full hash at any depth.
+    lhamt* x = lhamt_copy(n, n->Bitmap, at, 0);
+
+    if (child->Count == 1 && child->Slots[0].Key) {
+        x->Slots[at] = lhamt_slot_share(child->Slots[0]);
+        lhamt_free(child);
+    } else {
+        x->Slots[at] = (lhamt_slot) { .Node = child };
+    }
+
+    return x;
+}
+
+// Returns true if every key of `x` is bound to an equal value in `y`.
+bool lhamt_subset(lhamt* x, lhamt* y) {
+    if (!x || x == y) return true;
+
+    for (uint32_t i = 0; i < x->Count; ++i) {
+        lhamt_slot* s = &x->Slots[i];
+
+        if (!s->Key) {
+            if (!lhamt_subset(s->Node, y)) return false;
+            continue;
+        }
+
+        lval* v = lhamt_get(y, s->Hash, s->Key);
+        if (!v || !lval_eq(v, s->Val)) return false;
+    }
+
+    return true;
+}
+
+// Hashes the entries of `n` whatever their order, which depends on the shape
+// of the trie, so that equal maps hash the same.
+size_t lhamt_hash(lhamt* n) {
+    size_t h = 0;
+
+    for (uint32_t i = 0; n && i < n->Count; ++i) {
+        lhamt_slot* s = &n->Slots[i];
+
+        h += s->Key ? lval_hash_mix(s->Hash, lval_hash(s->Val)) : lhamt_hash(s->Node);
+    }
+
+    return h;
+}
+
+typedef enum {
+    LHAMT_KEYS,
+    LHAMT_VALS,
+    LHAMT_PAIRS,
+} lhamt_part;
+
+// Adds the keys, values or {key value} pairs of `n` to the list `l`.
+lval* lhamt_list(lhamt* n, lval* l, lhamt_part part) {
+    for (uint32_t i = 0; n && i < n->Count; ++i) {
+        lhamt_slot* s = &n->Slots[i];
+
+        if (!s->Key) {
+            l = lhamt_list(s->Node, l, part);
+            continue;
+        }
+
+        switch (part) {
+            case LHAMT_KEYS: l = lval_add(l, lval_copy(s->Key)); break;
+            case LHAMT_VALS: l = lval_add(l, lval_copy(s->Val)); break;
+            case LHAMT_PAIRS: {
+                lval* pair = lval_add(lval_add(lval_qexpr(), lval_copy(s->Key)), lval_copy(s->Val));
+                l = lval_add(l, pair);
+            } break;
+        }
+    }
+
+    return l;
+}
+
+lval* lval_hashmap(lhamt* n, size_t size) {
+    lval* v = lval_alloc(LVAL_MAP);
+
+    v->Type = LVAL_MAP;
+    v->Refs = 1;
+    v->Hamt = n;
+    v->Size = size;
+
+    return v;
+}
+
+// Returns a copy of the map `m` with `key` bound to `val`. Takes ownership
+// of both, but not of `m`.
+lval* lval_hashmap_put(lval* m, lval* key, lval* val) {
+    bool added = false;
+    lhamt* n = lhamt_put(m->Hamt, 0, lval_hash(key), key, val, &added);
+
+    return lval_hashmap(n, m->Size + added);
+}
+
+lval* lval_add(lval* v, lval* x) {
+    lval_reserve(v, 1);
+
+    v->Cell[v->Count++] = x;
+    if (v->Buf) ++v->Buf->Count;
+
+    return v;
+}
+
+void lval_write(lbytes* b, lval* v);
+
+void lval_expr_print(lbytes* b, lval* v, char open, char close) {
+    lbytes_putc(b, open);
+
+    for (size_t i = 0; i < v->Count; ++i) {
+        lval_write(b, v->Cell[i]);
+
+        if (i != (v->Count - 1)) {
+            lbytes_putc(b, ' ');
+        }
+    }
+
+    lbytes_putc(b, close);
+}
+
+// Possible unescapable characters 
+const char* const lval_str_unescapable = "abfnrtv\\\'\"";
+
+char lval_str_unescape(char x) {
+    switch (x) {
+        case 'a' : return '\a';
+        case 'b' : return '\b';
+        case 'f' : return '\f';
+        case 'n' : return '\n';
+        case 'r' : return '\r';
+        case 't' : return '\t';
+        case 'v' : return '\v';
+        case '\\': return '\\';
+        case '\'': return '\'';
+        case '\"': return '\"';
+        default  : return '\0';
+    }
+}
+
+// The character that follows the backslash when a character is escaped, or
+// 0 if it is printed as is.
+const char lval_str_escapes[256] = {
+    ['\a'] = 'a', ['\b'] = 'b', ['\f'] = 'f', ['\n'] = 'n', ['\r'] = 'r',
+    ['\t'] = 't', ['\v'] = 'v', ['\\'] = '\\', ['\''] = '\'', ['\"'] = '"',
+};
+
+void lval_str_print(lbytes* b, lval* v) {
+    char* str = v->Str;
+    size_t length = v->Length;
+
+    lbytes_putc(b, '"');
+
+    // Copy the runs between escapes whole
+    size_t start = 0;
+
+    for (size_t i = 0; i < length; ++i) {
+        char escape = lval_str_escapes[(unsigned char)str[i]];
+        if (!escape) continue;
+
+        lbytes_put(b, str + start, i - start);
+        start = i + 1;
+
+        char* out = lbytes_extend(b, 2);
+        out[0] = '\\';
+        out[1] = escape;
+    }
+
+    lbytes_put(b, str + start, length - start);
+    lbytes_putc(b, '"');
+}
+
+void lhamt_write(lbytes* b, lhamt* n, bool* first) {
+    for (uint32_t i = 0; i < n->Count; ++i) {
+        lhamt_slot* s = &n->Slots[i];
+
+        if (!s->Key) {
+            lhamt_write(b, s->Node, first);
+            continue;
+        }
+
+        if (!*first) lbytes_putc(b, ' ');
+        *first = false;
+
+        lval_write(b, s->Key);
+        lbytes_putc(b, ' ');
+        lval_write(b, s->Val);
+    }
+}
+
+// Appends the printed form of `v` to `b`.
+void lval_write(lbytes* b, lval* v) {
+    switch (lval_type_of(v)) {
+        case LVAL_NUM: {
+            lbytes_put_num(b, lval_num_of(v));
+        } break;
+        case LVAL_ERR: {
+            lbytes_puts(b, "Error: ");
+            lbytes_puts(b, v->Err);
+        } break;
+        case LVAL_SYM: {
+            lbytes_puts(b, v->Sym);
+        } break;
+        case LVAL_STR: {
+            lval_str_print(b, v);
+        } break;
+        case LVAL_FUN: {
+            if (lval_is_imm(v)) {
+                lbytes_puts(b, "<builtin '");
+                lbytes_puts(b, lval_builtin_entry(v)->Name);
+                lbytes_puts(b, "'>");
+            } else if (v->Memo) {
+                lbytes_puts(b, "(memo ");
+                lval_write(b, v->Memo->Fun);
+                lbytes_putc(b, ')');
+            } else {
+                // NOTE(daniel): a partial application shows the formals
+                // that are still unbound.
+                size_t bound = v->Args ? v->Args->Count : 0;
+                lval* formals = lval_slice(v->Formals, bound, v->Formals->Count - bound);
+
+                lbytes_puts(b, "(\\ ");
+                lval_write(b, formals);
+                lval_free(formals);
+                lbytes_putc(b, ' ');
+                lval_write(b, v->Body);
+                lbytes_putc(b, ')');
+            }
+        } break;
+        case LVAL_SEXPR: {
+            lval_expr_print(b, v, '(', ')');
+        } break;
+        case LVAL_QEXPR: {
+            lval_expr_print(b, v, '{', '}');
+        } break;
+        case LVAL_VEC: {
+            lbytes_putc(b, '[');
+
+            for (size_t i = 0; i < v->Vec->Count; ++i) {
+                if (i) lbytes_putc(b, ' ');
+                lbytes_put_num(b, v->Vec->Data[i]);
+            }
+
+            lbytes_putc(b, ']');
+        } break;
+        case LVAL_MAP: {
+            lbytes_puts(b, "#{");
+
+            // NOTE(daniel): the entries come in the order of their hashes.
+            bool first = true;
+            if (v->Hamt) lhamt_write(b, v->Hamt, &first);
+
+            lbytes_putc(b, '}');
+        } break;
+    }
+}
+
+// NOTE(daniel): values are printed into the output buffer of the thread and
+// written out with a single call, rather than a character at a time. A
+// buffer that grew large for one value isn't kept around.
+#define LOUT_KEEP (1 << 20)
+
+void lout_flush(FILE* f) {
+    fwrite(lout->Data, 1, lout->Length, f);
+    lout->Length = 0;
+
+    if (lout->Capacity > LOUT_KEEP) {
+        free(lout->Data);
+        *lout = (lbytes) { 0 };
+    }
+}
+
+void lval_fprint(FILE* f, lval* v) {
+    lval_write(lout, v);
+    lout_flush(f);
+}
+
+void lval_print(lval* v) {
+    lval_fprint(lispy_current->Out, v);
+}
+
+void lval_println(lval* v) {
+    lval_write(lout, v);
+    lbytes_putc(lout, '\n');
+    lout_flush(lispy_current->Out);
+}
+
+lval* lval_eval(lenv* e, lval* v) {
+    switch (lval_type_of(v)) {
+        case LVAL_SYM: {
+            lval* x = lenv_get(e, v);
+            lval_free(v);
+
+            return x;
+        }
+        case LVAL_SEXPR: 
+            return lval_eval_sexpr(e, v);
+        case LVAL_NUM: case LVAL_ERR: case LVAL_FUN: case LVAL_QEXPR: case LVAL_VEC:
+        default:
+            return v;
+    }
+}
+
+lval* lval_pop(lval* v, int i) {
+    // NOTE(daniel): popping either end just narrows the view. If no other view
+    // shares the buffer, its reference to the cell is handed over (leaving a
+    // NULL outside the view), otherwise it keeps it.
+    if (i == 0 || (size_t)i == v->Count - 1) {
+        lval* result = v->Cell[i];
+
+        if (!v->Buf) {
+            // Inline cells are owned by the view, so the reference goes along
+        } else if (v->Buf->Refs == 1) {
+            v->Cell[i] = NULL;
+
+            if (v->Cell + v->Count == v->Buf->Cells + v->Buf->Count && i > 0) --v->Buf->Count;
+        } else {
+            lval_copy(result);
+        }
+
+        if (i == 0) ++v->Cell;
+        --v->Count;
+
+        return result;
+    }
+
+    if (v->Buf && (v->Buf->Refs > 1 || v->Cell != v->Buf->Cells || v->Count != v->Buf->Count)) {
+        lval_rebuffer(v, v->Count);
+    }
+
+    lval* result = v->Cell[i];
+
+    // Shift the memory after the item at "i" over the top
+    memmove(&v->Cell[i], &v->Cell[i+1], sizeof(lval*) * (v->Count-i-1));
+
+    v->Count--;
+    if (v->Buf) v->Buf->Count--;
+
+    return result;
+}
+
+lval* lval_take(lval* v, int i) {
+    lval* result = lval_copy(v->Cell[i]);
+    lval_free(v);
+
+    return result;
+}
+
+lval* lval_join(lval* x, lval* y) {
+    x = lval_unshare(x);
+    lval_reserve(x, y->Count);
+
+    for (size_t i = 0; i < y->Count; ++i) {
+        x->Cell[x->Count++] = lval_copy(y->Cell[i]);
+    }
+
+    if (x->Buf) x->Buf->Count += y->Count;
+
+    lval_free(y);
+
+    return x; 
+}
+
+#define LASSERT(args, cond, ...)            \
+    if (!(cond)) {                          \
+        lval* err = lval_err(__VA_ARGS__);  \
+        lval_free(args);                    \
+        return err;                         \
+    }
+
+#define LASSERT_COUNT(args, name, count)          \
+    LASSERT(args, args->Count == count,           \
+        "Function '%s' passed incorrect number of arguments. Got %i, Expected %i.", \
+        name, args->Count, count);
+
+#define LASSERT_TYPE(args, name, i, type)         \
+    LASSERT(args, lval_type_of(args->Cell[i]) == type,    \
+        "Function '%s' passed incorrect type for argument %i. Got %s, Expected %s.", \
+        name, i, lval_type_name(lval_type_of(args->Cell[i])), lval_type_name(type));
+
+lval* builtin_head(lenv* e, lval* a) {
+    (void)e;
+
+    LASSERT_COUNT(a, "head", 1);
+    LASSERT_TYPE(a, "head", 0, LVAL_QEXPR);
+    LASSERT(a, a->Cell[0]->Count != 0, 
+        "Function 'head' passed {}");
+
+    lval* result = lval_slice(a->Cell[0], 0, 1);
+    lval_free(a);
+
+    return result;
+}
+
+lval* builtin_tail(lenv* e, lval* a) {
+    (void)e;
+
+    LASSERT_COUNT(a, "tail", 1);
+    LASSERT_TYPE(a, "tail", 0, LVAL_QEXPR);
+    LASSERT(a, a->Cell[0]->Count != 0, 
+        "Function 'head' passed {}");
+
+    lval* result = lval_slice(a->Cell[0], 1, a->Cell[0]->Count - 1);
+    lval_free(a);
+
+    return result;
+}
+
+// NOTE(daniel): the list builtins below replaced lambdas from the stdlib (the
+// originals are kept there with a -lisp suffix), and behave like them: too
+// few arguments give a partial application, and errors are the ones the
+// lambdas would have run into, often reported by head or tail.
+lval* builtin_arity(lval* a, lbuiltin fun, char* name, int arity, char** formals) {
+    if (a->Count > (size_t)arity) {
+        lval* err = lval_err("Function passed too many arguments. Got %i, Expected %i.",
+            a->Count, arity);
+        lval_free(a);
+
+        return err;
+    }
+
+    // NOTE(daniel): the lambda calls the builtin itself (not its name) with the
+    // arguments given so far, followed by the remaining formals.
+    lval* params = lval_qexpr();
+    lval* body = lval_add(lval_qexpr(), lval_fun(name, fun));
+    int given = a->Count;
+
+    while (a->Count) body = lval_add(body, lval_pop(a, 0));
+
+    for (int i = given; i < arity; ++i) {
+        params = lval_add(params, lval_sym(formals[i]));
+        body = lval_add(body, lval_sym(formals[i]));
+    }
+
+    lval_free(a);
+
+    return lval_lambda(params, body);
+}
+
+#define LARITY(args, fun, name, ...)                                        \
+    if (args->Count != sizeof((char*[]){__VA_ARGS__}) / sizeof(char*)) {   \
+        return builtin_arity(args, fun, name,                               \
+            sizeof((char*[]){__VA_ARGS__}) / sizeof(char*), (char*[]){__VA_ARGS__}); \
+    }
+
+#define LASSERT_LIST(args, name, i)                                         \
+    LASSERT(args, lval_type_of(args->Cell[i]) == LVAL_QEXPR,                        \
+        "Function '%s' passed incorrect type for argument 0. Got %s, Expected %s.", \
+        name, lval_type_name(lval_type_of(args->Cell[i])), lval_type_name(LVAL_QEXPR));
+
+// Evaluates a list element the way `fst` does.
+lval* lval_fst(lenv* e, lval* x) {
+    return lval_eval(e, lval_copy(x));
+}
+
+// Applies `f` to `a` the way an S-Expression would. Takes ownership of `a`.
+lval* lval_apply(lenv* e, lval* f, lval* a) {
+    if (lval_type_of(f) != LVAL_FUN) {
+        lval_free(a);
+
+        return lval_err("S-expression does not start with function. Got %s, Expected %s.",
+            lval_type_name(lval_type_of(f)), lval_type_name(LVAL_FUN));
+    }
+
+    return lval_call(e, lval_copy(f), a);
+}
+
+lval* builtin_len(lenv* e, lval* a) {
+    (void)e;
+
+    LARITY(a, builtin_len, "len", "l");
+    LASSERT_LIST(a, "tail", 0);
+
+    lval* result = lval_num(a->Cell[0]->Count);
+    lval_free(a);
+
+    return result;
+}
+
+lval* builtin_nth(lenv* e, lval* a) {
+    LARITY(a, builtin_nth, "nth", "n", "l");
+    LASSERT_TYPE(a, "-", 0, LVAL_NUM);
+
+    long n = lval_num_of(a->Cell[0]);
+    lval* l = a->Cell[1];
+
+    LASSERT_LIST(a, n == 0 ? "head" : "tail", 1);
+    LASSERT(a, n >= 0 && (size_t)n < l->Count,
+        "Function 'head' passed {}");
+
+    lval* result = lval_fst(e, l->Cell[n]);
+    lval_free(a);
+
+    return result;
+}
+
+lval* builtin_last(lenv* e, lval* a) {
+    LARITY(a, builtin_last, "last", "l");
+    LASSERT_LIST(a, "tail", 0);
+    LASSERT(a, a->Cell[0]->Count != 0,
+        "Function 'head' passed {}");
+
+    lval* result = lval_fst(e, a->Cell[0]->Cell[a->Cell[0]->Count - 1]);
+    lval_free(a);
+
+    return result;
+}
+
+lval* builtin_elem(lenv* e, lval* a) {
+    LARITY(a, builtin_elem, "elem", "x", "l");
+    LASSERT_LIST(a, "head", 1);
+
+    lval* l = a->Cell[1];
+    long found = 0;
+
+    for (size_t i = 0; i < l->Count && !found; ++i) {
+        lval* x = lval_fst(e, l->Cell[i]);
+
+        if (lval_type_of(x) == LVAL_ERR) {
+            lval_free(a);
+            return x;
+        }
+
+        found = lval_eq(a->Cell[0], x);
+        lval_free(x);
+    }
+
+    lval_free(a);
+
+    return lval_num(found);
+}
+
+// NOTE(daniel): map and filter apply `f` to every element before reporting the
+// first error, as the recursive lambdas evaluated all of their arguments.
+// They work on the items of `l` from `begin` to `end`, so the parallel
+// builtins can run them on chunks.
+lval* lval_map(lenv* e, lval* f, lval* l, size_t begin, size_t end) {
+    lval* result = lval_qexpr();
+    lval* err = NULL;
+
+    lval_reserve(result, end - begin);
+
+    for (size_t i = begin; i < end; ++i) {
+        lval* x = lval_fst(e, l->Cell[i]);
+
+        if (lval_type_of(x) != LVAL_ERR) {
+            x = lval_apply(e, f, lval_add(lval_sexpr(), x));
+        }
+
+        if (lval_type_of(x) == LVAL_ERR && !err) err = lval_copy(x);
+
+        result = lval_add(result, x);
+    }
+
+    if (err) {
+        lval_free(result);
+        return err;
+    }
+
+    return result;
+}
+
+lval* lval_filter(lenv* e, lval* f, lval* l, size_t begin, size_t end) {
+    lval* result = lval_qexpr();
+    lval* err = NULL;
+
+    for (size_t i = begin; i < end; ++i) {
+        lval* x = lval_fst(e, l->Cell[i]);
+
+        if (lval_type_of(x) != LVAL_ERR) {
+            x = lval_apply(e, f, lval_add(lval_sexpr(), x));
+        }
+
+        if (lval_type_of(x) != LVAL_ERR && lval_type_of(x) != LVAL_NUM) {
+            lval* t = lval_err("Function 'if' passed incorrect type for argument 0. Got %s, Expected %s.",
+                lval_type_name(lval_type_of(x)), lval_type_name(LVAL_NUM));
+            lval_free(x);
+            x = t;
+        }
+
+        if (lval_type_of(x) == LVAL_ERR) {
+            if (!err) err = lval_copy(x);
+        } else if (lval_num_of(x)) {
+            result = lval_add(result, lval_copy(l->Cell[i]));
+        }
+
+        lval_free(x);
+    }
+
+    if (err) {
+        lval_free(result);
+        return err;
+    }
+
+    return result;
+}
+
+// Folds the items of `l` from `begin` to `end` into `z`, which it takes
+// ownership of.
+lval* lval_foldl(lenv* e, lval* f, lval* z, lval* l, size_t begin, size_t end) {
+    for (size_t i = begin; i < end && lval_type_of(z) != LVAL_ERR; ++i) {
+        lval* x = lval_fst(e, l->Cell[i]);
+
+        if (lval_type_of(x) == LVAL_ERR) {
+            lval_free(z);
+            z = x;
+        } else {
+            z = lval_apply(e, f, lval_add(lval_add(lval_sexpr(), z), x));
+        }
+    }
+
+    return z;
+}
+
+lval* builtin_map(lenv* e, lval* a) {
+    LARITY(a, builtin_map, "map", "f", "l");
+    LASSERT_LIST(a, "head", 1);
+
+    lval* result = lval_map(e, a->Cell[0], a->Cell[1], 0, a->Cell[1]->Count);
+    lval_free(a);
+
+    return result;
+}
+
+lval* builtin_filter(lenv* e, lval* a) {
+    LARITY(a, builtin_filter, "filter", "f", "l");
+    LASSERT_LIST(a, "head", 1);
+
+    lval* result = lval_filter(e, a->Cell[0], a->Cell[1], 0, a->Cell[1]->Count);
+    lval_free(a);
+
+    return result;
+}
+
+lval* builtin_foldl(lenv* e, lval* a) {
+    LARITY(a, builtin_foldl, "foldl", "f", "z", "l");
+    LASSERT_LIST(a, "head", 2);
+
+    lval* l = a->Cell[2];
+    lval* result = lval_foldl(e, a->Cell[0], lval_copy(a->Cell[1]), l, 0, l->Count);
+    lval_free(a);
+
+    return result;
+}
+
+// NOTE(daniel): sum and product fold with + and * without building an argument
+// list per element. The arithmetic wraps, as it did in builtin_op.
+lval* builtin_fold_op(lenv* e, lval* a, char* op) {
+    lval* l = a->Cell[0];
+    unsigned long z = (strcmp(op, "+") == 0) ? 0 : 1;
+
+    for (size_t i = 0; i < l->Count; ++i) {
+        lval* x = lval_fst(e, l->Cell[i]);
+
+        if (lval_type_of(x) != LVAL_NUM) {
+            lval* err = (lval_type_of(x) == LVAL_ERR) ? lval_copy(x)
+                : lval_err("Function '%s' passed incorrect type for argument 1. Got %s, Expected %s.",
+                    op, lval_type_name(lval_type_of(x)), lval_type_name(LVAL_NUM));
+            lval_free(x);
+            lval_free(a);
+
+            return err;
+        }
+
+        if (strcmp(op, "+") == 0) z += (unsigned long)lval_num_of(x);
+        if (strcmp(op, "*") == 0) z *= (unsigned long)lval_num_of(x);
+
+        lval_free(x);
+    }
+
+    lval_free(a);
+
+    return lval_num((long)z);
+}
+
+lval* builtin_sum(lenv* e, lval* a) {
+    LARITY(a, builtin_sum, "sum", "l");
+    LASSERT_LIST(a, "head", 0);
+
+    return builtin_fold_op(e, a, "+");
+}
+
+lval* builtin_product(lenv* e, lval* a) {
+    LARITY(a, builtin_product, "product", "l");
+    LASSERT_LIST(a, "head", 0);
+
+    return builtin_fold_op(e, a, "*");
+}
+
+// Returns a view of the first `n` items of `l`, or the items after them.
+lval* builtin_slice(lval* a, bool keep) {
+    long n = lval_num_of(a->Cell[0]);
+    lval* l = a->Cell[1];
+
+    LASSERT(a, n >= 0 && (size_t)n <= l->Count,
+        "Function 'head' passed {}");
+
+    lval* result = keep
+        ? lval_slice(l, 0, n)
+        : lval_slice(l, n, l->Count - n);
+    lval_free(a);
+
+    return result;
+}
+
+lval* builtin_take(lenv* e, lval* a) {
+    (void)e;
+
+    LARITY(a, builtin_take, "take", "n", "l");
+
+    if (lval_type_of(a->Cell[0]) == LVAL_NUM && lval_num_of(a->Cell[0]) == 0) {
+        lval_free(a);
+        return lval_qexpr();
+    }
+
+    LASSERT_LIST(a, "head", 1);
+    LASSERT(a, a->Cell[1]->Count != 0,
+        "Function 'head' passed {}");
+    LASSERT_TYPE(a, "-", 0, LVAL_NUM);
+
+    return builtin_slice(a, true);
+}
+
+lval* builtin_drop(lenv* e, lval* a) {
+    (void)e;
+
+    LARITY(a, builtin_drop, "drop", "n", "l");
+
+    if (lval_type_of(a->Cell[0]) == LVAL_NUM && lval_num_of(a->Cell[0]) == 0) {
+        return lval_take(a, 1);
+    }
+
+    LASSERT_TYPE(a, "-", 0, LVAL_NUM);
+    LASSERT_LIST(a, "tail", 1);
+
+    return builtin_slice(a, false);
+}
+
+lval* builtin_split(lenv* e, lval* a) {
+    LARITY(a, builtin_split, "split", "n", "l");
+
+    lval* front = builtin_take(e, lval_copy(a));
+    if (lval_type_of(front) == LVAL_ERR) {
+        lval_free(a);
+        return front;
+    }
+
+    lval* back = builtin_drop(e, a);
+    if (lval_type_of(back) == LVAL_ERR) {
+        lval_free(front);
+        return back;
+    }
+
+    return lval_add(lval_add(lval_qexpr(), front), back);
+}
+
+lval* builtin_reverse(lenv* e, lval* a) {
+    (void)e;
+
+    LARITY(a, builtin_reverse, "reverse", "l");
+    LASSERT_LIST(a, "tail", 0);
+
+    lval* l = a->Cell[0];
+    lval* result = lval_qexpr();
+
+    lval_reserve(result, l->Count);
+
+    for (size_t i = l->Count; i > 0; --i) {
+        result = lval_add(result, lval_copy(l->Cell[i - 1]));
+    }
+
+    lval_free(a);
+
+    return result;
+}
+
+// NOTE(daniel): pmap, pfilter and preduce split a list into chunks that are
+// evaluated on a fixed pool of worker threads, started on first use with one
+// thread per processor (see --threads). While they run, everything the
+// workers can reach is frozen (see LVAL_FROZEN): the main thread freezes the
+// function, the list and the frames of the caller, and waits. Globals are
+// only frozen when a worker first looks them up, see lpar_share. Workers
+// allocate from their own heaps and can't change the environment.
+//
+// Once all chunks are done the main thread copies their results into its own
+// heap, frees the originals and thaws. Where the chunks begin and end only
+// depends on the length of the list, and their results are combined in a
+// fixed order, so results never depend on the number of threads or the
+// scheduling.
+typedef enum {
+    LPAR_MAP,
+    LPAR_FILTER,
+    LPAR_REDUCE,
+} lpar_op;
+
+typedef struct {
+    size_t  Begin;
+    size_t  End;
+    lval*   Result;
+} lpar_chunk;
+
+// The real count of a frozen lval (Refs) or buffer, code or cache (WideRefs).
+typedef struct {
+    uint32_t*   Refs;
+    size_t*     WideRefs;
+    size_t      Count;
+} lpar_frozen;
+
+// NOTE(daniel): enough chunks to keep a few per thread busy on large machines,
+// the last ones to finish are small.
+#define LPAR_CHUNKS 64
+
+struct lpar {
+    mtx_t           Lock;
+    cnd_t           Wake;
+    cnd_t           Done;
+
+    // Zero for one thread per processor
+    size_t          Threads;
+    size_t          Started;
+    lthread*        Workers;
+    thrd_t*         Handles;
+    bool            Quit;
+
+    // The job being run, Next is the first chunk no worker has taken yet
+    lpar_op         Op;
+    lenv*           Env;
+    lval*           Fun;
+    lval*           List;
+    size_t          ChunkCount;
+    size_t          Next;
+    size_t          Pending;
+    lpar_chunk*     Chunks;
+
+    // Counts the jobs run by the pool, see lpar_share
+    size_t          Epoch;
+
+    size_t          FrozenCount;
+    size_t          FrozenCapacity;
+    lpar_frozen*    Frozen;
+};
+
+size_t lpar_freeze_count(uint32_t* refs, size_t* wide_refs) {
+    if (par->FrozenCount == par->FrozenCapacity) {
+        par->FrozenCapacity = par->FrozenCapacity ? par->FrozenCapacity * 2 : 1024;
+        par->Frozen = realloc(par->Frozen, sizeof(lpar_frozen) * par->FrozenCapacity);
+    }
+
+    par->Frozen[par->FrozenCount] = (lpar_frozen) {
+        .Refs = refs,
+        .WideRefs = wide_refs,
+        .Count = refs ? *refs : *wide_refs,
+    };
+
+    return par->FrozenCount++;
+}
+
+void lpar_freeze_lval(lval* v);
+
+void lpar_freeze_hamt(lhamt* n) {
+    if (n->Refs >= LREFS_FROZEN) return;
+
+    n->Refs = LREFS_FROZEN + lpar_freeze_count(NULL, &n->Refs);
+
+    for (uint32_t i = 0; i < n->Count; ++i) {
+        lhamt_slot* s = &n->Slots[i];
+
+        if (s->Key) {
+            lpar_freeze_lval(s->Key);
+            lpar_freeze_lval(s->Val);
+        } else {
+            lpar_freeze_hamt(s->Node);
+        }
+    }
+}
+
+void lpar_freeze_lval(lval* v) {
+    if (lval_is_imm(v) || v->Refs >= LVAL_FROZEN) return;
+
+    v->Refs = LVAL_FROZEN + (uint32_t)lpar_freeze_count(&v->Refs, NULL);
+
+    switch (v->Type) {
+        case LVAL_FUN: {
+            lpar_freeze_lval(v->Formals);
+            lpar_freeze_lval(v->Body);
+            if (v->Args) lpar_freeze_lval(v->Args);
+
+            if (v->Code && v->Code->Refs < LREFS_FROZEN) {
+                v->Code->Refs = LREFS_FROZEN + lpar_freeze_count(NULL, &v->Code->Refs);
+
+                for (size_t i = 0; i < v->Code->ConstCount; ++i) {
+                    lpar_freeze_lval(v->Code->Consts[i]);
+                }
+            }
+
+            // NOTE(daniel): workers don't use the cache, see lval_call_memo.
+            if (v->Memo && v->Memo->Refs < LREFS_FROZEN) {
+                v->Memo->Refs = LREFS_FROZEN + lpar_freeze_count(NULL, &v->Memo->Refs);
+                lpar_freeze_lval(v->Memo->Fun);
+            }
+        } break;
+        case LVAL_SEXPR: case LVAL_QEXPR: {
+            // NOTE(daniel): other views of the buffer may see other cells.
+            if (v->Buf) {
+                if (v->Buf->Refs >= LREFS_FROZEN) break;
+
+                v->Buf->Refs = LREFS_FROZEN + lpar_freeze_count(NULL, &v->Buf->Refs);
+
+                for (size_t i = 0; i < v->Buf->Count; ++i) {
+                    if (v->Buf->Cells[i]) lpar_freeze_lval(v->Buf->Cells[i]);
+                }
+            } else {
+                for (size_t i = 0; i < v->Count; ++i) lpar_freeze_lval(v->Cell[i]);
+            }
+        } break;
+        case LVAL_STR: {
+            if (v->StrBuf->Refs < LREFS_FROZEN) {
+                v->StrBuf->Refs = LREFS_FROZEN + lpar_freeze_count(NULL, &v->StrBuf->Refs);
+            }
+        } break;
+        case LVAL_MAP: {
+            if (v->Hamt) lpar_freeze_hamt(v->Hamt);
+        } break;
+        default: break;
+    }
+}
+
+// Freezes the bindings of `e` and all of its parents, except the globals.
+void lpar_freeze_lenv(lenv* e) {
+    for (; e; e = e->Parent) {
+        if (e->Params) {
+            lpar_freeze_lval(e->Params);
+
+            for (size_t i = 0; i < e->Params->Count; ++i) {
+                if (e->Slots[i]) lpar_freeze_lval(e->Slots[i]);
+            }
+        }
+
+        for (size_t i = 0; i < e->Capacity; ++i) {
+            if (e->Syms[i]) lpar_freeze_lval(e->Vals[i]);
+        }
+    }
+}
+
+// Returns the global bound to `sym`, frozen. Called by the workers, which
+// freeze a global the first time any of them looks it up during a job, so a
+// job only pays for the globals it uses rather than for all of them.
+//
+// NOTE(daniel): freezing writes to the counts of the value and everything in
+// it, so it is done under the lock. Shared is only set once that is done,
+// and a worker that sees it set sees the counts frozen.
+lval* lpar_share(lsym* sym) {
+    if (atomic_load_explicit(&sym->Shared, memory_order_acquire) == par->Epoch) return sym->Global;
+
+    mtx_lock(&par->Lock);
+
+    if (atomic_load_explicit(&sym->Shared, memory_order_relaxed) != par->Epoch) {
+        lpar_freeze_lval(sym->Global);
+        atomic_store_explicit(&sym->Shared, par->Epoch, memory_order_release);
+    }
+
+    mtx_unlock(&par->Lock);
+
+    return sym->Global;
+}
+
+void lpar_thaw(void) {
+    for (size_t i = 0; i < par->FrozenCount; ++i) {
+        lpar_frozen* f = &par->Frozen[i];
+
+        if (f->Refs) {
+            *f->Refs = (uint32_t)f->Count;
+        } else {
+            *f->WideRefs = f->Count;
+        }
+    }
+
+    par->FrozenCount = 0;
+}
+
+lval* lpar_import(lval* v);
+
+// Adds the entries of the node `n` made by a worker to the map `m`.
+lval* lpar_import_hamt(lhamt* n, lval* m) {
+    for (uint32_t i = 0; i < n->Count; ++i) {
+        lhamt_slot* s = &n->Slots[i];
+
+        if (s->Key) {
+            lval* x = lval_hashmap_put(m, lpar_import(s->Key), lpar_import(s->Val));
+            lval_free(m);
+            m = x;
+        } else {
+            m = lpar_import_hamt(s->Node, m);
+        }
+    }
+
+    return m;
+}
+
+// Copies the value `v` made by a worker into the heap of the calling thread.
+// Frozen values are shared, they get the new reference when thawed.
+lval* lpar_import(lval* v) {
+    if (lval_is_imm(v) || v->Refs == LVAL_STATIC) return v;
+
+    if (v->Refs >= LVAL_FROZEN) {
+        ++par->Frozen[v->Refs - LVAL_FROZEN].Count;
+        return v;
+    }
+
+    switch (v->Type) {
+        case LVAL_FUN: {
+            lval* x = lval_lambda(lpar_import(v->Formals), lpar_import(v->Body));
+
+            x->Sym = v->Sym;
+            x->Args = v->Args ? lpar_import(v->Args) : NULL;
+
+            if (v->Memo && v->Memo->Refs == LREFS_STATIC) {
+                x->Memo = v->Memo;
+            } else if (v->Memo && v->Memo->Refs >= LREFS_FROZEN) {
+                ++par->Frozen[v->Memo->Refs - LREFS_FROZEN].Count;
+                x->Memo = v->Memo;
+            } else if (v->Memo) {
+                x->Memo = lmemo_new(lpar_import(v->Memo->Fun), v->Memo->Limit);
+            }
+
+            return x;
+        }
+        case LVAL_SEXPR: case LVAL_QEXPR: {
+            lval* x = v->Type == LVAL_SEXPR ? lval_sexpr() : lval_qexpr();
+            lval_reserve(x, v->Count);
+
+            for (size_t i = 0; i < v->Count; ++i) x = lval_add(x, lpar_import(v->Cell[i]));
+
+            return x;
+        }
+        case LVAL_STR:
+            return lval_str_n(v->Str, v->Length);
+        case LVAL_MAP: {
+            if (!v->Hamt || v->Hamt->Refs == LREFS_STATIC) return lval_clone(v);
+
+            if (v->Hamt->Refs >= LREFS_FROZEN) {
+                ++par->Frozen[v->Hamt->Refs - LREFS_FROZEN].Count;
+                return lval_hashmap(v->Hamt, v->Size);
+            }
+
+            return lpar_import_hamt(v->Hamt, lval_hashmap(NULL, 0));
+        }
+        default:
+            // NOTE(daniel): atoms own all of their data.
+            return lval_clone(v);
+    }
+}
+
+// Adds the counters of the workers to those of the main thread, which is
+// about to free what they allocated. Called with the lock held.
+void lpar_merge(void) {
+    for (size_t i = 0; i < par->Started; ++i) {
+        lheap* h = &par->Workers[i].Heap;
+        lstats* s = &par->Workers[i].Stats;
+
+        heap->Atoms.Allocs += h->Atoms.Allocs;
+        heap->Lvals.Allocs += h->Lvals.Allocs;
+        heap->Lenvs.Allocs += h->Lenvs.Allocs;
+        heap->Allocated += h->Allocated;
+
+        h->Atoms.Allocs = h->Lvals.Allocs = h->Lenvs.Allocs = h->Allocated = 0;
+
+        for (size_t t = 0; t < LVAL_TYPES; ++t) {
+            stats->Allocs[t] += s->Allocs[t];
+            stats->Copies[t] += s->Copies[t];
+            stats->Frees[t] += s->Frees[t];
+        }
+
+        stats->Frames += s->Frames;
+        stats->CellAllocs += s->CellAllocs;
+        stats->Bytes += s->Bytes;
+        stats->Evals += s->Evals;
+        stats->Calls += s->Calls;
+
+        *s = (lstats) { 0 };
+    }
+
+    if (stats->Bytes > stats->PeakBytes) stats->PeakBytes = stats->Bytes;
+}
+
+// Runs `op` on the items of `l` from `begin` to `end`. A chunk of a reduction
+// is folded starting from its first item.
+lval* lpar_chunk_run(lenv* e, lpar_op op, lval* f, lval* l, size_t begin, size_t end) {
+    switch (op) {
+        case LPAR_MAP: return lval_map(e, f, l, begin, end);
+        case LPAR_FILTER: return lval_filter(e, f, l, begin, end);
+        case LPAR_REDUCE: return lval_foldl(e, f, lval_fst(e, l->Cell[begin]), l, begin + 1, end);
+    }
+
+    return NULL;
+}
+
+int lpar_work(void* arg) {
+    lthread_enter(arg);
+    lpar_worker = true;
+    lpar_pooled = true;
+
+    mtx_lock(&par->Lock);
+
+    for (;;) {
+        while (par->Next == par->ChunkCount && !par->Quit) cnd_wait(&par->Wake, &par->Lock);
+        if (par->Quit) break;
+
+        lpar_chunk* c = &par->Chunks[par->Next++];
+        mtx_unlock(&par->Lock);
+
+        lpar_env = par->Env;
+        c->Result = lpar_chunk_run(par->Env, par->Op, par->Fun, par->List, c->Begin, c->End);
+
+        mtx_lock(&par->Lock);
+        if (--par->Pending == 0) cnd_signal(&par->Done);
+    }
+
+    mtx_unlock(&par->Lock);
+
+    return 0;
+}
+
+size_t lpar_processors(void) {
+#ifdef _WIN32
+    return 1;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return n > 0 ? (size_t)n : 1;
+#endif
+}
+
+void lpar_start(void) {
+    if (par->Workers) return;
+
+    size_t threads = par->Threads ? par->Threads : lpar_processors();
+
+    mtx_init(&par->Lock, mtx_plain);
+    cnd_init(&par->Wake);
+    cnd_init(&par->Done);
+
+    par->Workers = calloc(threads, sizeof(lthread));
+    par->Handles = calloc(threads, sizeof(thrd_t));
+
+    // NOTE(daniel): with a single thread everything runs on the main thread.
+    if (threads < 2) return;
+
+    for (size_t i = 0; i < threads; ++i) {
+        lthread* t = &par->Workers[i];
+
+        // NOTE(daniel): a worker never collects, its heap is empty between
+        // jobs.
+        lthread_init(t, lispy_current);
+        t->Heap.Depth = 1;
+
+        if (thrd_create(&par->Handles[i], lpar_work, t) != thrd_success) break;
+
+        ++par->Started;
+    }
+}
+
+// Stops the workers, and frees their heaps along with the pool.
+void lpar_stop(void) {
+    if (!par->Workers) return;
+
+    mtx_lock(&par->Lock);
+    par->Quit = true;
+    cnd_broadcast(&par->Wake);
+    mtx_unlock(&par->Lock);
+
+    for (size_t i = 0; i < par->Started; ++i) {
+        thrd_join(par->Handles[i], NULL);
+        lthread_free(&par->Workers[i]);
+    }
+
+    free(par->Workers);
+    free(par->Handles);
+    free(par->Chunks);
+    free(par->Frozen);
+
+    mtx_destroy(&par->Lock);
+    cnd_destroy(&par->Wake);
+    cnd_destroy(&par->Done);
+}
+
+// Returns where the chunk `i` of `chunks` begins in a list of `count` items.
+size_t lpar_chunk_begin(size_t count, size_t chunks, size_t i) {
+    return count * i / chunks;
+}
+
+// Runs `op` with the function `f` on chunks of the list `l`, and returns the
+// result of every chunk in order. Inside a worker, or without workers, the
+// chunks are run one after the other on this thread, up to the first error.
+lval* lpar_run(lenv* e, lpar_op op, lval* f, lval* l) {
+    lval* results = lval_qexpr();
+
+    if (l->Count == 0) return results;
+
+    if (!lpar_worker) lpar_start();
+
+    size_t chunks = l->Count < LPAR_CHUNKS ? l->Count : LPAR_CHUNKS;
+
+    // NOTE(daniel): the chunks still run as if on a worker, so the results
+    // are the same whatever the number of threads.
+    if (lpar_worker || par->Started < 2) {
+        bool worker = lpar_worker;
+        lenv* env = lpar_env;
+
+        lpar_worker = true;
+        lpar_env = e;
+        lval_reserve(results, chunks);
+
+        for (size_t i = 0; i < chunks; ++i) {
+            size_t begin = lpar_chunk_begin(l->Count, chunks, i);
+            size_t end = lpar_chunk_begin(l->Count, chunks, i + 1);
+
+            lval* x = lpar_chunk_run(e, op, f, l, begin, end);
+            results = lval_add(results, x);
+
+            if (lval_type_of(x) == LVAL_ERR) break;
+        }
+
+        lpar_worker = worker;
+        lpar_env = env;
+
+        return results;
+    }
+
+    lpar_freeze_lval(f);
+    lpar_freeze_lval(l);
+    lpar_freeze_lenv(e);
+
+    par->Chunks = realloc(par->Chunks, sizeof(lpar_chunk) * chunks);
+
+    for (size_t i = 0; i < chunks; ++i) {
+        par->Chunks[i] = (lpar_chunk) {
+            .Begin = lpar_chunk_begin(l->Count, chunks, i),
+            .End = lpar_chunk_begin(l->Count, chunks, i + 1),
+        };
+    }
+
+    mtx_lock(&par->Lock);
+
+    par->Op = op;
+    par->Env = e;
+    par->Fun = f;
+    par->List = l;
+    par->Epoch++;
+    par->ChunkCount = chunks;
+    par->Next = 0;
+    par->Pending = chunks;
+
+    cnd_broadcast(&par->Wake);
+    while (par->Pending) cnd_wait(&par->Done, &par->Lock);
+
+    lpar_merge();
+    mtx_unlock(&par->Lock);
+
+    lval_reserve(results, chunks);
+
+    for (size_t i = 0; i < chunks; ++i) {
+        results = lval_add(results, lpar_import(par->Chunks[i].Result));
+        lval_free(par->Chunks[i].Result);
+    }
+
+    lpar_thaw();
+
+    return results;
+}
+
+// Joins the lists made by the chunks, or returns the first error.
+lval* lpar_join(lval* chunks) {
+    size_t count = 0;
+
+    for (size_t i = 0; i < chunks->Count; ++i) {
+        if (lval_type_of(chunks->Cell[i]) == LVAL_ERR) return lval_take(chunks, i);
+
+        count += chunks->Cell[i]->Count;
+    }
+
+    lval* result = lval_qexpr();
+    lval_reserve(result, count);
+
+    for (size_t i = 0; i < chunks->Count; ++i) {
+        result = lval_join(result, lval_copy(chunks->Cell[i]));
+    }
+
+    lval_free(chunks);
+
+    return result;
+}
+
+lval* builtin_pmap(lenv* e, lval* a) {
+    LARITY(a, builtin_pmap, "pmap", "f", "l");
+    LASSERT_LIST(a, "head", 1);
+
+    lval* chunks = lpar_run(e, LPAR_MAP, a->Cell[0], a->Cell[1]);
+    lval_free(a);
+
+    return lpar_join(chunks);
+}
+
+lval* builtin_pfilter(lenv* e, lval* a) {
+    LARITY(a, builtin_pfilter, "pfilter", "f", "l");
+    LASSERT_LIST(a, "head", 1);
+
+    lval* chunks = lpar_run(e, LPAR_FILTER, a->Cell[0], a->Cell[1]);
+    lval_free(a);
+
+    return lpar_join(chunks);
+}
+
+// Combines the results of the chunks from `begin` to `end` with `f`, halving
+// the range at each level, or returns the first error.
+lval* lpar_combine(lenv* e, lval* f, lval* chunks, size_t begin, size_t end) {
+    if (end - begin == 1) return lval_copy(chunks->Cell[begin]);
+
+    size_t middle = begin + (end - begin) / 2;
+
+    lval* x = lpar_combine(e, f, chunks, begin, middle);
+    if (lval_type_of(x) == LVAL_ERR) return x;
+
+    lval* y = lpar_combine(e, f, chunks, middle, end);
+    if (lval_type_of(y) == LVAL_ERR) {
+        lval_free(x);
+        return y;
+    }
+
+    return lval_apply(e, f, lval_add(lval_add(lval_sexpr(), x), y));
+}
+
+// NOTE(daniel): each chunk is folded from its first item and the chunks are
+// combined pairwise before `z` is added on the left, so this is only the same
+// as foldl when `f` is associative. It is the same for any number of threads.
+lval* builtin_preduce(lenv* e, lval* a) {
+    LARITY(a, builtin_preduce, "preduce", "f", "z", "l");
+    LASSERT_LIST(a, "head", 2);
+
+    lval* f = a->Cell[0];
+    lval* chunks = lpar_run(e, LPAR_REDUCE, f, a->Cell[2]);
+    lval* z = lval_copy(a->Cell[1]);
+
+    if (chunks->Count) {
+        lval* x = lpar_combine(e, f, chunks, 0, chunks->Count);
+
+        if (lval_type_of(x) == LVAL_ERR) {
+            lval_free(z);
+            z = x;
+        } else {
+            z = lval_apply(e, f, lval_add(lval_add(lval_sexpr(), z), x));
+        }
+    }
+
+    lval_free(chunks);
+    lval_free(a);
+
+    return z;
+}
+
+#undef LARITY
+#undef LASSERT_LIST
+
+lval* builtin_list(lenv* e, lval* a) {
+    (void)e;
+
+    a = lval_unshare(a);
+    a->Type = LVAL_QEXPR;
+
+    return a;
+}
+
+lval* builtin_eval(lenv* e, lval* v) {
+    LASSERT_COUNT(v, "eval", 1);
+    LASSERT_TYPE(v, "eval", 0, LVAL_QEXPR);
+
+    lval* x = lval_unshare(lval_take(v, 0));
+    x->Type = LVAL_SEXPR;
+
+    return lval_eval(e, x);
+}
+
+lval* builtin_join(lenv* e, lval* a) {
+    (void)e;
+
+    for (size_t i = 0; i < a->Count; ++i) {
+        LASSERT_TYPE(a, "join", i, LVAL_QEXPR);
+    }
+
+    lval* result = lval_pop(a, 0);
+
+    while (a->Count) {
+        result = lval_join(result, lval_pop(a, 0));
+    }
+
+    lval_free(a);
+
+    return result;
+}
+
+lval* builtin_var(lenv* e, lval* a, char* fun) {
+    LASSERT_TYPE(a, "def", 0, LVAL_QEXPR);
+    
+    lval* Syms = a->Cell[0];
+
+    for (size_t i = 0; i < Syms->Count; ++i) {
+        LASSERT(a, (lval_type_of(Syms->Cell[i]) == LVAL_SYM), 
+            "Function 'def' cannot define non-symbol. Got %s, Expected %s.",
+            lval_type_name(lval_type_of(Syms->Cell[i])), lval_type_name(LVAL_SYM));
+    }
+
+    LASSERT(a, Syms->Count == a->Count-1, 
+        "Function 'def' cannot define incorrect number of values. Got %i, Expected %i.",
+        Syms->Count, a->Count-1);
+
+    // NOTE(daniel): the environment is frozen while workers run, they may only
+    // bind in their own frames.
+    LASSERT(a, !lpar_worker || (strcmp(fun, "=") == 0 && !lenv_shared(e)),
+        "Function '%s' cannot change the shared environment from a parallel worker.", fun);
+
+    for (size_t i = 0; i < Syms->Count; ++i) {
+        // NOTE(daniel): lambdas are known by the first name they're bound to.
+        lval* v = a->Cell[i+1];
+        if (lval_type_of(v) == LVAL_FUN && !lval_is_imm(v) && !v->Sym && !lpar_worker) {
+            v->Sym = Syms->Cell[i]->Sym;
+        }
+
+        if (strcmp(fun, "def") == 0) {
+            lenv_def(e, Syms->Cell[i], a->Cell[i+1]);
+        } else if (strcmp(fun, "=") == 0) {
+            lenv_put(e, Syms->Cell[i], a->Cell[i+1]);
+        }
+    }
+
+    lval_free(a);
+
+    return lval_sexpr();
+}
+
+lval* builtin_def(lenv* e, lval* a) {
+    return builtin_var(e, a, "def");
+}
+
+lval* builtin_put(lenv* e, lval* a) {
+    return builtin_var(e, a, "=");
+}
+
+lval* builtin_lambda(lenv* e, lval* a) {
+    (void)e;
+
+    LASSERT_COUNT(a, "\\", 2);
+    LASSERT_TYPE(a, "\\", 0, LVAL_QEXPR);
+    LASSERT_TYPE(a, "\\", 1, LVAL_QEXPR);
+
+    for (size_t i = 0; i < a->Cell[0]->Count; ++i) {
+        LASSERT(a, (lval_type_of(a->Cell[0]->Cell[i]) == LVAL_SYM), 
+            "Cannot define non-symbol. Got %s, Expected %s.",
+            lval_type_name(lval_type_of(a->Cell[0]->Cell[i])), lval_type_name(LVAL_SYM));
+    }
+
+    lval* formals = lval_pop(a, 0);
+    lval* body = lval_pop(a, 0);
+
+    lval_free(a);
+
+    return lval_lambda(formals, body);
+}
+
+lval* builtin_op(lenv* e, lval* a, char* op) {
+    (void)e;
+
+    // Ensure all arguments are numbers
+    for (size_t i = 0; i < a->Count; ++i) {
+        if (lval_type_of(a->Cell[i]) != LVAL_NUM) {
+            LASSERT_TYPE(a, op, i, LVAL_NUM);
+        }
+    }
+
+    // NOTE(daniel): compute in a plain unsigned long, so the arithmetic wraps
+    // around instead of overflowing. The result is only boxed if it doesn't
+    // fit a fixnum.
+    unsigned long result = (unsigned long)lval_num_of(a->Cell[0]);
+
+    if ((strcmp(op, "-") == 0) && a->Count == 1) {
+        result = 0 - result;
+    }
+
+    for (size_t i = 1; i < a->Count; ++i) {
+        long y = lval_num_of(a->Cell[i]);
+
+        if (strcmp(op, "+") == 0) result += (unsigned long)y;
+        if (strcmp(op, "-") == 0) result -= (unsigned long)y;
+        if (strcmp(op, "*") == 0) result *= (unsigned long)y;
+        if (strcmp(op, "/") == 0) {
+            if (y == 0) {
+                lval_free(a);
+                return lval_err("Division by zero");
+            }
+
+            // Dividing the smallest long by -1 overflows as well
+            result = y == -1 ? 0 - result : (unsigned long)((long)result / y);
+        }
+    }
+
+    lval_free(a);
+    return lval_num((long)result);
+}
+
+lval* builtin_add(lenv* e, lval* a) {
+    return builtin_op(e, a, "+");
+}
+
+lval* builtin_sub(lenv* e, lval* a) {
+    return builtin_op(e, a, "-");
+}
+
+lval* builtin_mul(lenv* e, lval* a) {
+    return builtin_op(e, a, "*");
+}
+
+lval* builtin_div(lenv* e, lval* a) {
+    return builtin_op(e, a, "/");
+}
+
+lval* builtin_ord(lenv* e, lval* a, char* op) {
+    (void)e;
+
+    LASSERT_COUNT(a, op, 2);
+    LASSERT_TYPE(a, op, 0, LVAL_NUM);
+    LASSERT_TYPE(a, op, 1, LVAL_NUM);
+
+    int result = 0;
+
+    if (strcmp(op, ">") == 0) {
+        result = lval_num_of(a->Cell[0]) > lval_num_of(a->Cell[1]);
+    } else if (strcmp(op, "<") == 0) {
+        result = lval_num_of(a->Cell[0]) < lval_num_of(a->Cell[1]);
+    } else if (strcmp(op, ">=") == 0) {
+        result = lval_num_of(a->Cell[0]) >= lval_num_of(a->Cell[1]);
+    } else if (strcmp(op, "<=") == 0) {
+        result = lval_num_of(a->Cell[0]) <= lval_num_of(a->Cell[1]);
+    }
+
+    lval_free(a);
+
+    return lval_num(result);
+}
+
+lval* builtin_gt(lenv* e, lval* a) {
+    return builtin_ord(e, a, ">");
+}
+
+lval* builtin_lt(lenv* e, lval* a) {
+    return builtin_ord(e, a, "<");
+}
+
+lval* builtin_ge(lenv* e, lval* a) {
+    return builtin_ord(e, a, ">=");
+}
+
+lval* builtin_le(lenv* e, lval* a) {
+    return builtin_ord(e, a, "<=");
+}
+
+lval* builtin_cmp(lenv* e, lval* a, char* op) {
+    (void)e;
+
+    LASSERT_COUNT(a, op, 2);
+
+    int result = 0;
+    
+    if (strcmp(op, "==") == 0) {
+        result = lval_eq(a->Cell[0], a->Cell[1]);
+    } else if (strcmp(op, "!=") == 0) {
+        result = !lval_eq(a->Cell[0], a->Cell[1]);
+    }
+
+    lval_free(a);
+
+    return lval_num(result);
+}
+
+lval* builtin_eq(lenv* e, lval* a) {
+    return builtin_cmp(e, a, "==");
+}
+
+lval* builtin_ne(lenv* e, lval* a) {
+    return builtin_cmp(e, a, "!=");
+}
+
+lval* builtin_if(lenv* e, lval* a) {
+    LASSERT_COUNT(a, "if", 3);
+    LASSERT_TYPE(a, "if", 0, LVAL_NUM);
+    LASSERT_TYPE(a, "if", 1, LVAL_QEXPR);
+    LASSERT_TYPE(a, "if", 2, LVAL_QEXPR);
+
+    // Turn the chosen Q-Expression into an S-Expression, so it can be evaluated.
+    lval* branch = lval_unshare(lval_pop(a, lval_num_of(a->Cell[0]) ? 1 : 2));
+    branch->Type = LVAL_SEXPR;
+
+    lval_free(a);
+
+    return lval_eval(e, branch);
+}
+
+// Maps the file at `path` into memory, returns NULL if it can't be read. A
+// writable mapping is private, changes never reach the file.
+char* lfile_map(char* path, size_t* length, bool writable) {
+#ifdef _WIN32
+    (void)writable;
+
+    FILE* f = fopen(path, "rb");
+    if (!f) return NULL;
+
+    fseek(f, 0, SEEK_END);
+    *length = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char* data = malloc(*length + 1);
+    *length = fread(data, 1, *length, f);
+    fclose(f);
+
+    return data;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return NULL;
+    }
+
+    // NOTE(daniel): an empty mapping is an error, but an empty file isn't.
+    *length = st.st_size;
+    char* data = *length
+        ? mmap(NULL, *length, PROT_READ | (writable ? PROT_WRITE : 0), MAP_PRIVATE, fd, 0)
+        : "";
+    close(fd);
+
+    return data != MAP_FAILED ? data : NULL;
+#endif
+}
+
+void lfile_unmap(char* data, size_t length) {
+#ifdef _WIN32
+    (void)length;
+    free(data);
+#else
+    if (length) munmap(data, length);
+#endif
+}
+
+// NOTE(daniel): hashes the contents of a file, to tell if it changed. This
+// goes a word at a time in four independent lanes, FNV-1a (lsym_hash_str) is
+// a lot slower on big files. The hash can be taken a piece at a time, as a
+// file is read, with lhash_update.
+typedef struct {
+    uint64_t    Lanes[4];
+    uint64_t    Length;
+    char        Tail[32];   // the start of a block that isn't complete yet
+} lhash;
+
+lhash lhash_new(void) {
+    return (lhash) { .Lanes = { 0, 0x9e3779b97f4a7c15ULL, 0xbf58476d1ce4e5b9ULL, 0x94d049bb133111ebULL } };
+}
+
+void lhash_block(lhash* h, char* block) {
+    for (size_t k = 0; k < 4; ++k) {
+        uint64_t x;
+        memcpy(&x, block + 8 * k, sizeof(x));
+
+        h->Lanes[k] = (h->Lanes[k] ^ x) * 0xff51afd7ed558ccdULL;
+        h->Lanes[k] ^= h->Lanes[k] >> 32;
+    }
+}
+
+// Adds the `length` bytes at `data` to the hash.
+void lhash_update(lhash* h, char* data, size_t length) {
+    size_t tail = h->Length % 32;
+    h->Length += length;
+
+    if (tail) {
+        size_t n = 32 - tail < length ? 32 - tail : length;
+        memcpy(h->Tail + tail, data, n);
+
+        if (tail + n < 32) return;
+
+        lhash_block(h, h->Tail);
+        data += n;
+        length -= n;
+    }
+
+    for (; length >= 32; data += 32, length -= 32) lhash_block(h, data);
+
+    memcpy(h->Tail, data, length);
+}
+
+uint64_t lhash_final(lhash* h) {
+    uint64_t x = h->Length;
+    uint64_t r = (h->Lanes[0] ^ x) ^ (h->Lanes[1] * 3) ^ (h->Lanes[2] * 5) ^ (h->Lanes[3] * 7);
+    size_t tail = h->Length % 32;
+
+    for (size_t i = 0; i < tail; i += 8) {
+        x = 0;
+        memcpy(&x, h->Tail + i, tail - i < 8 ? tail - i : 8);
+
+        r = (r ^ x) * 0xff51afd7ed558ccdULL;
+        r ^= r >> 32;
+    }
+
+    r *= 0xc4ceb9fe1a85ec53ULL;
+    r ^= r >> 33;
+
+    return r;
+}
+
+uint64_t lfile_hash(char* data, size_t length) {
+    lhash h = lhash_new();
+    lhash_update(&h, data, length);
+
+    return lhash_final(&h);
+}
+
+// Creates a file to replace the one at `path`, writing its name to `tmp`.
+// Returns NULL if it can't be created. See lfile_commit.
+//
+// NOTE(daniel): write a file of our own and move it over the old one, so no
+// one ever reads a partial file. Other threads or processes may be writing
+// the same one; if they picked the same name too, just give up.
+FILE* lfile_create(char* path, char* tmp, size_t size) {
+    snprintf(tmp, size, "%s.%lx.%lx.tmp", path, (unsigned long)time(NULL), (unsigned long)(uintptr_t)tmp);
+
+    return fopen(tmp, "wbx");
+}
+
+// Closes the file `f` made by lfile_create and, if `ok`, moves it from `tmp`
+// over `path`. Otherwise it is removed. Returns false if it wasn't moved.
+bool lfile_commit(FILE* f, char* tmp, char* path, bool ok) {
+    if (fclose(f) != 0) ok = false;
+    if (ok) ok = rename(tmp, path) == 0;
+    if (!ok) remove(tmp);
+
+    return ok;
+}
+
+// Replaces the file at `path` with the `length` bytes at `data`. Returns false
+// if it couldn't be written.
+bool lfile_write(char* path, char* data, size_t length) {
+    char tmp[4096];
+
+    FILE* f = lfile_create(path, tmp, sizeof(tmp));
+    if (!f) return false;
+
+    return lfile_commit(f, tmp, path, fwrite(data, 1, length, f) == length);
+}
+
+// Lets the pages of the mapped file `data` from `begin` to `end` go, once
+// they have been read. Whole pages only, they are read again if touched.
+// Returns where the pages let go end, to start from the next time.
+size_t lfile_release(char* data, size_t begin, size_t end) {
+#ifdef _WIN32
+    (void)data; (void)end;
+
+    return begin;
+#else
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+
+    begin = (begin + page - 1) / page * page;
+    end = end / page * page;
+
+    if (begin >= end) return begin;
+
+    madvise(data + begin, end - begin, MADV_DONTNEED);
+
+    return end;
+#endif
+}
+
+lval* builtin_load(lenv* e, lval* a) {
+    LASSERT_COUNT(a, "load", 1);
+    LASSERT_TYPE(a, "load", 0, LVAL_STR);
+
+    // Open the file and check if exists
+    char* path = strndup(a->Cell[0]->Str, a->Cell[0]->Length);
+    lload* input = lload_open(path);
+    free(path);
+
+    if (!input) {
+        lval* err = lval_err("Could not load library %.*s", (int)a->Cell[0]->Length, a->Cell[0]->Str);
+        lval_free(a);
+
+        return err; 
+    }
+
+    lheap_push_root(a);
+
+    // Evaluate the forms as they are read, up to the first that doesn't read
+    for (lval* expr; (expr = lload_next(input));) {
+        if (lval_type_of(expr) == LVAL_ERR) {
+            lval_println(expr);
+            lval_free(expr);
+            break;
+        }
+
+        lval* x = lval_eval(e, expr);
+
+        if (lval_type_of(x) == LVAL_ERR) {
+            lval_println(x);
+        }
+
+        lval_free(x);
+
+        lheap_safepoint(e);
+    }
+
+    lheap_pop_root();
+    lload_close(input);
+    lval_free(a);
+
+    return lval_sexpr();
+}
+
+lval* builtin_print(lenv* e, lval* a) {
+    (void)e;
+
+    for (size_t i = 0; i < a->Count; ++i) {
+        lval_write(lout, a->Cell[i]);
+        lbytes_putc(lout, ' ');
+    }
+
+    lbytes_putc(lout, '\n');
+    lout_flush(lispy_current->Out);
+    lval_free(a);
+
+    return lval_sexpr();
+}
+
+// Returns the printed form of a value as a string.
+lval* builtin_show(lenv* e, lval* a) {
+    (void)e;
+
+    LASSERT_COUNT(a, "show", 1);
+
+    size_t start = lout->Length;
+    lval_write(lout, a->Cell[0]);
+
+    lval* x = lval_str_n(lout->Data + start, lout->Length - start);
+    lout->Length = start;
+    lval_free(a);
+
+    return x;
+}
+
+lval* builtin_error(lenv* e, lval* a) {
+    (void)e;
+
+    LASSERT_COUNT(a, "error", 1);
+    LASSERT_TYPE(a, "error", 0, LVAL_STR);
+
+    lval* err = lval_err("%.*s", (int)a->Cell[0]->Length, a->Cell[0]->Str);
+    lval_free(a);
+
+    return err;
+}
+
+// Returns the runtime counters as a list of {name value} pairs, given "get".
+// Given "reset" it also starts counting from zero. (A call needs an argument,
+// `(stats)` on its own evaluates to the function.)
+lval* builtin_stats(lenv* e, lval* a) {
+    (void)e;
+
+    LASSERT_COUNT(a, "stats", 1);
+    LASSERT_TYPE(a, "stats", 0, LVAL_STR);
+
+    bool reset = lval_str_is(a->Cell[0], "reset");
+
+    LASSERT(a, reset || lval_str_is(a->Cell[0], "get"),
+        "Function 'stats' passed unknown command \"%.*s\".", (int)a->Cell[0]->Length, a->Cell[0]->Str);
+
+    lval_free(a);
+
+    lstat_value list[LSTATS_MAX];
+    size_t n = lstats_list(list);
+
+    lval* result = lval_qexpr();
+    lval_reserve(result, n);
+
+    for (size_t i = 0; i < n; ++i) {
+        lval* pair = lval_add(lval_qexpr(), lval_sym(list[i].Name));
+        result = lval_add(result, lval_add(pair, lval_num(list[i].Value)));
+    }
+
+    if (reset) lstats_reset();
+
+    return result;
+}
+
+// Wraps the lambda in a cache of its results keyed by the arguments, holding
+// at most the given number of them if there is one.
+lval* builtin_memo(lenv* e, lval* a) {
+    (void)e;
+
+    LASSERT(a, a->Count == 1 || a->Count == 2,
+        "Function 'memo' passed incorrect number of arguments. Got %i, Expected 1 or 2.", a->Count);
+    LASSERT_TYPE(a, "memo", 0, LVAL_FUN);
+    LASSERT(a, !lval_is_imm(a->Cell[0]),
+        "Function 'memo' passed a builtin, Expected a lambda.");
+
+    size_t limit = 0;
+
+    if (a->Count == 2) {
+        LASSERT_TYPE(a, "memo", 1, LVAL_NUM);
+        LASSERT(a, lval_num_of(a->Cell[1]) > 0,
+            "Function 'memo' passed invalid size %li, Expected a positive number.", lval_num_of(a->Cell[1]));
+
+        limit = lval_num_of(a->Cell[1]);
+    }
+
+    lval* f = lval_pop(a, 0);
+    lval_free(a);
+
+    // NOTE(daniel): memoizing again just replaces the cache.
+    if (f->Memo) {
+        lval* g = lval_copy(f->Memo->Fun);
+        lval_free(f);
+        f = g;
+    }
+
+    lval* v = lval_clone(f);
+    v->Memo = lmemo_new(f, limit);
+
+    return v;
+}
+
+lval* builtin_memo_stats(lenv* e, lval* a) {
+    (void)e;
+
+    LASSERT_COUNT(a, "memo-stats", 1);
+    LASSERT_TYPE(a, "memo-stats", 0, LVAL_FUN);
+    LASSERT(a, !lval_is_imm(a->Cell[0]) && a->Cell[0]->Memo,
+        "Function 'memo-stats' passed a function that is not memoized.");
+
+    lmemo* m = a->Cell[0]->Memo;
+
+    char* names[] = { "hits", "misses", "size", "limit" };
+    size_t values[] = { m->Hits, m->Misses, m->Count, m->Limit };
+
+    lval_free(a);
+
+    lval* result = lval_qexpr();
+
+    for (size_t i = 0; i < 4; ++i) {
+        lval* pair = lval_add(lval_qexpr(), lval_sym(names[i]));
+        result = lval_add(result, lval_add(pair, lval_num(values[i])));
+    }
+
+    return result;
+}
+
+// NOTE(daniel): maps are values like any other, the map builtins return new
+// maps that share all they can with their argument, see lhamt.
+//
+// A map is made from a list of keys each followed by its value, like vec.
+lval* builtin_hash_map(lenv* e, lval* a) {
+    (void)e;
+
+    LASSERT_COUNT(a, "hash-map", 1);
+    LASSERT_TYPE(a, "hash-map", 0, LVAL_QEXPR);
+
+    lval* l = a->Cell[0];
+
+    LASSERT(a, l->Count % 2 == 0,
+        "Function 'hash-map' passed a list of %i elements, Expected keys each followed by a value.", l->Count);
+
+    lval* m = lval_hashmap(NULL, 0);
+
+    for (size_t i = 0; i < l->Count; i += 2) {
+        lval* x = lval_hashmap_put(m, lval_copy(l->Cell[i]), lval_copy(l->Cell[i + 1]));
+        lval_free(m);
+        m = x;
+    }
+
+    lval_free(a);
+
+    return m;
+}
+
+// Returns the value of a key, or the default if given and the key is unbound.
+lval* builtin_map_get(lenv* e, lval* a) {
+    (void)e;
+
+    LASSERT(a, a->Count == 2 || a->Count == 3,
+        "Function 'map-get' passed incorrect number of arguments. Got %i, Expected 2 or 3.", a->Count);
+    LASSERT_TYPE(a, "map-get", 0, LVAL_MAP);
+
+    lval* key = a->Cell[1];
+    lval* x = lhamt_get(a->Cell[0]->Hamt, lval_hash(key), key);
+
+    if (!x && a->Count == 3) x = a->Cell[2];
+
+    LASSERT(a, x, "Function 'map-get' passed a key that is not in the map.");
+
+    x = lval_copy(x);
+    lval_free(a);
+
+    return x;
+}
+
+lval* builtin_map_put(lenv* e, lval* a) {
+    (void)e;
+
+    LASSERT_COUNT(a, "map-put", 3);
+    LASSERT_TYPE(a, "map-put", 0, LVAL_MAP);
+
+    lval* x = lval_hashmap_put(a->Cell[0], lval_copy(a->Cell[1]), lval_copy(a->Cell[2]));
+    lval_free(a);
+
+    return x;
+}
+
+lval* builtin_map_del(lenv* e, lval* a) {
+    (void)e;
+
+    LASSERT_COUNT(a, "map-del", 2);
+    LASSERT_TYPE(a, "map-del", 0, LVAL_MAP);
+
+    lval* m = a->Cell[0];
+    lval* key = a->Cell[1];
+
+    if (!m->Hamt) {
+        lval* x = lval_copy(m);
+        lval_free(a);
+
+        return x;
+    }
+
+    bool removed = false;
+    lhamt* n = lhamt_del(m->Hamt, 0, lval_hash(key), key, &removed);
+
+    lval* x = lval_hashmap(n, m->Size - removed);
+    lval_free(a);
+
+    return x;
+}
+
+lval* builtin_map_has(lenv* e, lval* a) {
+    (void)e;
+
+    LASSERT_COUNT(a, "map-has", 2);
+    LASSERT_TYPE(a, "map-has", 0, LVAL_MAP);
+
+    bool has = lhamt_get(a->Cell[0]->Hamt, lval_hash(a->Cell[1]), a->Cell[1]) != NULL;
+    lval_free(a);
+
+    return lval_num(has);
+}
+
+lval* builtin_map_len(lenv* e, lval* a) {
+    (void)e;
+
+    LASSERT_COUNT(a, "map-len", 1);
+    LASSERT_TYPE(a, "map-len", 0, LVAL_MAP);
+
+    size_t n = a->Cell[0]->Size;
+    lval_free(a);
+
+    return lval_num(n);
+}
+
+lval* builtin_map_list(lval* a, lhamt_part part, char* name) {
+    LASSERT_COUNT(a, name, 1);
+    LASSERT_TYPE(a, name, 0, LVAL_MAP);
+
+    lval* l = lval_qexpr();
+    lval_reserve(l, a->Cell[0]->Size);
+
+    l = lhamt_list(a->Cell[0]->Hamt, l, part);
+    lval_free(a);
+
+    return l;
+}
+
+lval* builtin_map_keys(lenv* e, lval* a) { (void)e; return builtin_map_list(a, LHAMT_KEYS, "map-keys"); }
+lval* builtin_map_vals(lenv* e, lval* a) { (void)e; return builtin_map_list(a, LHAMT_VALS, "map-vals"); }
+lval* builtin_map_pairs(lenv* e, lval* a) { (void)e; return builtin_map_list(a, LHAMT_PAIRS, "map-pairs"); }
+
+// Folds `f` over the entries of `n`, calling (f z key value).
+lval* lhamt_fold(lenv* e, lval* f, lval* z, lhamt* n) {
+    for (uint32_t i = 0; n && i < n->Count && lval_type_of(z) != LVAL_ERR; ++i) {
+        lhamt_slot* s = &n->Slots[i];
+
+        if (!s->Key) {
+            z = lhamt_fold(e, f, z, s->Node);
+            continue;
+        }
+
+        lval* args = lval_add(lval_add(lval_sexpr(), z), lval_copy(s->Key));
+        z = lval_apply(e, f, lval_add(args, lval_copy(s->Val)));
+    }
+
+    return z;
+}
+
+// Iterates over a map without building a list of its entries.
+lval* builtin_map_fold(lenv* e, lval* a) {
+    LASSERT_COUNT(a, "map-fold", 3);
+    LASSERT_TYPE(a, "map-fold", 0, LVAL_FUN);
+    LASSERT_TYPE(a, "map-fold", 2, LVAL_MAP);
+
+    lval* result = lhamt_fold(e, a->Cell[0], lval_copy(a->Cell[1]), a->Cell[2]->Hamt);
+    lval_free(a);
+
+    return result;
+}
+
+lval* lval_parse_num(char* start, size_t length);
+
+// NOTE(daniel): the string builtins share characters where they can: substr
+// and str-split return views of their argument, and concat appends to its
+// first argument in place when nothing else uses the room after it, see
+// lval_str_extend.
+lval* builtin_str_len(lenv* e, lval* a) {
+    (void)e;
+
+    LASSERT_COUNT(a, "str-len", 1);
+    LASSERT_TYPE(a, "str-len", 0, LVAL_STR);
+
+    size_t n = a->Cell[0]->Length;
+    lval_free(a);
+
+    return lval_num(n);
+}
+
+// Returns `count` characters of a string from `start`.
+lval* builtin_substr(lenv* e, lval* a) {
+    (void)e;
+
+    LASSERT_COUNT(a, "substr", 3);
+    LASSERT_TYPE(a, "substr", 0, LVAL_STR);
+    LASSERT_TYPE(a, "substr", 1, LVAL_NUM);
+    LASSERT_TYPE(a, "substr", 2, LVAL_NUM);
+
+    lval* s = a->Cell[0];
+    long start = lval_num_of(a->Cell[1]);
+    long count = lval_num_of(a->Cell[2]);
+
+    LASSERT(a, start >= 0 && count >= 0 && (size_t)start <= s->Length && (size_t)count <= s->Length - start,
+        "Function 'substr' passed range %li+%li outside a string of %zu characters.", start, count, s->Length);
+
+    lval* x = lval_str_view(s->StrBuf, s->Str + start, count);
+    lval_free(a);
+
+    return x;
+}
+
+lval* builtin_concat(lenv* e, lval* a) {
+    (void)e;
+
+    LASSERT(a, a->Count > 0, "Function 'concat' passed no arguments.");
+
+    size_t n = 0;
+
+    for (size_t i = 0; i < a->Count; ++i) {
+        LASSERT_TYPE(a, "concat", i, LVAL_STR);
+        if (i) n += a->Cell[i]->Length;
+    }
+
+    char* tail;
+    lval* x = lval_str_extend(a->Cell[0], n, &tail);
+
+    for (size_t i = 1; i < a->Count; ++i) {
+        memcpy(tail, a->Cell[i]->Str, a->Cell[i]->Length);
+        tail += a->Cell[i]->Length;
+    }
+
+    lval_free(a);
+
+    return x;
+}
+
+// Splits a string at every occurrence of a separator.
+lval* builtin_str_split(lenv* e, lval* a) {
+    (void)e;
+
+    LASSERT_COUNT(a, "str-split", 2);
+    LASSERT_TYPE(a, "str-split", 0, LVAL_STR);
+    LASSERT_TYPE(a, "str-split", 1, LVAL_STR);
+    LASSERT(a, a->Cell[1]->Length != 0, "Function 'str-split' passed an empty separator.");
+
+    lval* s = a->Cell[0];
+    lval* sep = a->Cell[1];
+
+    char* end = s->Str + s->Length;
+    char* start = s->Str;
+    lval* x = lval_qexpr();
+
+    for (char* p = start; (size_t)(end - p) >= sep->Length;) {
+        p = memchr(p, sep->Str[0], end - p - sep->Length + 1);
+        if (!p) break;
+
+        if (memcmp(p, sep->Str, sep->Length) == 0) {
+            x = lval_add(x, lval_str_view(s->StrBuf, start, p - start));
+            start = p += sep->Length;
+        } else {
+            ++p;
+        }
+    }
+
+    x = lval_add(x, lval_str_view(s->StrBuf, start, end - start));
+    lval_free(a);
+
+    return x;
+}
+
+// Joins a list of strings with a separator, the inverse of str-split.
+lval* builtin_str_join(lenv* e, lval* a) {
+    (void)e;
+
+    LASSERT_COUNT(a, "str-join", 2);
+    LASSERT_TYPE(a, "str-join", 0, LVAL_QEXPR);
+    LASSERT_TYPE(a, "str-join", 1, LVAL_STR);
+
+    lval* l = a->Cell[0];
+    lval* sep = a->Cell[1];
+    size_t n = 0;
+
+    for (size_t i = 0; i < l->Count; ++i) {
+        lval_type type = lval_type_of(l->Cell[i]);
+
+        LASSERT(a, type == LVAL_STR,
+            "Function 'str-join' passed incorrect type in the list. Got %s, Expected %s.",
+            lval_type_name(type), lval_type_name(LVAL_STR));
+
+        n += l->Cell[i]->Length + (i ? sep->Length : 0);
+    }
+
+    if (!l->Count) {
+        lval_free(a);
+        return lval_str_n("", 0);
+    }
+
+    // Join onto the first string, so joining a single one copies nothing
+    char* tail;
+    lval* x = lval_str_extend(l->Cell[0], n - l->Cell[0]->Length, &tail);
+
+    for (size_t i = 1; i < l->Count; ++i) {
+        memcpy(tail, sep->Str, sep->Length);
+        memcpy(tail + sep->Length, l->Cell[i]->Str, l->Cell[i]->Length);
+        tail += sep->Length + l->Cell[i]->Length;
+    }
+
+    lval_free(a);
+
+    return x;
+}
+
+lval* builtin_str_to_num(lenv* e, lval* a) {
+    (void)e;
+
+    LASSERT_COUNT(a, "str->num", 1);
+    LASSERT_TYPE(a, "str->num", 0, LVAL_STR);
+
+    lval* x = lval_parse_num(a->Cell[0]->Str, a->Cell[0]->Length);
+
+    LASSERT(a, x, "Function 'str->num' passed \"%.*s\", which is not a number.",
+        (int)a->Cell[0]->Length, a->Cell[0]->Str);
+
+    lval_free(a);
+
+    return x;
+}
+
+// NOTE(daniel): the vector kernels are plain C, unrolled four elements at a
+// time into independent lanes, which gcc and clang turn into SIMD code at -O2
+// already (a simple loop is only vectorized at -O3). Arithmetic wraps around
+// like builtin_op instead of overflowing.
+typedef enum {
+    LVEC_ADD, LVEC_SUB, LVEC_MUL, LVEC_DIV,
+    LVEC_EQ, LVEC_LT, LVEC_GT, LVEC_LE, LVEC_GE,
+} lvec_op;
+
+// Runs the statement for every index `i` below `n`.
+#define LVEC_UNROLL(n, ...)                                                 \
+    for (size_t k = 0; k + 4 <= (n); k += 4) {                              \
+        { size_t i = k;     __VA_ARGS__ }                                   \
+        { size_t i = k + 1; __VA_ARGS__ }                                   \
+        { size_t i = k + 2; __VA_ARGS__ }                                   \
+        { size_t i = k + 3; __VA_ARGS__ }                                   \
+    }                                                                       \
+    for (size_t i = (n) & ~(size_t)3; i < (n); ++i) { __VA_ARGS__ }
+
+// Applies `expr` of the elements `a` and `b` of `x` and `y` into `z`. A
+// scalar operand (xs, ys) is its first element repeated.
+#define LVEC_MAP(expr)                                                      \
+    if (xs) {                                                               \
+        int64_t a = x[0];                                                   \
+        LVEC_UNROLL(n, int64_t b = y[i]; z[i] = (expr);)                    \
+    } else if (ys) {                                                        \
+        int64_t b = y[0];                                                   \
+        LVEC_UNROLL(n, int64_t a = x[i]; z[i] = (expr);)                    \
+    } else {                                                                \
+        LVEC_UNROLL(n, int64_t a = x[i]; int64_t b = y[i]; z[i] = (expr);)  \
+    }
+
+void lvec_map(lvec_op op, int64_t* restrict z,
+        const int64_t* restrict x, bool xs, const int64_t* restrict y, bool ys, size_t n) {
+    switch (op) {
+        case LVEC_ADD: LVEC_MAP((int64_t)((uint64_t)a + (uint64_t)b)); break;
+        case LVEC_SUB: LVEC_MAP((int64_t)((uint64_t)a - (uint64_t)b)); break;
+        case LVEC_MUL: LVEC_MAP((int64_t)((uint64_t)a * (uint64_t)b)); break;
+        case LVEC_DIV: LVEC_MAP(b == -1 ? (int64_t)(0 - (uint64_t)a) : a / b); break;
+        case LVEC_EQ:  LVEC_MAP(a == b); break;
+        case LVEC_LT:  LVEC_MAP(a < b); break;
+        case LVEC_GT:  LVEC_MAP(a > b); break;
+        case LVEC_LE:  LVEC_MAP(a <= b); break;
+        case LVEC_GE:  LVEC_MAP(a >= b); break;
+    }
+}
+
+#undef LVEC_MAP
+
+int64_t lvec_sum(const int64_t* restrict x, size_t n) {
+    uint64_t sum[4] = { 0 };
+    LVEC_UNROLL(n, sum[i & 3] += (uint64_t)x[i];)
+
+    return (int64_t)(sum[0] + sum[1] + sum[2] + sum[3]);
+}
+
+int64_t lvec_dot(const int64_t* restrict x, const int64_t* restrict y, size_t n) {
+    uint64_t sum[4] = { 0 };
+    LVEC_UNROLL(n, sum[i & 3] += (uint64_t)x[i] * (uint64_t)y[i];)
+
+    return (int64_t)(sum[0] + sum[1] + sum[2] + sum[3]);
+}
+
+int64_t lvec_min(const int64_t* restrict x, size_t n) {
+    int64_t min[4] = { x[0], x[0], x[0], x[0] };
+    LVEC_UNROLL(n, min[i & 3] = x[i] < min[i & 3] ? x[i] : min[i & 3];)
+
+    int64_t result = min[0];
+    for (size_t i = 1; i < 4; ++i) result = min[i] < result ? min[i] : result;
+
+    return result;
+}
+
+int64_t lvec_max(const int64_t* restrict x, size_t n) {
+    int64_t max[4] = { x[0], x[0], x[0], x[0] };
+    LVEC_UNROLL(n, max[i & 3] = x[i] > max[i & 3] ? x[i] : max[i & 3];)
+
+    int64_t result = max[0];
+    for (size_t i = 1; i < 4; ++i) result = max[i] > result ? max[i] : result;
+
+    return result;
+}
+
+#undef LVEC_UNROLL
+
+// NOTE(daniel): each prefix sum depends on the previous one, so this one
+// stays a plain loop.
+void lvec_scan(int64_t* restrict z, const int64_t* restrict x, size_t n) {
+    uint64_t sum = 0;
+
+    for (size_t i = 0; i < n; ++i) {
+        sum += (uint64_t)x[i];
+        z[i] = (int64_t)sum;
+    }
+}
+
+lval* builtin_vec(lenv* e, lval* a) {
+    (void)e;
+
+    LASSERT_COUNT(a, "vec", 1);
+    LASSERT_TYPE(a, "vec", 0, LVAL_QEXPR);
+
+    lval* l = a->Cell[0];
+
+    for (size_t i = 0; i < l->Count; ++i) {
+        LASSERT(a, lval_type_of(l->Cell[i]) == LVAL_NUM,
+            "Function 'vec' passed incorrect type for element %i. Got %s, Expected %s.",
+            i, lval_type_name(lval_type_of(l->Cell[i])), lval_type_name(LVAL_NUM));
+    }
+
+    lval* v = lval_vec(l->Count);
+
+    if (lval_type_of(v) == LVAL_ERR) {
+        lval_free(a);
+        return v;
+    }
+
+    for (size_t i = 0; i < l->Count; ++i) v->Vec->Data[i] = lval_num_of(l->Cell[i]);
+
+    lval_free(a);
+
+    return v;
+}
+
+lval* builtin_vlist(lenv* e, lval* a) {
+    (void)e;
+
+    LASSERT_COUNT(a, "vlist", 1);
+    LASSERT_TYPE(a, "vlist", 0, LVAL_VEC);
+
+    lvec* x = a->Cell[0]->Vec;
+    lval* l = lval_qexpr();
+    lval_reserve(l, x->Count);
+
+    for (size_t i = 0; i < x->Count; ++i) l = lval_add(l, lval_num(x->Data[i]));
+
+    lval_free(a);
+
+    return l;
+}
+
+lval* builtin_vrange(lenv* e, lval* a) {
+    (void)e;
+
+    LASSERT_COUNT(a, "vrange", 1);
+    LASSERT_TYPE(a, "vrange", 0, LVAL_NUM);
+
+    long n = lval_num_of(a->Cell[0]);
+    LASSERT(a, n >= 0, "Function 'vrange' passed negative length %li.", n);
+
+    lval_free(a);
+
+    lval* v = lval_vec(n);
+    if (lval_type_of(v) == LVAL_ERR) return v;
+
+    for (long i = 0; i < n; ++i) v->Vec->Data[i] = i;
+
+    return v;
+}
+
+lval* builtin_vlen(lenv* e, lval* a) {
+    (void)e;
+
+    LASSERT_COUNT(a, "vlen", 1);
+    LASSERT_TYPE(a, "vlen", 0, LVAL_VEC);
+
+    size_t n = a->Cell[0]->Vec->Count;
+    lval_free(a);
+
+    return lval_num(n);
+}
+
+// Applies `op` elementwise to two vectors of the same length, or to a vector
+// and a number.
+lval* builtin_vop(lenv* e, lval* a, lvec_op op, char* name) {
+    (void)e;
+
+    LASSERT_COUNT(a, name, 2);
+
+    for (size_t i = 0; i < 2; ++i) {
+        lval_type type = lval_type_of(a->Cell[i]);
+
+        LASSERT(a, type == LVAL_VEC || type == LVAL_NUM,
+            "Function '%s' passed incorrect type for argument %i. Got %s, Expected %s or %s.",
+            name, i, lval_type_name(type), lval_type_name(LVAL_VEC), lval_type_name(LVAL_NUM));
+    }
+
+    bool xs = lval_type_of(a->Cell[0]) == LVAL_NUM;
+    bool ys = lval_type_of(a->Cell[1]) == LVAL_NUM;
+
+    LASSERT(a, !xs || !ys, "Function '%s' passed no vector.", name);
+
+    int64_t xn = xs ? lval_num_of(a->Cell[0]) : 0;
+    int64_t yn = ys ? lval_num_of(a->Cell[1]) : 0;
+    lvec* x = xs ? NULL : a->Cell[0]->Vec;
+    lvec* y = ys ? NULL : a->Cell[1]->Vec;
+
+    LASSERT(a, xs || ys || x->Count == y->Count,
+        "Function '%s' passed vectors of different lengths. Got %i and %i.", name, x->Count, y->Count);
+
+    size_t n = xs ? y->Count : x->Count;
+    int64_t* yd = ys ? &yn : y->Data;
+
+    if (op == LVEC_DIV) {
+        for (size_t i = 0; i < (ys ? 1 : n); ++i) {
+            if (yd[i] == 0) {
+                lval_free(a);
+                return lval_err("Division by zero");
+            }
+        }
+    }
+
+    lval* z = lval_vec(n);
+
+    if (lval_type_of(z) == LVAL_ERR) {
+        lval_free(a);
+        return z;
+    }
+
+    lvec_map(op, z->Vec->Data, xs ? &xn : x->Data, xs, yd, ys, n);
+
+    lval_free(a);
+
+    return z;
+}
+
+lval* builtin_vadd(lenv* e, lval* a) { return builtin_vop(e, a, LVEC_ADD, "v+"); }
+lval* builtin_vsub(lenv* e, lval* a) { return builtin_vop(e, a, LVEC_SUB, "v-"); }
+lval* builtin_vmul(lenv* e, lval* a) { return builtin_vop(e, a, LVEC_MUL, "v*"); }
+lval* builtin_vdiv(lenv* e, lval* a) { return builtin_vop(e, a, LVEC_DIV, "v/"); }
+lval* builtin_veq(lenv* e, lval* a) { return builtin_vop(e, a, LVEC_EQ, "v=="); }
+lval* builtin_vlt(lenv* e, lval* a) { return builtin_vop(e, a, LVEC_LT, "v<"); }
+lval* builtin_vgt(lenv* e, lval* a) { return builtin_vop(e, a, LVEC_GT, "v>"); }
+lval* builtin_vle(lenv* e, lval* a) { return builtin_vop(e, a, LVEC_LE, "v<="); }
+lval* builtin_vge(lenv* e, lval* a) { return builtin_vop(e, a, LVEC_GE, "v>="); }
+
+lval* builtin_vsum(lenv* e, lval* a) {
+    (void)e;
+
+    LASSERT_COUNT(a, "vsum", 1);
+    LASSERT_TYPE(a, "vsum", 0, LVAL_VEC);
+
+    lvec* x = a->Cell[0]->Vec;
+    int64_t sum = lvec_sum(x->Data, x->Count);
+
+    lval_free(a);
+
+    return lval_num(sum);
+}
+
+lval* builtin_vdot(lenv* e, lval* a) {
+    (void)e;
+
+    LASSERT_COUNT(a, "vdot", 2);
+    LASSERT_TYPE(a, "vdot", 0, LVAL_VEC);
+    LASSERT_TYPE(a, "vdot", 1, LVAL_VEC);
+
+    lvec* x = a->Cell[0]->Vec;
+    lvec* y = a->Cell[1]->Vec;
+
+    LASSERT(a, x->Count == y->Count,
+        "Function 'vdot' passed vectors of different lengths. Got %i and %i.", x->Count, y->Count);
+
+    int64_t dot = lvec_dot(x->Data, y->Data, x->Count);
+
+    lval_free(a);
+
+    return lval_num(dot);
+}
+
+lval* builtin_vminmax(lenv* e, lval* a, bool max) {
+    (void)e;
+
+    char* name = max ? "vmax" : "vmin";
+
+    LASSERT_COUNT(a, name, 1);
+    LASSERT_TYPE(a, name, 0, LVAL_VEC);
+
+    lvec* x = a->Cell[0]->Vec;
+    LASSERT(a, x->Count > 0, "Function '%s' passed an empty vector.", name);
+
+    int64_t result = max ? lvec_max(x->Data, x->Count) : lvec_min(x->Data, x->Count);
+
+    lval_free(a);
+
+    return lval_num(result);
+}
+
+lval* builtin_vmin(lenv* e, lval* a) { return builtin_vminmax(e, a, false); }
+lval* builtin_vmax(lenv* e, lval* a) { return builtin_vminmax(e, a, true); }
+
+lval* builtin_vscan(lenv* e, lval* a) {
+    (void)e;
+
+    LASSERT_COUNT(a, "vscan", 1);
+    LASSERT_TYPE(a, "vscan", 0, LVAL_VEC);
+
+    lvec* x = a->Cell[0]->Vec;
+    lval* z = lval_vec(x->Count);
+
+    if (lval_type_of(z) == LVAL_ERR) {
+        lval_free(a);
+        return z;
+    }
+
+    lvec_scan(z->Vec->Data, x->Data, x->Count);
+
+    lval_free(a);
+
+    return z;
+}
+
+#undef LASSERT
+#undef LASSERT_COUNT 
+#undef LASSERT_TYPE
+
+// The builtins bound in the root environment of every interpreter. Their
+// immediates are their indices here.
+lbuiltin_entry lbuiltin_list[] = {
+    { "list", builtin_list },
+    { "head", builtin_head },
+    { "tail", builtin_tail },
+    { "join", builtin_join },
+    { "eval", builtin_eval },
+
+    { "len", builtin_len },
+    { "nth", builtin_nth },
+    { "last", builtin_last },
+    { "elem", builtin_elem },
+    { "map", builtin_map },
+    { "filter", builtin_filter },
+    { "foldl", builtin_foldl },
+    { "sum", builtin_sum },
+    { "product", builtin_product },
+    { "take", builtin_take },
+    { "drop", builtin_drop },
+    { "split", builtin_split },
+    { "reverse", builtin_reverse },
+    { "pmap", builtin_pmap },
+    { "pfilter", builtin_pfilter },
+    { "preduce", builtin_preduce },
+
+    { "def", builtin_def },
+    { "=", builtin_put },
+    { "\\", builtin_lambda },
+
+    { "+", builtin_add },
+    { "-", builtin_sub },
+    { "*", builtin_mul },
+    { "/", builtin_div },
+
+    { "if", builtin_if },
+    { "==", builtin_eq },
+    { "!=", builtin_ne },
+    { ">", builtin_gt },
+    { "<", builtin_lt },
+    { ">=", builtin_ge },
+    { "<=", builtin_le },
+
+    { "load", builtin_load },
+    { "print", builtin_print },
+    { "show", builtin_show },
+    { "error", builtin_error },
+    { "stats", builtin_stats },
+    { "memo", builtin_memo },
+    { "memo-stats", builtin_memo_stats },
+
+    { "hash-map", builtin_hash_map },
+    { "map-get", builtin_map_get },
+    { "map-put", builtin_map_put },
+    { "map-del", builtin_map_del },
+    { "map-has", builtin_map_has },
+    { "map-len", builtin_map_len },
+    { "map-keys", builtin_map_keys },
+    { "map-vals", builtin_map_vals },
+    { "map-pairs", builtin_map_pairs },
+    { "map-fold", builtin_map_fold },
+
+    { "str-len", builtin_str_len },
+    { "substr", builtin_substr },
+    { "concat", builtin_concat },
+    { "str-split", builtin_str_split },
+    { "str-join", builtin_str_join },
+    { "str->num", builtin_str_to_num },
+
+    { "vec", builtin_vec },
+    { "vlist", builtin_vlist },
+    { "vrange", builtin_vrange },
+    { "vlen", builtin_vlen },
+    { "v+", builtin_vadd },
+    { "v-", builtin_vsub },
+    { "v*", builtin_vmul },
+    { "v/", builtin_vdiv },
+    { "v==", builtin_veq },
+    { "v<", builtin_vlt },
+    { "v>", builtin_vgt },
+    { "v<=", builtin_vle },
+    { "v>=", builtin_vge },
+    { "vsum", builtin_vsum },
+    { "vdot", builtin_vdot },
+    { "vmin", builtin_vmin },
+    { "vmax", builtin_vmax },
+    { "vscan", builtin_vscan },
+};
+
+// Fills the builtin table, see lval_builtins.
+void lval_builtins_init(void) {
+    lval_builtins.Entries = lbuiltin_list;
+    lval_builtins.Count = sizeof(lbuiltin_list) / sizeof(lbuiltin_list[0]);
+}
+
+void lenv_add_builtins(lenv* e) {
+    call_once(&lval_builtins.Once, lval_builtins_init);
+
+    for (size_t i = 0; i < lval_builtins.Count; ++i) {
+        lenv_add_builtin(e, lval_builtins.Entries[i].Name, lval_builtins.Entries[i].Fun);
+    }
+}
+
+// Returns a partial application of the lambda `f`, which shares its formals,
+// body and code and holds the arguments bound so far. Takes ownership of `a`.
+lval* lval_partial(lval* f, lval* a) {
+    lval* v = lval_clone(f);
+    lval* args = v->Args ? v->Args : lval_qexpr();
+
+    v->Args = lval_join(args, a);
+
+    return v;
+}
+
+// Binds the arguments `a`, after those already held by the lambda `f`, to its
+// formals. Once all of them are bound, returns NULL and the activation frame
+// in `frame`. Otherwise returns a partial application or an error.
+// Takes ownership of `a` only, `f` itself is never modified.
+lval* lval_bind(lval* f, lval* a, lenv** frame) {
+    lval* formals = f->Formals;
+    size_t bound = f->Args ? f->Args->Count : 0;
+
+    // NOTE(daniel): find the formal the arguments end at first, so nothing is
+    // bound unless the call is valid.
+    size_t given = a->Count;
+    size_t next = bound;
+
+    while (next < formals->Count && next - bound < given && formals->Cell[next]->Sym != lsym_table->Amp) {
+        ++next;
+    }
+
+    bool rest = next < formals->Count && formals->Cell[next]->Sym == lsym_table->Amp;
+
+    if (!rest && next - bound < given) {
+        lval_free(a);
+        return lval_err("Function passed too many arguments. Got %i, Expected %i.",
+            (int)given, (int)(formals->Count - bound));
+    }
+
+    if (rest && formals->Count - next != 2) {
+        lval_free(a);
+        return lval_err("Function format invalid. Symbol '&' not followed by single symbol.");
+    }
+
+    if (!rest && next < formals->Count) {
+        if (given == 0) {
+            lval_free(a);
+            return lval_copy(f);
+        }
+
+        return lval_partial(f, a);
+    }
+
+    lenv* e = lenv_new_frame(formals);
+    size_t slot = 0;
+
+    for (size_t i = 0; i < bound; ++i) {
+        lenv_put(e, formals->Cell[slot++], f->Args->Cell[i]);
+    }
+
+    size_t i = 0;
+    for (; slot < next; ++i) {
+        lenv_put(e, formals->Cell[slot++], a->Cell[i]);
+    }
+
+    // NOTE(daniel): the formal after '&' gets the remaining arguments, if any.
+    if (rest) {
+        lval* list = lval_slice(a, i, given - i);
+        list->Type = LVAL_QEXPR;
+
+        lenv_put(e, formals->Cell[slot + 1], list);
+        lval_free(list);
+    }
+
+    lval_free(a);
+
+    *frame = e;
+    return NULL;
+}
+
+// Evaluates the body of the lambda `f` in its activation frame `frame`.
+// Takes ownership of both.
+lval* lval_run(lenv* e, lval* f, lenv* frame) {
+    frame->Parent = e;
+
+    if (f->Code) return lvm_run(f, frame);
+
+    if (prof->Enabled) lprof_enter(f);
+
+    lval* result = builtin_eval(frame, lval_add(lval_sexpr(), lval_copy(f->Body)));
+    lenv_free(frame);
+    lval_free(f);
+
+    if (prof->Enabled) lprof_exit();
+
+    return result;
+}
+
+// Calls the memoized lambda `f`, which only runs on a cache miss.
+lval* lval_call_memo(lenv* e, lval* f, lval* a) {
+    lmemo* m = f->Memo;
+
+    // NOTE(daniel): the cache is shared with the main thread, workers just
+    // call the lambda.
+    if (lpar_worker) {
+        lval* g = lval_copy(m->Fun);
+        lval_free(f);
+
+        return lval_call(e, g, a);
+    }
+    size_t hash = lval_hash(a);
+    lval* result = lmemo_get(m, a, hash);
+
+    if (result) {
+        ++m->Hits;
+        lval_free(a);
+    } else {
+        ++m->Misses;
+        result = lval_call(e, lval_copy(m->Fun), lval_clone(a));
+
+        // NOTE(daniel): errors aren't cached, they may well be caused by the
+        // environment (an unbound symbol) rather than the arguments.
+        if (lval_type_of(result) != LVAL_ERR) {
+            lmemo_put(m, a, hash, lval_copy(result));
+        } else {
+            lval_free(a);
+        }
+    }
+
+    lval_free(f);
+
+    return result;
+}
+
+// NOTE(daniel): takes ownership of both the function and its arguments.
+lval* lval_call(lenv *e, lval* f, lval* a) {
+    ++stats->Calls;
+
+    lbuiltin builtin = lval_builtin_of(f);
+
+    if (builtin) {
+        if (prof->Enabled) lprof_enter(f);
+
+        ++heap->Depth;
+        lval* result = builtin(e, a);
+        --heap->Depth;
+
+        if (prof->Enabled) lprof_exit();
+
+        return result;
+    }
+
+    if (f->Memo) return lval_call_memo(e, f, a);
+
+    // NOTE(daniel): if all formals have been bound evaluate the function,
+    // otherwise return the partially applied function (or the error).
+    lenv* frame = NULL;
+    lval* partial = lval_bind(f, a, &frame);
+
+    if (partial) {
+        lval_free(f);
+        return partial;
+    }
+
+    return lval_run(e, f, frame);
+}
+
+// NOTE(daniel): lambdas are compiled when they are created, unless the tree
+// walking evaluator is requested with --tree-walk (useful to compare both),
+// see TreeWalk.
+void lcode_emit(lcode* c, lop op, size_t arg) {
+    if (c->Count == c->Capacity) {
+        c->Capacity = c->Capacity ? c->Capacity * 2 : 16;
+        c->Instrs = realloc(c->Instrs, sizeof(linstr) * c->Capacity);
+    }
+
+    c->Instrs[c->Count++] = (linstr) { .Op = op, .Arg = (uint32_t)arg };
+}
+
+size_t lcode_const(lcode* c, lval* v) {
+    if (c->ConstCount == c->ConstCapacity) {
+        c->ConstCapacity = c->ConstCapacity ? c->ConstCapacity * 2 : 8;
+        c->Consts = realloc(c->Consts, sizeof(lval*) * c->ConstCapacity);
+    }
+
+    c->Consts[c->ConstCount] = lval_copy(v);
+
+    return c->ConstCount++;
+}
+
+// Returns the slot index of the formal `sym`, or -1.
+ptrdiff_t lcode_formal(lval* formals, char* sym) {
+    if (sym == lsym_table->Amp) return -1;
+
+    for (size_t i = 0; i < formals->Count; ++i) {
+        if (formals->Cell[i]->Sym == sym) return i;
+    }
+
+    return -1;
+}
+
+void lcode_compile_sexpr(lcode* c, lval* formals, lval* v, bool tail);
+
+void lcode_compile_expr(lcode* c, lval* formals, lval* v) {
+    switch (lval_type_of(v)) {
+        case LVAL_SYM: {
+            ptrdiff_t slot = lcode_formal(formals, v->Sym);
+
+            if (slot >= 0) {
+                lcode_emit(c, OP_LOAD_LOCAL, slot);
+            } else {
+                lcode_emit(c, OP_LOAD_GLOBAL, lcode_const(c, v));
+            }
+        } break;
+        case LVAL_SEXPR: {
+            lcode_compile_sexpr(c, formals, v, false);
+        } break;
+        default: {
+            lcode_emit(c, OP_CONST, lcode_const(c, v));
+        } break;
+    }
+}
+
+// NOTE(daniel): an S-Expression evaluates all of its children and then calls
+// the first one. The common shape (if cond {then} {else}) is compiled to
+// jumps, guarded at runtime by OP_IF in case 'if' has been redefined. The
+// body itself and the branches of an 'if' in tail position are tail calls.
+void lcode_compile_sexpr(lcode* c, lval* formals, lval* v, bool tail) {
+    lop call = tail ? OP_TAIL_CALL : OP_CALL;
+
+    bool is_if = v->Count == 4
+        && lval_type_of(v->Cell[0]) == LVAL_SYM && v->Cell[0]->Sym == lsym_table->If
+        && lval_type_of(v->Cell[2]) == LVAL_QEXPR && lval_type_of(v->Cell[3]) == LVAL_QEXPR;
+
+    if (!is_if) {
+        for (size_t i = 0; i < v->Count; ++i) {
+            lcode_compile_expr(c, formals, v->Cell[i]);
+        }
+
+        lcode_emit(c, call, v->Count);
+
+        return;
+    }
+
+    lcode_compile_expr(c, formals, v->Cell[0]);
+    lcode_compile_expr(c, formals, v->Cell[1]);
+
+    size_t guard = c->Count;
+    lcode_emit(c, OP_IF, 0);
+
+    size_t branch = c->Count;
+    lcode_emit(c, OP_JUMP_IF_NOT, 0);
+
+    lcode_compile_sexpr(c, formals, v->Cell[2], tail);
+
+    size_t then_end = c->Count;
+    lcode_emit(c, OP_JUMP, 0);
+
+    c->Instrs[branch].Arg = c->Count;
+    lcode_compile_sexpr(c, formals, v->Cell[3], tail);
+
+    size_t else_end = c->Count;
+    lcode_emit(c, OP_JUMP, 0);
+
+    // NOTE(daniel): the generic path calls whatever 'if' is bound to.
+    c->Instrs[guard].Arg = c->Count;
+    lcode_emit(c, OP_CONST, lcode_const(c, v->Cell[2]));
+    lcode_emit(c, OP_CONST, lcode_const(c, v->Cell[3]));
+    lcode_emit(c, call, 4);
+
+    c->Instrs[then_end].Arg = c->Count;
+    c->Instrs[else_end].Arg = c->Count;
+}
+
+lcode* lcode_compile(lval* formals, lval* body) {
+    if (lispy_current->TreeWalk) return NULL;
+
+    lcode* c = calloc(1, sizeof(lcode));
+    c->Refs = 1;
+
+    // NOTE(daniel): the body is a Q-Expression that is evaluated as an S-Expression.
+    lcode_compile_sexpr(c, formals, body, true);
+    lcode_emit(c, OP_RETURN, 0);
+
+    return c;
+}
+
+void lcode_free(lcode* c) {
+    if (c->Refs >= LREFS_FROZEN || --c->Refs > 0) return;
+
+    for (size_t i = 0; i < c->ConstCount; ++i) {
+        lval_free(c->Consts[i]);
+    }
+
+    free(c->Instrs);
+    free(c->Consts);
+    free(c);
+}
+
+void lvm_push(lval* v) {
+    if (vm->Count == vm->Capacity) {
+        vm->Capacity = vm->Capacity ? vm->Capacity * 2 : 256;
+        vm->Stack = realloc(vm->Stack, sizeof(lval*) * vm->Capacity);
+    }
+
+    vm->Stack[vm->Count++] = v;
+}
+
+void lvm_push_frame(lval* f, lenv* env) {
+    if (vm->FrameCount == vm->FrameCapacity) {
+        vm->FrameCapacity = vm->FrameCapacity ? vm->FrameCapacity * 2 : 64;
+        vm->Frames = realloc(vm->Frames, sizeof(lframe) * vm->FrameCapacity);
+    }
+
+    vm->Frames[vm->FrameCount++] = (lframe) { .Fun = f, .Env = env, .Pc = 0, .Kept = 0, .Profiled = 0 };
+
+    if (prof->Enabled) {
+        lprof_enter(f);
+        vm->Frames[vm->FrameCount - 1].Profiled = 1;
+    }
+}
+
+// Returns true if every symbol bound in `e` is also bound in `n`, that is,
+// if no lookup through `n` can ever observe `e`.
+bool lenv_shadows(lenv* n, lenv* e) {
+    for (size_t i = 0; i < lenv_slot_count(e); ++i) {
+        if (e->Slots[i] && !lenv_lookup(n, lenv_slot_sym(e, i))) return false;
+    }
+
+    for (size_t i = 0; i < e->Capacity; ++i) {
+        if (e->Syms[i] && !lenv_lookup(n, e->Syms[i])) return false;
+    }
+
+    return true;
+}
+
+// Replaces the running frame with the lambda `f` for a tail call.
+//
+// NOTE(daniel): scoping is dynamic, so the callee normally sees the caller's
+// bindings through its parent. The caller's frame can only be dropped when
+// the callee shadows all of them (always the case for self recursion).
+// Otherwise it stays alive as the parent of the new one, but the C stack
+// still doesn't grow.
+void lvm_tail_call(lval* f, lenv* env) {
+    lframe* frame = &vm->Frames[vm->FrameCount - 1];
+    lenv* current = frame->Env;
+
+    if (lenv_shadows(env, current)) {
+        env->Parent = current->Parent;
+        lenv_free(current);
+    } else {
+        env->Parent = current;
+        ++frame->Kept;
+    }
+
+    lval_free(frame->Fun);
+
+    frame->Fun = f;
+    frame->Env = env;
+    frame->Pc = 0;
+
+    if (prof->Enabled) lprof_tail_call(f, &frame->Profiled);
+}
+
+// Evaluates the S-Expression made of the top `n` values of the stack, the
+// same way lval_eval_sexpr does. Calls to compiled lambdas push a new frame
+// (or replace the current one for tail calls) instead of recursing,
+// everything else leaves its result on the stack.
+void lvm_call(lenv* e, size_t n, bool tail) {
+    lval** args = &vm->Stack[vm->Count - n];
+
+    ++stats->Evals;
+
+    // Error checking
+    for (size_t i = 0; i < n; ++i) {
+        if (lval_type_of(args[i]) == LVAL_ERR) {
+            lval* err = lval_copy(args[i]);
+
+            for (size_t j = 0; j < n; ++j) lval_free(args[j]);
+            vm->Count -= n;
+
+            lvm_push(err);
+            return;
+        }
+    }
+
+    // Empty expression
+    if (n == 0) {
+        lvm_push(lval_sexpr());
+        return;
+    }
+
+    // Single expression
+    if (n == 1) return;
+
+    // Ensure first element is a function
+    lval* f = args[0];
+    if (lval_type_of(f) != LVAL_FUN) {
+        lval* err = lval_err("S-expression does not start with function. Got %s, Expected %s.",
+            lval_type_name(lval_type_of(f)), lval_type_name(LVAL_FUN));
+
+        for (size_t j = 0; j < n; ++j) lval_free(args[j]);
+        vm->Count -= n;
+
+        lvm_push(err);
+        return;
+    }
+
+    lval* a = lval_sexpr();
+    lval_reserve(a, n - 1);
+    memcpy(a->Cell, &args[1], sizeof(lval*) * (n - 1));
+    a->Count = n - 1;
+    if (a->Buf) a->Buf->Count = n - 1;
+
+    vm->Count -= n;
+
+    if (lval_is_imm(f) || f->Memo) {
+        lvm_push(lval_call(e, f, a));
+        return;
+    }
+
+    ++stats->Calls;
+
+    lenv* frame = NULL;
+    lval* partial = lval_bind(f, a, &frame);
+
+    if (partial) {
+        lval_free(f);
+        lvm_push(partial);
+    } else if (!f->Code) {
+        lvm_push(lval_run(e, f, frame));
+    } else if (tail) {
+        lvm_tail_call(f, frame);
+    } else {
+        frame->Parent = e;
+        lvm_push_frame(f, frame);
+    }
+}
+
+// Runs the compiled lambda `f` in its activation frame `e`.
+lval* lvm_run(lval* f, lenv* e) {
+    size_t entry = vm->FrameCount;
+    lvm_push_frame(f, e);
+
+    for (;;) {
+        lframe* frame = &vm->Frames[vm->FrameCount - 1];
+        lcode* code = frame->Fun->Code;
+        lenv* env = frame->Env;
+        linstr in = code->Instrs[frame->Pc++];
+
+        switch (in.Op) {
+            case OP_CONST: {
+                lvm_push(lval_copy(code->Consts[in.Arg]));
+            } break;
+            case OP_LOAD_LOCAL: {
+                lval* v = env->Slots[in.Arg];
+                lvm_push(v ? lval_copy(v) : lenv_get(env, env->Params->Cell[in.Arg]));
+            } break;
+            case OP_LOAD_GLOBAL: {
+                lvm_push(lenv_get(env, code->Consts[in.Arg]));
+            } break;
+            case OP_CALL: {
+                lvm_call(env, in.Arg, false);
+            } break;
+            case OP_TAIL_CALL: {
+                lvm_call(env, in.Arg, true);
+            } break;
+            case OP_IF: {
+                lval* fun = vm->Stack[vm->Count - 2];
+                lval* cond = vm->Stack[vm->Count - 1];
+
+                if (lval_builtin_of(fun) != builtin_if || lval_type_of(cond) != LVAL_NUM) {
+                    frame->Pc = in.Arg;
+                    break;
+                }
+
+                vm->Stack[vm->Count - 2] = cond;
+                --vm->Count;
+
+                lval_free(fun);
+            } break;
+            case OP_JUMP_IF_NOT: {
+                lval* cond = vm->Stack[--vm->Count];
+
+                if (!lval_num_of(cond)) frame->Pc = in.Arg;
+
+                lval_free(cond);
+            } break;
+            case OP_JUMP: {
+                frame->Pc = in.Arg;
+            } break;
+            case OP_RETURN: {
+                lval* result = vm->Stack[--vm->Count];
+
+                for (size_t i = 0; i <= frame->Kept; ++i) {
+                    lenv* parent = env->Parent;
+                    lenv_free(env);
+                    env = parent;
+                }
+
+                lval_free(frame->Fun);
+                --vm->FrameCount;
+
+                for (size_t i = 0; i < frame->Profiled; ++i) lprof_exit();
+
+                if (vm->FrameCount == entry) return result;
+
+                lvm_push(result);
+            } break;
+        }
+    }
+}
+
+lval* lval_eval_sexpr(lenv* e, lval* v) {
+    ++stats->Evals;
+
+    // NOTE(daniel): the children are replaced in place by their values.
+    v = lval_unshare(v);
+    lval_own_cells(v);
+
+    // Recursively evaluate children
+    for (size_t i = 0; i < v->Count; ++i) {
+        v->Cell[i] = lval_eval(e, v->Cell[i]);
+    }
+
+    // Error checking
+    for (size_t i = 0; i < v->Count; ++i) {
+        if (lval_type_of(v->Cell[i]) == LVAL_ERR) return lval_take(v, i);
+    }
+
+    // Empty expression
+    if (v->Count == 0) return v;
+
+    // Single expression
+    if (v->Count == 1) return lval_take(v, 0);
+
+    // Ensure first element is a function
+    lval* f = lval_pop(v, 0);
+    if (lval_type_of(f) != LVAL_FUN) {
+        lval* err = lval_err("S-expression does not start with function. Got %s, Expected %s.",
+            lval_type_name(lval_type_of(f)), lval_type_name(LVAL_FUN));
+
+        lval_free(f);
+        lval_free(v);
+
+        return err;
+    }
+
+    // Call builtin with operator
+    return lval_call(e, f, v);
+}
+
+// NOTE(daniel): the reader works on a slice of the source, which doesn't have
+// to be NUL terminated (a mapped file isn't). Symbols are interned and strings
+// copied straight from the source, so nothing is allocated per character.
+typedef struct {
+    char* Pos;
+    char* End;
+} lreader;
+
+enum {
+    LCHAR_SPACE   = 1 << 0,
+    LCHAR_COMMENT = 1 << 1,
+    LCHAR_SYM     = 1 << 2,
+    LCHAR_DIGIT   = 1 << 3,
+};
+
+const unsigned char lreader_class[256] = {
+    [' '] = LCHAR_SPACE, ['\t'] = LCHAR_SPACE, ['\v'] = LCHAR_SPACE, ['\r'] = LCHAR_SPACE, ['\n'] = LCHAR_SPACE,
+    [';'] = LCHAR_COMMENT,
+    ['a'] = LCHAR_SYM, ['b'] = LCHAR_SYM, ['c'] = LCHAR_SYM, ['d'] = LCHAR_SYM, ['e'] = LCHAR_SYM, ['f'] = LCHAR_SYM,
+    ['g'] = LCHAR_SYM, ['h'] = LCHAR_SYM, ['i'] = LCHAR_SYM, ['j'] = LCHAR_SYM, ['k'] = LCHAR_SYM, ['l'] = LCHAR_SYM,
+    ['m'] = LCHAR_SYM, ['n'] = LCHAR_SYM, ['o'] = LCHAR_SYM, ['p'] = LCHAR_SYM, ['q'] = LCHAR_SYM, ['r'] = LCHAR_SYM,
+    ['s'] = LCHAR_SYM, ['t'] = LCHAR_SYM, ['u'] = LCHAR_SYM, ['v'] = LCHAR_SYM, ['w'] = LCHAR_SYM, ['x'] = LCHAR_SYM,
+    ['y'] = LCHAR_SYM, ['z'] = LCHAR_SYM,
+    ['A'] = LCHAR_SYM, ['B'] = LCHAR_SYM, ['C'] = LCHAR_SYM, ['D'] = LCHAR_SYM, ['E'] = LCHAR_SYM, ['F'] = LCHAR_SYM,
+    ['G'] = LCHAR_SYM, ['H'] = LCHAR_SYM, ['I'] = LCHAR_SYM, ['J'] = LCHAR_SYM, ['K'] = LCHAR_SYM, ['L'] = LCHAR_SYM,
+    ['M'] = LCHAR_SYM, ['N'] = LCHAR_SYM, ['O'] = LCHAR_SYM, ['P'] = LCHAR_SYM, ['Q'] = LCHAR_SYM, ['R'] = LCHAR_SYM,
+    ['S'] = LCHAR_SYM, ['T'] = LCHAR_SYM, ['U'] = LCHAR_SYM, ['V'] = LCHAR_SYM, ['W'] = LCHAR_SYM, ['X'] = LCHAR_SYM,
+    ['Y'] = LCHAR_SYM, ['Z'] = LCHAR_SYM,
+    ['0'] = LCHAR_SYM | LCHAR_DIGIT, ['1'] = LCHAR_SYM | LCHAR_DIGIT, ['2'] = LCHAR_SYM | LCHAR_DIGIT, ['3'] = LCHAR_SYM | LCHAR_DIGIT,
+    ['4'] = LCHAR_SYM | LCHAR_DIGIT, ['5'] = LCHAR_SYM | LCHAR_DIGIT, ['6'] = LCHAR_SYM | LCHAR_DIGIT, ['7'] = LCHAR_SYM | LCHAR_DIGIT,
+    ['8'] = LCHAR_SYM | LCHAR_DIGIT, ['9'] = LCHAR_SYM | LCHAR_DIGIT,
+    ['_'] = LCHAR_SYM, ['+'] = LCHAR_SYM, ['-'] = LCHAR_SYM, ['*'] = LCHAR_SYM, ['\\'] = LCHAR_SYM, ['/'] = LCHAR_SYM,
+    ['='] = LCHAR_SYM, ['<'] = LCHAR_SYM, ['>'] = LCHAR_SYM, ['!'] = LCHAR_SYM, ['&'] = LCHAR_SYM,
+};
+
+lreader lreader_new(char* s, size_t length) {
+    return (lreader) { .Pos = s, .End = s + length };
+}
+
+char lreader_peek(lreader* r) {
+    return r->Pos < r->End ? *r->Pos : '\0';
+}
+
+unsigned char lreader_class_of(lreader* r) {
+    return r->Pos < r->End ? lreader_class[(unsigned char)*r->Pos] : 0;
+}
+
+// Skips whitespace and comments
+void lreader_skip(lreader* r) {
+    for (;;) {
+        unsigned char class = lreader_class_of(r);
+
+        if (class & LCHAR_SPACE) {
+            ++r->Pos;
+        } else if (class & LCHAR_COMMENT) {
+            while (r->Pos < r->End && *r->Pos != '\n') ++r->Pos;
+        } else {
+            return;
+        }
+    }
+}
+
+lval* lval_read(lreader* r);
+
+lval* lval_read_expr(lreader* r, char end) {
+    lval* x = (end == '}') ? lval_qexpr() : lval_sexpr();
+
+    while (lreader_peek(r) != end) {
+        lval* y = lval_read(r);
+
+        if (lval_type_of(y) == LVAL_ERR) {
+            lval_free(x);
+
+            return y;
+        }
+
+        lval_add(x, y);
+    }
+
+    if (r->Pos < r->End) ++r->Pos;
+
+    return x;
+}
+
+lval* lval_read_sym(lreader* r) {
+    char* start = r->Pos;
+
+    while (lreader_class_of(r) & LCHAR_SYM) ++r->Pos;
+
+    size_t length = r->Pos - start;
+
+    lval* x = lval_parse_num(start, length);
+
+    return x ? x : lval_sym_n(start, length);
+}
+
+// Reads the `length` characters at `start` as a number. Returns NULL if they
+// don't look like one, or an error if it doesn't fit.
+lval* lval_parse_num(char* start, size_t length) {
+    bool negative = length && start[0] == '-';
+    bool is_num = length > (size_t)negative;
+    for (size_t i = negative; i < length && is_num; ++i) {
+        is_num = lreader_class[(unsigned char)start[i]] & LCHAR_DIGIT;
+    }
+
+    if (!is_num) return NULL;
+
+    // NOTE(daniel): accumulate towards negative, so LONG_MIN can be read too.
+    long num = 0;
+    for (size_t i = negative; i < length; ++i) {
+        int digit = start[i] - '0';
+
+        if (num < (LONG_MIN + digit) / 10) return lval_err("Invalid number");
+
+        num = num * 10 - digit;
+    }
+
+    if (!negative) {
+        if (num == LONG_MIN) return lval_err("Invalid number");
+
+        num = -num;
+    }
+
+    return lval_num(num);
+}
+
+lval* lval_read_str(lreader* r) {
+    // Skip the initial quote
+    char* start = ++r->Pos;
+    bool escaped = false;
+
+    while (lreader_peek(r) != '"') {
+        if (r->Pos >= r->End) return lval_err("Unexpected end of input");
+
+        // Check the escape sequence, it is unescaped below.
+        if (*r->Pos == '\\') {
+            ++r->Pos;
+
+            if (r->Pos >= r->End) return lval_err("Unexpected end of input");
+
+            if (!strchr(lval_str_unescapable, *r->Pos)) {
+                return lval_err("Invalid escape sequence \\%c", *r->Pos);
+            }
+
+            escaped = true;
+        }
+
+        ++r->Pos;
+    }
+
+    lval* x = lval_str_n(start, r->Pos - start);
+
+    // Skip the final quote
+    ++r->Pos;
+
+    // NOTE(daniel): the buffer is new, so it can still shrink.
+    if (escaped) {
+        char* out = x->Str;
+
+        for (char* in = x->Str; in < x->Str + x->Length; ++in) {
+            *out++ = (*in == '\\') ? lval_str_unescape(*++in) : *in;
+        }
+
+        *out = '\0';
+        x->Length = x->StrBuf->Length = out - x->Str;
+    }
+
+    return x;
+}
+
+lval* lval_read_all(char* s, size_t length) {
+    lreader r = lreader_new(s, length);
+
+    return lval_read_expr(&r, '\0');
+}
+
+lval* lval_read(lreader* r) {
+    // Skip leading whitespace and comments
+    lreader_skip(r);
+
+    lval* x = NULL;
+    char c = lreader_peek(r);
+
+    if (r->Pos >= r->End) return lval_err("Unexpected end of input");
+
+    if (c == '(') {
+        ++r->Pos;
+        x = lval_read_expr(r, ')');
+    } else if (c == '{') {
+        ++r->Pos;
+        x = lval_read_expr(r, '}');
+    } else if (lreader_class_of(r) & LCHAR_SYM) {
+        x = lval_read_sym(r);
+    } else if (c == '"') {
+        x = lval_read_str(r);
+    } else {
+        x = lval_err("Unexpected character %c", c);
+    }
+
+    // Skip trailing whitespace and comments
+    lreader_skip(r);
+
+    return x;
+}
+
+// NOTE(daniel): load reads a file one top-level form at a time, evaluating
+// each before reading the next, so it only ever holds the form at hand. A
+// stream reads its file in chunks, finds where the next form ends from the
+// brackets, strings and comments in it, and then hands just that slice to the
+// reader. The scan picks up where it stopped whenever more input comes in, so
+// a form can span chunks, and memory only grows with the longest form.
+#define LSTREAM_CHUNK (64 * 1024)
+
+typedef struct {
+    FILE*   File;
+    char*   Data;
+    size_t  Start;      // the first character not yet read
+    size_t  Length;
+    size_t  Capacity;
+    bool    Eof;
+    lhash   Hash;       // of everything read so far, for the load cache
+
+    // How far the form at Start has been scanned, and what is open there
+    size_t  Scan;
+    size_t  Depth;
+    bool    InString;
+    bool    Escaped;
+    bool    InComment;
+    bool    InAtom;
+} lstream;
+
+// Reads more input, after dropping what has been read.
+void lstream_fill(lstream* s) {
+    size_t pending = s->Length - s->Start;
+    if (pending) memmove(s->Data, s->Data + s->Start, pending);
+
+    s->Start = 0;
+    s->Length = pending;
+
+    if (s->Length + LSTREAM_CHUNK > s->Capacity) {
+        s->Capacity = (s->Length + LSTREAM_CHUNK) * 2;
+        s->Data = realloc(s->Data, s->Capacity);
+    }
+
+    // NOTE(daniel): read whatever is there, so the forms on a pipe are run
+    // as soon as they come in.
+#ifdef _WIN32
+    size_t n = fread(s->Data + s->Length, 1, s->Capacity - s->Length, s->File);
+#else
+    ssize_t n = read(fileno(s->File), s->Data + s->Length, s->Capacity - s->Length);
+#endif
+
+    if (n <= 0) {
+        s->Eof = true;
+    } else {
+        lhash_update(&s->Hash, s->Data + s->Length, n);
+        s->Length += n;
+    }
+}
+
+// Returns the length of the form at Start, or 0 if it doesn't end in the
+// input read so far.
+size_t lstream_scan(lstream* s) {
+    char* form = s->Data + s->Start;
+    size_t length = s->Length - s->Start;
+
+    for (; s->Scan < length; ++s->Scan) {
+        char c = form[s->Scan];
+
+        if (s->InString) {
+            if (s->Escaped) {
+                s->Escaped = false;
+            } else if (c == '\\') {
+                s->Escaped = true;
+            } else if (c == '"') {
+                s->InString = false;
+                if (!s->Depth) return s->Scan + 1;
+            }
+        } else if (s->InComment) {
+            if (c == '\n') s->InComment = false;
+        } else if (s->InAtom) {
+            if (!(lreader_class[(unsigned char)c] & LCHAR_SYM)) return s->Scan;
+        } else if (c == '"') {
+            s->InString = true;
+        } else if (c == ';') {
+            s->InComment = true;
+        } else if (c == '(' || c == '{') {
+            ++s->Depth;
+        } else if (c == ')' || c == '}') {
+            if (s->Depth) --s->Depth;
+            if (!s->Depth) return s->Scan + 1;
+        } else if (!s->Depth) {
+            // Anything else at the top is a symbol or number, or an error.
+            if (!(lreader_class[(unsigned char)c] & LCHAR_SYM)) return s->Scan + 1;
+
+            s->InAtom = true;
+        }
+    }
+
+    return 0;
+}
+
+// Returns the next form, or NULL at the end of the input. A form that can't
+// be read is an error.
+lval* lstream_next(lstream* s) {
+    // Skip whitespace and comments
+    for (;;) {
+        while (s->Start < s->Length) {
+            char c = s->Data[s->Start];
+
+            if (s->InComment) {
+                if (c == '\n') s->InComment = false;
+            } else if (c == ';') {
+                s->InComment = true;
+            } else if (!(lreader_class[(unsigned char)c] & LCHAR_SPACE)) {
+                break;
+            }
+
+            ++s->Start;
+        }
+
+        if (s->Start < s->Length) break;
+        if (s->Eof) return NULL;
+
+        lstream_fill(s);
+    }
+
+    size_t length = 0;
+
+    while (!(length = lstream_scan(s))) {
+        // NOTE(daniel): let the reader complain about an unfinished form.
+        if (s->Eof) {
+            length = s->Length - s->Start;
+            break;
+        }
+
+        lstream_fill(s);
+    }
+
+    lreader r = lreader_new(s->Data + s->Start, length);
+    lval* x = lval_read(&r);
+
+    s->Start += length;
+    s->Scan = 0;
+    s->Depth = 0;
+    s->InString = s->Escaped = s->InComment = s->InAtom = false;
+
+    return x;
+}
+
+// NOTE(daniel): the load cache keeps the forms read from a file in a compact
+// binary form, so loading it again skips the reader. It is written next to
+// the file (foo.lisp.ast) or into the directory given to lispy_load_cache.
+//
+// After the header come the top-level forms, one after the other, each a type
+// byte and:
+//
+//  LVAL_NUM            the number, 8 bytes
+//  LVAL_SYM            the index of its name, 4 bytes
+//  LVAL_STR            the length, 8 bytes, and the characters
+//  LVAL_SEXPR/QEXPR    the count, 4 bytes, and the cells
+//
+// all in native byte order. Last come the names of all symbols in the file,
+// which are interned once when it is opened. The forms are written as they
+// are read and the symbols and header at the end, so neither side holds more
+// than a form at a time. A cache is only used if the mtime and hash of the
+// file are the ones it was written for, otherwise the file is read and the
+// cache written again.
+#define LCACHE_VERSION 3
+
+typedef struct {
+    char        Magic[8];
+    uint32_t    Version;
+    uint32_t    SymCount;
+    int64_t     Mtime;
+    uint64_t    Hash;
+    uint64_t    SourceLength;
+    uint64_t    Syms;       // where the names of the symbols start
+    uint64_t    Length;
+    uint64_t    Checksum;
+} lcache_header;
+
+typedef struct {
+    FILE*       File;
+    char        Tmp[4096];
+    uint64_t    Length;     // written so far
+    uint64_t    Checksum;
+    lhash       Hash;       // of all written after the header
+    bool        Failed;
+
+    lbytes      Syms;
+    lbytes      Form;       // the form being written
+    uint32_t    SymCount;
+
+    // The index of each symbol written so far plus one, by name
+    lptrmap     Seen;
+} lcache_writer;
+
+// Appends `b` to the cache, and empties it.
+void lcache_write(lcache_writer* w, lbytes* b) {
+    if (!b->Length) return;
+
+    if (fwrite(b->Data, 1, b->Length, w->File) != b->Length) w->Failed = true;
+
+    lhash_update(&w->Hash, b->Data, b->Length);
+    w->Length += b->Length;
+    b->Length = 0;
+}
+
+// Starts a cache at `path`, returns false if it can't be created. It only
+// replaces the old one once saved, see lcache_save.
+bool lcache_create(lcache_writer* w, char* path) {
+    *w = (lcache_writer) { .Hash = lhash_new() };
+
+    w->File = lfile_create(path, w->Tmp, sizeof(w->Tmp));
+    if (!w->File) return false;
+
+    // The header is only known at the end
+    lcache_header h = { 0 };
+    w->Failed = fwrite(&h, sizeof(h), 1, w->File) != 1;
+    w->Length = sizeof(h);
+
+    return true;
+}
+
+// Adds the form `v` to the cache.
+void lcache_put(lcache_writer* w, lval* v) {
+    uint8_t type = lval_type_of(v);
+    lbytes_put(&w->Form, &type, 1);
+
+    switch (type) {
+        case LVAL_NUM: {
+            int64_t x = lval_num_of(v);
+            lbytes_put(&w->Form, &x, sizeof(x));
+        } break;
+        case LVAL_SYM: {
+            uint64_t i = lptrmap_get(&w->Seen, v->Sym);
+
+            if (!i) {
+                uint32_t length = strlen(v->Sym);
+                lbytes_put(&w->Syms, &length, sizeof(length));
+                lbytes_put(&w->Syms, v->Sym, length);
+
+                i = ++w->SymCount;
+                lptrmap_put(&w->Seen, v->Sym, i);
+            }
+
+            uint32_t index = i - 1;
+            lbytes_put(&w->Form, &index, sizeof(index));
+        } break;
+        case LVAL_STR: {
+            uint64_t length = v->Length;
+            lbytes_put(&w->Form, &length, sizeof(length));
+            lbytes_put(&w->Form, v->Str, length);
+        } break;
+        case LVAL_SEXPR: case LVAL_QEXPR: {
+            uint32_t count = v->Count;
+            lbytes_put(&w->Form, &count, sizeof(count));
+
+            for (size_t i = 0; i < v->Count; ++i) lcache_put(w, v->Cell[i]);
+        } break;
+        default: break;
+    }
+}
+
+// Adds the top-level form `v` to the cache.
+void lcache_add(lcache_writer* w, lval* v) {
+    lcache_put(w, v);
+    lcache_write(w, &w->Form);
+}
+
+// Finishes the cache with the forms added to `w`, read from a file of
+// `length` characters with the given mtime and hash, and moves it to `path`.
+void lcache_save(lcache_writer* w, char* path, int64_t mtime, uint64_t hash, size_t length) {
+    lcache_header h = { 0 };
+
+    memcpy(h.Magic, "LISPYAST", sizeof(h.Magic));
+    h.Version = LCACHE_VERSION;
+    h.SymCount = w->SymCount;
+    h.Mtime = mtime;
+    h.Hash = hash;
+    h.SourceLength = length;
+    h.Syms = w->Length;
+
+    lcache_write(w, &w->Syms);
+
+    h.Length = w->Length;
+    h.Checksum = lhash_final(&w->Hash);
+
+    if (fseek(w->File, 0, SEEK_SET) != 0 || fwrite(&h, sizeof(h), 1, w->File) != 1) w->Failed = true;
+
+    lfile_commit(w->File, w->Tmp, path, !w->Failed);
+    w->File = NULL;
+}
+
+// Frees `w`, and drops the cache if it wasn't saved.
+void lcache_writer_free(lcache_writer* w) {
+    if (w->File) lfile_commit(w->File, w->Tmp, NULL, false);
+
+    free(w->Syms.Data);
+    free(w->Form.Data);
+    lptrmap_free(&w->Seen);
+}
+
+typedef struct {
+    char*       Data;
+    size_t      Length;
+    size_t      Released;   // see lfile_release
+    uint64_t    Hash;       // of the file it was written for
+
+    char*       Pos;
+    char*       End;
+    char**      Syms;
+    uint32_t    SymCount;
+} lcache_reader;
+
+bool lcache_get(lcache_reader* r, void* out, size_t n) {
+    if ((size_t)(r->End - r->Pos) < n) return false;
+
+    memcpy(out, r->Pos, n);
+    r->Pos += n;
+
+    return true;
+}
+
+// Returns the next form of the cache, or NULL if it is damaged.
+lval* lcache_read(lcache_reader* r) {
+    uint8_t type;
+    if (!lcache_get(r, &type, sizeof(type))) return NULL;
+
+    switch (type) {
+        case LVAL_NUM: {
+            int64_t x;
+            if (!lcache_get(r, &x, sizeof(x))) return NULL;
+
+            return lval_num(x);
+        }
+        case LVAL_SYM: {
+            uint32_t i;
+            if (!lcache_get(r, &i, sizeof(i)) || i >= r->SymCount) return NULL;
+
+            return lval_sym_interned(r->Syms[i]);
+        }
+        case LVAL_STR: {
+            uint64_t length;
+            if (!lcache_get(r, &length, sizeof(length)) || length > (size_t)(r->End - r->Pos)) return NULL;
+
+            lval* x = lval_str_n(r->Pos, length);
+            r->Pos += length;
+
+            return x;
+        }
+        case LVAL_SEXPR: case LVAL_QEXPR: {
+            // NOTE(daniel): every cell takes a byte at least, which bounds
+            // the count of a damaged cache.
+            uint32_t count;
+            if (!lcache_get(r, &count, sizeof(count)) || count > (size_t)(r->End - r->Pos)) return NULL;
+
+            lval* x = type == LVAL_SEXPR ? lval_sexpr() : lval_qexpr();
+            lval_reserve(x, count);
+
+            for (size_t i = 0; i < count; ++i) {
+                lval* y = lcache_read(r);
+
+                if (!y) {
+                    lval_free(x);
+                    return NULL;
+                }
+
+                x = lval_add(x, y);
+            }
+
+            return x;
+        }
+        default:
+            return NULL;
+    }
+}
+
+// Returns the next top-level form of the cache, or NULL at its end.
+lval* lcache_next(lcache_reader* r) {
+    if (r->Pos == r->End) return NULL;
+
+    lval* x = lcache_read(r);
+    r->Released = lfile_release(r->Data, r->Released, r->Pos - r->Data);
+
+    return x ? x : lval_err("Damaged load cache");
+}
+
+void lcache_close(lcache_reader* r) {
+    lfile_unmap(r->Data, r->Length);
+    free(r->Syms);
+}
+
+// Returns the hash of the cache after its header, letting its pages go as
+// it goes.
+uint64_t lcache_checksum(lcache_reader* r) {
+    lhash h = lhash_new();
+    size_t released = 0;
+
+    for (size_t i = sizeof(lcache_header); i < r->Length; i += LSTREAM_CHUNK) {
+        size_t n = r->Length - i < LSTREAM_CHUNK ? r->Length - i : LSTREAM_CHUNK;
+
+        lhash_update(&h, r->Data + i, n);
+        released = lfile_release(r->Data, released, i + n);
+    }
+
+    return lhash_final(&h);
+}
+
+// Opens the cache at `path`, returns false if there is none or it wasn't
+// written for a file with the given mtime and length. The hash of the file
+// it was written for is left in Hash, to check once these match.
+bool lcache_open(lcache_reader* r, char* path, int64_t mtime, size_t length) {
+    *r = (lcache_reader) { 0 };
+
+    r->Data = lfile_map(path, &r->Length, false);
+    if (!r->Data) return false;
+
+    lcache_header h = { 0 };
+    if (r->Length >= sizeof(h)) memcpy(&h, r->Data, sizeof(h));
+
+    bool valid = r->Length >= sizeof(h)
+        && memcmp(h.Magic, "LISPYAST", sizeof(h.Magic)) == 0
+        && h.Version == LCACHE_VERSION
+        && h.Mtime == mtime && h.SourceLength == length
+        && h.Length == r->Length
+        && h.Syms >= sizeof(h) && h.Syms <= h.Length
+        && h.Checksum == lcache_checksum(r);
+
+    if (valid) {
+        r->Hash = h.Hash;
+        r->Pos = r->Data + h.Syms;
+        r->End = r->Data + r->Length;
+        r->SymCount = h.SymCount;
+        r->Syms = malloc(sizeof(char*) * h.SymCount);
+    }
+
+    for (uint32_t i = 0; i < r->SymCount && valid; ++i) {
+        uint32_t n;
+        valid = lcache_get(r, &n, sizeof(n)) && n <= (size_t)(r->End - r->Pos);
+
+        if (valid) {
+            r->Syms[i] = lsym_intern_n(r->Pos, n);
+            r->Pos += n;
+        }
+    }
+
+    if (!valid) {
+        lcache_close(r);
+        return false;
+    }
+
+    lfile_release(r->Data, h.Syms, r->Length);
+
+    r->Pos = r->Data + sizeof(h);
+    r->End = r->Data + h.Syms;
+
+    return true;
+}
+
+// Writes the path of the cache of the file at `path` to `out`.
+void lcache_path(char* out, size_t size, char* dir, char* path) {
+    if (!*dir) {
+        snprintf(out, size, "%s.ast", path);
+        return;
+    }
+
+    // NOTE(daniel): files with the same name in other directories share the
+    // cache directory, so the name carries a hash of the whole path.
+    char* name = strrchr(path, '/');
+    name = name ? name + 1 : path;
+
+    snprintf(out, size, "%s/%s.%016" PRIx64 ".ast", dir, name, (uint64_t)lsym_hash_str(path, strlen(path)));
+}
+
+// The forms of a file being loaded, which come from its cache if it has one
+// (Cached), and otherwise from Stream. Those read from the stream are added
+// to Writer, if CachePath is set, and saved when all of them were read.
+struct lload {
+    lstream         Stream;
+
+    bool            Cached;
+    lcache_reader   Cache;
+
+    char*           CachePath;
+    lcache_writer   Writer;
+    int64_t         Mtime;
+
+    bool            Done;
+    bool            Failed;
+};
+
+// Returns the hash of the whole file of `s`, and starts it over.
+uint64_t lstream_hash(lstream* s) {
+    while (!s->Eof) {
+        s->Start = s->Length;
+        lstream_fill(s);
+    }
+
+    uint64_t hash = lhash_final(&s->Hash);
+
+    rewind(s->File);
+    *s = (lstream) { .File = s->File, .Data = s->Data, .Capacity = s->Capacity, .Hash = lhash_new() };
+
+    return hash;
+}
+
+// Opens the file at `path` for loading, or standard input for "-". Returns
+// NULL if it can't be read.
+lload* lload_open(char* path) {
+    lload* ld = calloc(1, sizeof(lload));
+    ld->Stream.Hash = lhash_new();
+
+    struct stat st;
+
+    if (strcmp(path, "-") == 0) {
+        ld->Stream.File = stdin;
+    } else if (stat(path, &st) < 0 || S_ISDIR(st.st_mode) || !(ld->Stream.File = fopen(path, "rb"))) {
+        free(ld);
+        return NULL;
+    }
+
+    // Streams aren't cached, their contents are only known at the end.
+    char* dir = lispy_current ? lispy_current->Cache : NULL;
+    if (!dir || ld->Stream.File == stdin || !S_ISREG(st.st_mode)) return ld;
+
+    char cache[4096];
+    lcache_path(cache, sizeof(cache), dir, path);
+
+    ld->Mtime = (int64_t)st.st_mtime;
+
+    // NOTE(daniel): only hash the file for a cache that matches otherwise,
+    // a file that changed is then read once, while writing its new cache.
+    if (lcache_open(&ld->Cache, cache, ld->Mtime, st.st_size)) {
+        if (lstream_hash(&ld->Stream) == ld->Cache.Hash) {
+            ++stats->CacheHits;
+            ld->Cached = true;
+
+            return ld;
+        }
+
+        lcache_close(&ld->Cache);
+    }
+
+    ++stats->CacheMisses;
+    if (lcache_create(&ld->Writer, cache)) ld->CachePath = strdup(cache);
+
+    return ld;
+}
+
+// Returns the next form of the file, or NULL once there are none. A form
+// that doesn't read is an error.
+lval* lload_next(lload* ld) {
+    if (ld->Cached) return lcache_next(&ld->Cache);
+
+    lval* x = lstream_next(&ld->Stream);
+
+    if (!x) {
+        ld->Done = true;
+    } else if (lval_type_of(x) == LVAL_ERR) {
+        ld->Failed = true;
+    } else if (ld->CachePath) {
+        lcache_add(&ld->Writer, x);
+    }
+
+    return x;
+}
+
+void lload_close(lload* ld) {
+    if (ld->Cached) lcache_close(&ld->Cache);
+
+    // NOTE(daniel): a file that doesn't read is reported every time.
+    if (ld->CachePath) {
+        if (ld->Done && !ld->Failed) {
+            lcache_save(&ld->Writer, ld->CachePath, ld->Mtime, lhash_final(&ld->Stream.Hash), ld->Stream.Hash.Length);
+        }
+
+        lcache_writer_free(&ld->Writer);
+        free(ld->CachePath);
+    }
+
+    if (ld->Stream.File != stdin) fclose(ld->Stream.File);
+    free(ld->Stream.Data);
+
+    free(ld);
+}
+
+// NOTE(daniel): an image is a snapshot of the root environment, written once
+// the files it is made from have been loaded (see lispy_load_image), so that
+// later runs can map it instead of evaluating them again. It holds the values
+// of all root bindings laid out as they are in memory, with every pointer
+// replaced by an offset into the file. Relocs lists those pointers: on load
+// each one is moved by the address of the mapping or, for symbols and
+// builtins, relinked by name to the symbols of the interpreter and to the
+// builtin table.
+//
+// Mapped values are never freed, their counts are LVAL_STATIC (LREFS_STATIC
+// for buffers and code), and the collector doesn't trace them. The caches of
+// memoized lambdas are the exception, they're made anew on load and traced
+// from the image, see limage_mark. The tries of maps are made anew too, since
+// they are laid out by hashes that can change from run to run, but they only
+// hold mapped values.
+//
+// An image is stale if any of its files has another mtime or hash than when
+// it was written, or if it was written by a build with another lval layout.
+// A stale or damaged image is written again.
+#define LIMAGE_VERSION 2
+
+typedef enum {
+    LIMAGE_PTR,         // the offset of an object in the image
+    LIMAGE_SYM,         // the offset of the name of a symbol
+    LIMAGE_BUILTIN,     // the offset of the name of a builtin
+    LIMAGE_MEMO,        // the offset of an limage_memo to make a cache for
+    LIMAGE_MAP,         // the offset of an limage_map to make a trie for
+} limage_kind;
+
+typedef struct {
+    char        Magic[8];
+    uint32_t    Version;
+    uint32_t    LvalSize;
+    uint32_t    TreeWalk;
+    uint32_t    SourceCount;
+    uint64_t    Sources;
+    uint64_t    Globals;
+    uint64_t    GlobalCount;
+    uint64_t    Relocs;
+    uint64_t    RelocCount;
+    uint64_t    Length;
+    uint64_t    Checksum;
+} limage_header;
+
+// A file the image was made from
+typedef struct {
+    uint64_t    Path;
+    int64_t     Mtime;
+    uint64_t    Hash;
+} limage_source;
+
+typedef struct {
+    uint64_t    Slot;
+    uint64_t    Kind;
+} limage_reloc;
+
+typedef struct {
+    char*       Name;
+    lval*       Value;
+} limage_global;
+
+// The cache shared by the copies of a memoized lambda, Memo is set on load
+typedef struct {
+    lval*       Fun;
+    size_t      Limit;
+    lmemo*      Memo;
+} limage_memo;
+
+// The entries of a map, Count keys each followed by its value. Hamt is set on
+// load.
+typedef struct {
+    lhamt*      Hamt;
+    size_t      Count;
+    lval*       Items[];
+} limage_map;
+
+struct limage {
+    limage*     Next;
+    char*       Data;
+    size_t      Length;
+    size_t      MemoCount;
+    lmemo**     Memos;
+    size_t      HamtCount;
+    lhamt**     Hamts;
+};
+
+typedef struct {
+    lbytes          Bytes;
+
+    size_t          RelocCount;
+    size_t          RelocCapacity;
+    limage_reloc*   Relocs;
+
+    // The offsets of the objects written so far, by address
+    lptrmap         Seen;
+} limage_writer;
+
+#define LIMAGE_AT(w, offset, type) ((type*)((w)->Bytes.Data + (offset)))
+
+// Returns the offset of `size` zeroed bytes at the end of the image.
+uint64_t limage_alloc(limage_writer* w, size_t size, size_t align) {
+    size_t offset = (w->Bytes.Length + align - 1) & ~(align - 1);
+    size_t n = offset + size - w->Bytes.Length;
+
+    memset(lbytes_extend(&w->Bytes, n), 0, n);
+
+    return offset;
+}
+
+// Stores `value` in the pointer at `slot`, to be fixed up on load as `kind`.
+void limage_relocate(limage_writer* w, uint64_t slot, uint64_t value, limage_kind kind) {
+    uintptr_t x = (uintptr_t)value;
+    memcpy(w->Bytes.Data + slot, &x, sizeof(x));
+
+    if (w->RelocCount == w->RelocCapacity) {
+        w->RelocCapacity = w->RelocCapacity ? w->RelocCapacity * 2 : 1024;
+        w->Relocs = realloc(w->Relocs, sizeof(limage_reloc) * w->RelocCapacity);
+    }
+
+    w->Relocs[w->RelocCount++] = (limage_reloc) { .Slot = slot, .Kind = kind };
+}
+
+uint64_t limage_put_str(limage_writer* w, char* s) {
+    uint64_t offset = lptrmap_get(&w->Seen, s);
+    if (offset) return offset;
+
+    size_t length = strlen(s) + 1;
+
+    offset = limage_alloc(w, length, 1);
+    memcpy(w->Bytes.Data + offset, s, length);
+    lptrmap_put(&w->Seen, s, offset);
+
+    return offset;
+}
+
+uint64_t limage_put_lval(limage_writer* w, lval* v);
+
+// Stores the value `v` in the pointer at `slot`.
+void limage_put_value(limage_writer* w, uint64_t slot, lval* v) {
+    if (lval_builtin_entry(v)) {
+        limage_relocate(w, slot, limage_put_str(w, lval_builtin_entry(v)->Name), LIMAGE_BUILTIN);
+    } else if (lval_is_imm(v)) {
+        // NOTE(daniel): a small integer is its own bits.
+        memcpy(w->Bytes.Data + slot, &v, sizeof(v));
+    } else {
+        limage_relocate(w, slot, limage_put_lval(w, v), LIMAGE_PTR);
+    }
+}
+
+uint64_t limage_put_buf(limage_writer* w, lbuf* b) {
+    uint64_t offset = lptrmap_get(&w->Seen, b);
+    if (offset) return offset;
+
+    offset = limage_alloc(w, lbuf_size(b->Count), 16);
+    lptrmap_put(&w->Seen, b, offset);
+
+    LIMAGE_AT(w, offset, lbuf)->Refs = LREFS_STATIC;
+    LIMAGE_AT(w, offset, lbuf)->Count = b->Count;
+    LIMAGE_AT(w, offset, lbuf)->Capacity = b->Count;
+
+    // NOTE(daniel): cells handed over to a view are NULL, see lval_pop.
+    for (size_t i = 0; i < b->Count; ++i) {
+        if (b->Cells[i]) limage_put_value(w, offset + lbuf_size(i), b->Cells[i]);
+    }
 
-    return lval_lambda(formals, body);
+    return offset;
 }
 
-lval* builtin_op(lenv* e, lval* a, char* op) {
-    (void)e;
+uint64_t limage_put_strbuf(limage_writer* w, lstrbuf* b) {
+    uint64_t offset = lptrmap_get(&w->Seen, b);
+    if (offset) return offset;
 
-    // Ensure all arguments are numbers
-    for (size_t i = 0; i < a->Count; ++i) {
-        if (a->Cell[i]->Type != LVAL_NUM) {
-            LASSERT_TYPE(a, op, i, LVAL_NUM);
-        }
-    }
+    offset = limage_alloc(w, lstrbuf_size(b->Length), 16);
+    lptrmap_put(&w->Seen, b, offset);
 
-    lval* result = lval_pop(a, 0);
+    LIMAGE_AT(w, offset, lstrbuf)->Refs = LREFS_STATIC;
+    LIMAGE_AT(w, offset, lstrbuf)->Length = b->Length;
+    LIMAGE_AT(w, offset, lstrbuf)->Capacity = b->Length;
+    memcpy(LIMAGE_AT(w, offset, lstrbuf)->Data, b->Data, b->Length + 1);
 
-    if ((strcmp(op, "-") == 0) && a->Count == 0) {
-        result->Num = -result->Num;
-    }
+    return offset;
+}
 
-    while (a->Count > 0) {
-        lval* y = lval_pop(a, 0);
+uint64_t limage_put_code(limage_writer* w, lcode* c) {
+    uint64_t offset = lptrmap_get(&w->Seen, c);
+    if (offset) return offset;
 
-        if (strcmp(op, "+") == 0) result->Num += y->Num;
-        if (strcmp(op, "-") == 0) result->Num -= y->Num;
-        if (strcmp(op, "*") == 0) result->Num *= y->Num;
-        if (strcmp(op, "/") == 0) {
-            if (y->Num == 0) {
-                lval_free(result);
-                lval_free(y);
+    offset = limage_alloc(w, sizeof(lcode), 16);
+    lptrmap_put(&w->Seen, c, offset);
 
-                result = lval_err("Division by zero");
-                break;
-            }
+    LIMAGE_AT(w, offset, lcode)->Refs = LREFS_STATIC;
+    LIMAGE_AT(w, offset, lcode)->Count = c->Count;
+    LIMAGE_AT(w, offset, lcode)->Capacity = c->Count;
+    LIMAGE_AT(w, offset, lcode)->ConstCount = c->ConstCount;
+    LIMAGE_AT(w, offset, lcode)->ConstCapacity = c->ConstCount;
 
-            result->Num /= y->Num;
-        }
+    uint64_t instrs = limage_alloc(w, sizeof(linstr) * c->Count, 16);
+    memcpy(w->Bytes.Data + instrs, c->Instrs, sizeof(linstr) * c->Count);
+    limage_relocate(w, offset + offsetof(lcode, Instrs), instrs, LIMAGE_PTR);
 
-        lval_free(y);
+    uint64_t consts = limage_alloc(w, sizeof(lval*) * c->ConstCount, 16);
+    limage_relocate(w, offset + offsetof(lcode, Consts), consts, LIMAGE_PTR);
+
+    for (size_t i = 0; i < c->ConstCount; ++i) {
+        limage_put_value(w, consts + sizeof(lval*) * i, c->Consts[i]);
     }
 
-    lval_free(a);
-    return result;
+    return offset;
 }
 
-lval* builtin_add(lenv* e, lval* a) {
-    return builtin_op(e, a, "+");
-}
+uint64_t limage_put_memo(limage_writer* w, lmemo* m) {
+    uint64_t offset = lptrmap_get(&w->Seen, m);
+    if (offset) return offset;
 
-lval* builtin_sub(lenv* e, lval* a) {
-    return builtin_op(e, a, "-");
-}
+    offset = limage_alloc(w, sizeof(limage_memo), 16);
+    lptrmap_put(&w->Seen, m, offset);
 
-lval* builtin_mul(lenv* e, lval* a) {
-    return builtin_op(e, a, "*");
-}
+    LIMAGE_AT(w, offset, limage_memo)->Limit = m->Limit;
+    limage_put_value(w, offset + offsetof(limage_memo, Fun), m->Fun);
 
-lval* builtin_div(lenv* e, lval* a) {
-    return builtin_op(e, a, "/");
+    return offset;
 }
 
-lval* builtin_ord(lenv* e, lval* a, char* op) {
-    (void)e;
-
-    LASSERT_COUNT(a, op, 2);
-    LASSERT_TYPE(a, op, 0, LVAL_NUM);
-    LASSERT_TYPE(a, op, 1, LVAL_NUM);
+// Writes the entries of the node `n` to the items of an limage_map at
+// `items`, from the `i`th.
+void limage_put_hamt(limage_writer* w, uint64_t items, lhamt* n, size_t* i) {
+    for (uint32_t j = 0; j < n->Count; ++j) {
+        lhamt_slot* s = &n->Slots[j];
 
-    int result = 0;
+        if (!s->Key) {
+            limage_put_hamt(w, items, s->Node, i);
+            continue;
+        }
 
-    if (strcmp(op, ">") == 0) {
-        result = a->Cell[0]->Num > a->Cell[1]->Num;
-    } else if (strcmp(op, "<") == 0) {
-        result = a->Cell[0]->Num < a->Cell[1]->Num;
-    } else if (strcmp(op, ">=") == 0) {
-        result = a->Cell[0]->Num >= a->Cell[1]->Num;
-    } else if (strcmp(op, "<=") == 0) {
-        result = a->Cell[0]->Num <= a->Cell[1]->Num;
+        limage_put_value(w, items + sizeof(lval*) * (*i)++, s->Key);
+        limage_put_value(w, items + sizeof(lval*) * (*i)++, s->Val);
     }
+}
 
-    lval_free(a);
+uint64_t limage_put_map(limage_writer* w, lval* v) {
+    uint64_t offset = limage_alloc(w, sizeof(limage_map) + sizeof(lval*) * 2 * v->Size, 16);
+    LIMAGE_AT(w, offset, limage_map)->Count = v->Size;
 
-    return lval_num(result);
-}
+    size_t i = 0;
+    limage_put_hamt(w, offset + offsetof(limage_map, Items), v->Hamt, &i);
 
-lval* builtin_gt(lenv* e, lval* a) {
-    return builtin_ord(e, a, ">");
+    return offset;
 }
 
-lval* builtin_lt(lenv* e, lval* a) {
-    return builtin_ord(e, a, "<");
-}
+uint64_t limage_put_lval(limage_writer* w, lval* v) {
+    uint64_t offset = lptrmap_get(&w->Seen, v);
+    if (offset) return offset;
 
-lval* builtin_ge(lenv* e, lval* a) {
-    return builtin_ord(e, a, ">=");
-}
+    offset = limage_alloc(w, lval_pool(v->Type) == &heap->Atoms ? LVAL_ATOM_SIZE : sizeof(lval), 16);
+    lptrmap_put(&w->Seen, v, offset);
 
-lval* builtin_le(lenv* e, lval* a) {
-    return builtin_ord(e, a, "<=");
-}
+    LIMAGE_AT(w, offset, lval)->Type = v->Type;
+    LIMAGE_AT(w, offset, lval)->Refs = LVAL_STATIC;
 
-lval* builtin_cmp(lenv* e, lval* a, char* op) {
-    (void)e;
+    switch (v->Type) {
+        case LVAL_NUM: {
+            LIMAGE_AT(w, offset, lval)->Num = v->Num;
+        } break;
+        case LVAL_ERR: {
+            limage_relocate(w, offset + offsetof(lval, Err), limage_put_str(w, v->Err), LIMAGE_PTR);
+        } break;
+        case LVAL_STR: {
+            uint64_t b = limage_put_strbuf(w, v->StrBuf);
 
-    LASSERT_COUNT(a, op, 2);
+            LIMAGE_AT(w, offset, lval)->Length = v->Length;
+            limage_relocate(w, offset + offsetof(lval, StrBuf), b, LIMAGE_PTR);
+            limage_relocate(w, offset + offsetof(lval, Str), b + offsetof(lstrbuf, Data) + (v->Str - v->StrBuf->Data), LIMAGE_PTR);
+        } break;
+        case LVAL_SYM: {
+            limage_relocate(w, offset + offsetof(lval, Sym), limage_put_str(w, v->Sym), LIMAGE_SYM);
+        } break;
+        case LVAL_FUN: {
+            if (v->Sym) limage_relocate(w, offset + offsetof(lval, Sym), limage_put_str(w, v->Sym), LIMAGE_SYM);
 
-    int result = 0;
-    
-    if (strcmp(op, "==") == 0) {
-        result = lval_eq(a->Cell[0], a->Cell[1]);
-    } else if (strcmp(op, "!=") == 0) {
-        result = !lval_eq(a->Cell[0], a->Cell[1]);
-    }
+            limage_put_value(w, offset + offsetof(lval, Formals), v->Formals);
+            limage_put_value(w, offset + offsetof(lval, Body), v->Body);
 
-    lval_free(a);
+            if (v->Code) limage_relocate(w, offset + offsetof(lval, Code), limage_put_code(w, v->Code), LIMAGE_PTR);
+            if (v->Args) limage_put_value(w, offset + offsetof(lval, Args), v->Args);
+            if (v->Memo) limage_relocate(w, offset + offsetof(lval, Memo), limage_put_memo(w, v->Memo), LIMAGE_MEMO);
+        } break;
+        case LVAL_SEXPR: case LVAL_QEXPR: {
+            LIMAGE_AT(w, offset, lval)->Count = v->Count;
 
-    return lval_num(result);
-}
+            if (v->Buf) {
+                uint64_t b = limage_put_buf(w, v->Buf);
 
-lval* builtin_eq(lenv* e, lval* a) {
-    return builtin_cmp(e, a, "==");
+                limage_relocate(w, offset + offsetof(lval, Buf), b, LIMAGE_PTR);
+                limage_relocate(w, offset + offsetof(lval, Cell), b + lbuf_size(v->Cell - v->Buf->Cells), LIMAGE_PTR);
+            } else {
+                for (size_t i = 0; i < v->Count; ++i) {
+                    limage_put_value(w, offset + offsetof(lval, Inline) + sizeof(lval*) * i, v->Cell[i]);
+                }
+
+                limage_relocate(w, offset + offsetof(lval, Cell), offset + offsetof(lval, Inline), LIMAGE_PTR);
+            }
+        } break;
+        case LVAL_VEC: {
+            uint64_t x = limage_alloc(w, lvec_size(v->Vec->Count), 16);
+
+            memcpy(w->Bytes.Data + x, v->Vec, lvec_size(v->Vec->Count));
+            limage_relocate(w, offset + offsetof(lval, Vec), x, LIMAGE_PTR);
+        } break;
+        case LVAL_MAP: {
+            LIMAGE_AT(w, offset, lval)->Size = v->Size;
+
+            if (v->Hamt) limage_relocate(w, offset + offsetof(lval, Hamt), limage_put_map(w, v), LIMAGE_MAP);
+        } break;
+    }
+
+    return offset;
 }
 
-lval* builtin_ne(lenv* e, lval* a) {
-    return builtin_cmp(e, a, "!=");
+// Reads the mtime and hash of the file at `path`, returns false if it can't
+// be read.
+bool limage_source_of(char* path, limage_source* source) {
+    struct stat st;
+    if (stat(path, &st) < 0) return false;
+
+    size_t length = 0;
+    char* data = lfile_map(path, &length, false);
+    if (!data) return false;
+
+    source->Mtime = (int64_t)st.st_mtime;
+    source->Hash = lfile_hash(data, length);
+    lfile_unmap(data, length);
+
+    return true;
 }
 
-lval* builtin_if(lenv* e, lval* a) {
-    LASSERT_COUNT(a, "if", 3);
-    LASSERT_TYPE(a, "if", 0, LVAL_NUM);
-    LASSERT_TYPE(a, "if", 1, LVAL_QEXPR);
-    LASSERT_TYPE(a, "if", 2, LVAL_QEXPR);
+// Writes the root bindings of `l` to an image at `path`, made from the
+// `count` files in `paths` whose mtimes and hashes are in `sources`.
+bool limage_save(lispy* l, char* path, char** paths, limage_source* sources, size_t count) {
+    limage_writer w = { 0 };
+    limage_alloc(&w, sizeof(limage_header), 16);
 
-    // Turn both Q-Expression into S-Expression, so they can be evaluated. 
-    a->Cell[1]->Type = LVAL_SEXPR;
-    a->Cell[2]->Type = LVAL_SEXPR;
+    uint64_t first_source = limage_alloc(&w, sizeof(limage_source) * count, 16);
 
-    lval* result = NULL;
+    for (size_t i = 0; i < count; ++i) {
+        uint64_t name = limage_put_str(&w, paths[i]);
+        limage_source* source = LIMAGE_AT(&w, first_source + sizeof(limage_source) * i, limage_source);
 
-    if (a->Cell[0]->Num) {
-        result = lval_eval(e, lval_pop(a, 1));
-    } else {
-        result = lval_eval(e, lval_pop(a, 2));
+        *source = sources[i];
+        source->Path = name;
     }
 
-    lval_free(a);
+    size_t globals = 0;
 
-    return result;
-}
+    for (size_t i = 0; i < l->Syms.Capacity; ++i) {
+        char* name = l->Syms.Names[i];
+        if (name && lsym_of(name)->Global) ++globals;
+    }
 
-lval* builtin_load(lenv* e, lval* a) {
-    LASSERT_COUNT(a, "load", 1);
-    LASSERT_TYPE(a, "load", 0, LVAL_STR);
+    uint64_t first_global = limage_alloc(&w, sizeof(limage_global) * globals, 16);
+    uint64_t g = first_global;
 
-    // Open file and check if exists 
-    FILE* f = fopen(a->Cell[0]->Str, "rb");
-    if (!f) {
-        lval* err = lval_err("Could not load library %s", a->Cell[0]->Str);
-        lval_free(a);
+    for (size_t i = 0; i < l->Syms.Capacity; ++i) {
+        char* name = l->Syms.Names[i];
+        if (!name || !lsym_of(name)->Global) continue;
 
-        return err; 
+        limage_relocate(&w, g + offsetof(limage_global, Name), limage_put_str(&w, name), LIMAGE_SYM);
+        limage_put_value(&w, g + offsetof(limage_global, Value), lsym_of(name)->Global);
+
+        g += sizeof(limage_global);
     }
 
-    // Read file contents
-    fseek(f, 0, SEEK_END);
-    long length = ftell(f);
-    fseek(f, 0, SEEK_SET);
-    char* input = calloc(length+1, 1);
-    fread(input, 1, length, f);
-    fclose(f);
+    uint64_t relocs = limage_alloc(&w, sizeof(limage_reloc) * w.RelocCount, 16);
+    memcpy(w.Bytes.Data + relocs, w.Relocs, sizeof(limage_reloc) * w.RelocCount);
 
-    // Parse file
-    int pos = 0;
-    lval* expr = lval_read_expr(input, &pos, '\0');
-    free(input);
+    limage_header* h = LIMAGE_AT(&w, 0, limage_header);
 
-    if (expr->Type != LVAL_ERR) {
-        while (expr->Count) {
-            lval* x = lval_eval(e, lval_pop(expr, 0));
+    memcpy(h->Magic, "LISPYIMG", sizeof(h->Magic));
+    h->Version = LIMAGE_VERSION;
+    h->LvalSize = sizeof(lval);
+    h->TreeWalk = l->TreeWalk;
+    h->SourceCount = count;
+    h->Sources = first_source;
+    h->Globals = first_global;
+    h->GlobalCount = globals;
+    h->Relocs = relocs;
+    h->RelocCount = w.RelocCount;
+    h->Length = w.Bytes.Length;
+    h->Checksum = lfile_hash(w.Bytes.Data + sizeof(limage_header), w.Bytes.Length - sizeof(limage_header));
 
-            if (x->Type == LVAL_ERR) {
-                lval_println(x);
-            }
+    bool ok = lfile_write(path, w.Bytes.Data, w.Bytes.Length);
 
-            lval_free(x);
-        }
-    } else {
-        lval_println(expr);
-    }
+    free(w.Bytes.Data);
+    free(w.Relocs);
+    lptrmap_free(&w.Seen);
 
-    lval_free(expr);
-    lval_free(a);
+    return ok;
+}
 
-    return lval_sexpr();
+// Returns true if the `length` bytes at `data` hold a NUL terminated string
+// at `offset`.
+bool limage_str_valid(char* data, size_t length, uint64_t offset) {
+    return offset < length && memchr(data + offset, '\0', length - offset);
 }
 
-lval* builtin_print(lenv* e, lval* a) {
-    (void)e;
+bool limage_range_valid(size_t length, uint64_t offset, uint64_t count, size_t size) {
+    return offset <= length && count <= (length - offset) / size;
+}
 
-    for (size_t i = 0; i < a->Count; ++i) {
-        lval_print(a->Cell[i]);
-        putchar(' ');
+// Checks that the image in the `length` bytes at `data` was made from the
+// files in `paths` as they are now, and that everything in it is in bounds.
+bool limage_valid(lispy* l, char* data, size_t length, char** paths, size_t count) {
+    limage_header* h = (limage_header*)data;
+
+    if (length < sizeof(limage_header) || memcmp(h->Magic, "LISPYIMG", sizeof(h->Magic)) != 0) return false;
+    if (h->Version != LIMAGE_VERSION || h->LvalSize != sizeof(lval) || h->TreeWalk != l->TreeWalk) return false;
+
+    // NOTE(daniel): the values aren't checked one by one, so a damaged image
+    // must be caught here.
+    if (h->Length != length) return false;
+    if (h->Checksum != lfile_hash(data + sizeof(limage_header), length - sizeof(limage_header))) return false;
+    if (h->SourceCount != count || !limage_range_valid(length, h->Sources, count, sizeof(limage_source))) return false;
+    if (!limage_range_valid(length, h->Globals, h->GlobalCount, sizeof(limage_global))) return false;
+    if (!limage_range_valid(length, h->Relocs, h->RelocCount, sizeof(limage_reloc))) return false;
+
+    limage_source* sources = (limage_source*)(data + h->Sources);
+
+    for (size_t i = 0; i < count; ++i) {
+        if (!limage_str_valid(data, length, sources[i].Path)) return false;
+        if (strcmp(data + sources[i].Path, paths[i]) != 0) return false;
+
+        // NOTE(daniel): only hash the file if its mtime hasn't changed.
+        struct stat st;
+        if (stat(paths[i], &st) < 0 || (int64_t)st.st_mtime != sources[i].Mtime) return false;
+
+        limage_source now = { 0 };
+        if (!limage_source_of(paths[i], &now) || now.Hash != sources[i].Hash) return false;
     }
 
-    putchar('\n');
-    lval_free(a);
+    limage_reloc* relocs = (limage_reloc*)(data + h->Relocs);
+
+    for (size_t i = 0; i < h->RelocCount; ++i) {
+        limage_reloc* r = &relocs[i];
+        if (r->Slot % sizeof(uintptr_t) || !limage_range_valid(length, r->Slot, 1, sizeof(uintptr_t))) return false;
+
+        uintptr_t value;
+        memcpy(&value, data + r->Slot, sizeof(value));
+
+        switch (r->Kind) {
+            case LIMAGE_PTR: if (value > length) return false; break;
+            case LIMAGE_SYM: if (!limage_str_valid(data, length, value)) return false; break;
+            case LIMAGE_BUILTIN: {
+                if (!limage_str_valid(data, length, value) || !lval_builtin_named(data + value)) return false;
+            } break;
+            case LIMAGE_MEMO: {
+                if (value % 16 || !limage_range_valid(length, value, 1, sizeof(limage_memo))) return false;
+            } break;
+            case LIMAGE_MAP: {
+                if (value % 16 || !limage_range_valid(length, value, 1, sizeof(limage_map))) return false;
+
+                uint64_t n = ((limage_map*)(data + value))->Count;
+                if (n > SIZE_MAX / 2 || !limage_range_valid(length, value + sizeof(limage_map), 2 * n, sizeof(lval*))) return false;
+            } break;
+            default: return false;
+        }
+    }
 
-    return lval_sexpr();
+    return true;
 }
 
-lval* builtin_error(lenv* e, lval* a) {
-    (void)e;
+void limage_static_hamt(lhamt* n) {
+    n->Refs = LREFS_STATIC;
 
-    LASSERT_COUNT(a, "error", 1);
-    LASSERT_TYPE(a, "error", 0, LVAL_STR);
+    for (uint32_t i = 0; i < n->Count; ++i) {
+        if (!n->Slots[i].Key) limage_static_hamt(n->Slots[i].Node);
+    }
+}
 
-    lval* err = lval_err(a->Cell[0]->Str);
-    lval_free(a);
+// Frees a trie made on load, whose keys and values are mapped.
+void limage_free_hamt(lhamt* n) {
+    for (uint32_t i = 0; i < n->Count; ++i) {
+        if (!n->Slots[i].Key) limage_free_hamt(n->Slots[i].Node);
+    }
 
-    return err;
+    lstats_free(lhamt_size(n->Count));
+    free(n);
 }
 
-#undef LASSERT
-#undef LASSERT_COUNT 
-#undef LASSERT_TYPE
+// Maps the image at `path` and binds its values in the root environment of
+// `l`. Returns false, changing nothing, if there's no image or it is stale.
+bool limage_load(lispy* l, char* path, char** paths, size_t count) {
+    size_t length = 0;
+    char* data = lfile_map(path, &length, true);
+    if (!data) return false;
 
-void lenv_add_builtins(lenv* e) {
-    lenv_add_builtin(e, "list", builtin_list);
-    lenv_add_builtin(e, "head", builtin_head);
-    lenv_add_builtin(e, "tail", builtin_tail);
-    lenv_add_builtin(e, "join", builtin_join);
-    lenv_add_builtin(e, "eval", builtin_eval);
-
-    lenv_add_builtin(e, "def", builtin_def);
-    lenv_add_builtin(e, "=", builtin_put);
-    lenv_add_builtin(e, "\\", builtin_lambda);
-
-    lenv_add_builtin(e, "+", builtin_add);
-    lenv_add_builtin(e, "-", builtin_sub);
-    lenv_add_builtin(e, "*", builtin_mul);
-    lenv_add_builtin(e, "/", builtin_div);
-
-    lenv_add_builtin(e, "if", builtin_if);
-    lenv_add_builtin(e, "==", builtin_eq);
-    lenv_add_builtin(e, "!=", builtin_ne);
-    lenv_add_builtin(e, ">",  builtin_gt);
-    lenv_add_builtin(e, "<",  builtin_lt);
-    lenv_add_builtin(e, ">=", builtin_ge);
-    lenv_add_builtin(e, "<=", builtin_le);
-
-    lenv_add_builtin(e, "load", builtin_load);
-    lenv_add_builtin(e, "print", builtin_print);
-    lenv_add_builtin(e, "error", builtin_error);
-}
+    if (!limage_valid(l, data, length, paths, count)) {
+        lfile_unmap(data, length);
+        return false;
+    }
 
-lval* lval_call(lenv *e, lval* f, lval* a) {
-    if (f->Builtin) return f->Builtin(e, a);
+    limage_header* h = (limage_header*)data;
+    limage_reloc* relocs = (limage_reloc*)(data + h->Relocs);
 
-    int given = a->Count;
-    int total = f->Formals->Count;
+    limage* image = calloc(1, sizeof(limage));
+    image->Data = data;
+    image->Length = length;
 
-    while (a->Count) {
-        if (f->Formals->Count == 0) {
-            lval_free(a);
-            return lval_err("Function passed too many arguments. Got %i, Expected %i.", given, total);
-        }
+    // NOTE(daniel): caches go after the rest, their lambdas must be relocated
+    // first, and maps go last, their keys are hashed.
+    for (int pass = 0; pass < 3; ++pass) {
+        for (size_t i = 0; i < h->RelocCount; ++i) {
+            limage_reloc* r = &relocs[i];
+            if ((r->Kind == LIMAGE_MEMO ? 1 : r->Kind == LIMAGE_MAP ? 2 : 0) != pass) continue;
 
-        lval* sym = lval_pop(f->Formals, 0);
+            uintptr_t value;
+            memcpy(&value, data + r->Slot, sizeof(value));
 
-        if (strcmp(sym->Sym, "&") == 0) {
-            if (f->Formals->Count != 1) {
-                lval_free(sym);
-                lval_free(a);
+            switch (r->Kind) {
+                case LIMAGE_PTR: value += (uintptr_t)data; break;
+                case LIMAGE_SYM: value = (uintptr_t)lsym_intern(data + value); break;
+                case LIMAGE_BUILTIN: value = (uintptr_t)lval_builtin_named(data + value); break;
+                case LIMAGE_MEMO: {
+                    limage_memo* m = (limage_memo*)(data + value);
 
-                return lval_err("Function format invalid. Symbol '&' not followed by single symbol.");
-            }
+                    if (!m->Memo) {
+                        m->Memo = lmemo_new(m->Fun, m->Limit);
+                        m->Memo->Refs = LREFS_STATIC;
 
-            lval* nsym = lval_pop(f->Formals, 0);
-            lenv_put(f->Env, nsym, builtin_list(e, a));
+                        image->Memos = realloc(image->Memos, sizeof(lmemo*) * (image->MemoCount + 1));
+                        image->Memos[image->MemoCount++] = m->Memo;
+                    }
 
-            lval_free(sym);
-            lval_free(nsym);
+                    value = (uintptr_t)m->Memo;
+                } break;
+                case LIMAGE_MAP: {
+                    limage_map* m = (limage_map*)(data + value);
 
-            break;
-        }
+                    if (!m->Hamt) {
+                        for (size_t j = 0; j < m->Count; ++j) {
+                            bool added = false;
+                            lhamt* n = lhamt_put(m->Hamt, 0, lval_hash(m->Items[2 * j]), m->Items[2 * j], m->Items[2 * j + 1], &added);
 
-        lval* val = lval_pop(a, 0);
+                            if (m->Hamt) lhamt_free(m->Hamt);
+                            m->Hamt = n;
+                        }
 
-        // NOTE(daniel): bind the value to the symbol in the environment.
-        lenv_put(f->Env, sym, val);
+                        limage_static_hamt(m->Hamt);
 
-        lval_free(sym);
-        lval_free(val);
-    }
+                        image->Hamts = realloc(image->Hamts, sizeof(lhamt*) * (image->HamtCount + 1));
+                        image->Hamts[image->HamtCount++] = m->Hamt;
+                    }
 
-    lval_free(a);
+                    value = (uintptr_t)m->Hamt;
+                } break;
+            }
 
-    // NOTE(daniel): if '&' remains in the formal list bind it to an empty list.
-    if (f->Formals->Count > 0 && strcmp(f->Formals->Cell[0]->Sym, "&") == 0) {
-        if (f->Formals->Count != 2) {
-            return lval_err("Function format invalid. Symbol '&' not followed by single symbol.");
+            memcpy(data + r->Slot, &value, sizeof(value));
         }
+    }
 
-        lval_free(lval_pop(f->Formals, 0));
+    limage_global* globals = (limage_global*)(data + h->Globals);
 
-        lval* sym = lval_pop(f->Formals, 0);
-        lval* val = lval_qexpr();
+    for (size_t i = 0; i < h->GlobalCount; ++i) {
+        lsym* sym = lsym_of(globals[i].Name);
 
-        lenv_put(f->Env, sym, val);
-        lval_free(sym);
-        lval_free(val);
+        if (sym->Global) lval_free(sym->Global);
+        sym->Global = globals[i].Value;
     }
 
-    // NOTE(daniel): if all formals have been bound evaluate the function,
-    // otherwise return partially evaluated function.
-    if (f->Formals->Count == 0) {
-        f->Env->Parent = e;
+    image->Next = l->Images;
+    l->Images = image;
 
-        return builtin_eval(f->Env, lval_add(lval_sexpr(), lval_copy(f->Body)));
-    } else {
-        return lval_copy(f);
-    }
+    return true;
 }
 
-lval* lval_eval_sexpr(lenv* e, lval* v) {
-    // Recursively evaluate children
-    for (size_t i = 0; i < v->Count; ++i) {
-        v->Cell[i] = lval_eval(e, v->Cell[i]);
+// Marks what the caches of the images hold, which lives in the heap.
+void limage_mark(void) {
+    for (limage* image = lispy_current->Images; image; image = image->Next) {
+        for (size_t i = 0; i < image->MemoCount; ++i) lheap_mark_memo(image->Memos[i]);
     }
+}
 
-    // Error checking
-    for (size_t i = 0; i < v->Count; ++i) {
-        if (v->Cell[i]->Type == LVAL_ERR) return lval_take(v, i);
+void limage_free(limage* image) {
+    for (size_t i = 0; i < image->MemoCount; ++i) {
+        image->Memos[i]->Refs = 1;
+        lmemo_free(image->Memos[i]);
     }
 
-    // Empty expression
-    if (v->Count == 0) return v;
+    for (size_t i = 0; i < image->HamtCount; ++i) limage_free_hamt(image->Hamts[i]);
 
-    // Single expression
-    if (v->Count == 1) return lval_take(v, 0);
+    lfile_unmap(image->Data, image->Length);
+    free(image->Memos);
+    free(image->Hamts);
+    free(image);
+}
 
-    // Ensure first element is a function
-    lval* f = lval_pop(v, 0);
-    if (f->Type != LVAL_FUN) {
-        lval* err = lval_err("S-expression does not start with function. Got %s, Expected %s.",
-            lval_type_name(f->Type), lval_type_name(LVAL_FUN));
+// Prints `v` into the Result of `l`, and frees it. Returns 0, or -1 if `v` is
+// an error.
+int lispy_set_result(lispy* l, lval* v) {
+    int status = lval_type_of(v) == LVAL_ERR ? -1 : 0;
 
-        lval_free(f);
-        lval_free(v);
+    free(l->Result);
 
-        return err;
-    }
+    lbytes b = { 0 };
+    lval_write(&b, v);
+    lbytes_putc(&b, '\0');
+    l->Result = b.Data;
 
-    // Call builtin with operator
-    lval* result = lval_call(e, f, v);
-    lval_free(f);
+    lval_free(v);
 
-    return result;
+    return status;
 }
 
-void load_file(lenv* env, char* filename) {
-    lval* args = lval_add(lval_sexpr(), lval_str(filename));
-    lval* x = builtin_load(env, args);
+lispy* lispy_new(void) {
+    lispy* l = calloc(1, sizeof(lispy));
+    l->Par = calloc(1, sizeof(lpar));
+    l->Out = stdout;
 
-    if (x->Type == LVAL_ERR) {
-        lval_println(x);
-    }
+    lthread_init(&l->Main, l);
+    lthread_enter(&l->Main);
 
-    lval_free(x);
-}
+    lsym_init(&l->Syms);
 
-lval* lval_read(char* s, int* i);
+    l->Root = lenv_new_root();
+    lenv_add_builtins(l->Root);
 
-lval* lval_read_expr(char* s, int* i, char end) {
-    lval* x = (end == '}') ? lval_qexpr() : lval_sexpr();
+    return l;
+}
 
-    while (s[*i] != end) {
-        lval* y = lval_read(s, i);
+void lispy_free(lispy* l) {
+    lthread_enter(&l->Main);
+    lpar_stop();
 
-        if (y->Type == LVAL_ERR) {
-            lval_free(x);
+    // NOTE(daniel): once the root bindings are gone, everything but the root
+    // environment is garbage.
+    for (size_t i = 0; i < l->Syms.Capacity; ++i) {
+        char* name = l->Syms.Names[i];
 
-            return y;
+        if (name && lsym_of(name)->Global) {
+            lval_free(lsym_of(name)->Global);
+            lsym_of(name)->Global = NULL;
         }
+    }
 
-        lval_add(x, y);
+    lheap_collect(l->Root);
+
+    while (l->Images) {
+        limage* next = l->Images->Next;
+        limage_free(l->Images);
+        l->Images = next;
     }
 
-    ++(*i);
+    lthread_free(&l->Main);
+    lsym_free(&l->Syms);
+    free(l->Par);
+    free(l->Result);
+    free(l->Cache);
+    free(l);
 
-    return x;
+    lthread_leave();
 }
 
-char* lval_str_sym_characters = 
-    "abcdefghijklmnopqrstuvwxyz"
-    "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
-    "0123456789"
-    "_+-*\\/=<>!&";
+void lispy_output(lispy* l, FILE* out) {
+    l->Out = out ? out : stdout;
+}
 
-lval* lval_read_sym(char* s, int* i) {
-    char* part = calloc(1, 1);
+void lispy_load_cache(lispy* l, const char* dir) {
+    free(l->Cache);
+    l->Cache = dir ? strdup(dir) : NULL;
+}
 
-    while (strchr(lval_str_sym_characters, s[*i]) && s[*i] != '\0') {
-        part = realloc(part, strlen(part) + 2);
-        part[strlen(part) + 0] = s[*i];
-        part[strlen(part) + 1] = '\0';
-        ++(*i);
-    }
+int lispy_load(lispy* l, const char* path) {
+    lthread_enter(&l->Main);
 
-    // Check if identifier looks like a number
-    int is_num = strchr("-0123456789", part[0]) != NULL;
-    for (size_t i = 1; i < strlen(part); ++i) {
-        if (!strchr("0123456789", part[i])) {
-            is_num = 0;
-            break;
-        }
-    }
-    if (strlen(part) == 1 && part[0] == '-') is_num = 0;
+    lval* args = lval_add(lval_sexpr(), lval_str((char*)path));
 
-    lval* x = NULL;
-    if (is_num) {
-        errno = 0;
-        long num = strtol(part, NULL, 10);
-        x = (errno != ERANGE) ? lval_num(num) : lval_err("Invalid number");
-    } else {
-        x = lval_sym(part);
-    }
+    return lispy_set_result(l, builtin_load(l->Root, args));
+}
 
-    free(part);
+int lispy_eval(lispy* l, const char* src, size_t length) {
+    lthread_enter(&l->Main);
 
-    return x;
-}
+    lval* expr = lval_read_all((char*)src, length);
+    if (lval_type_of(expr) == LVAL_ERR) return lispy_set_result(l, expr);
 
-lval* lval_read_str(char* s, int* i) {
-    // Skip the initial quote
-    ++(*i);
+    lval* x = lval_sexpr();
+    lheap_push_root(expr);
 
-    char* part = calloc(1, 1);
-    while (s[*i] != '"') {
-        char c = s[*i];
+    while (expr->Count && lval_type_of(x) != LVAL_ERR) {
+        lval_free(x);
+        x = lval_eval(l->Root, lval_pop(expr, 0));
 
-        if (c == '\0') {
-            free(part);
+        lheap_push_root(x);
+        lheap_safepoint(l->Root);
+        lheap_pop_root();
+    }
 
-            return lval_err("Unexpected end of input");
-        }
+    lheap_pop_root();
+    lval_free(expr);
 
-        // Read escape sequence
-        if (c == '\\') {
-            ++(*i);
+    return lispy_set_result(l, x);
+}
 
-            if (strchr(lval_str_unescapable, s[*i])) {
-                c = lval_str_unescape(s[*i]);
-            } else {
-                free(part);
+int lispy_load_image(lispy* l, const char* image, const char** paths, size_t count) {
+    lthread_enter(&l->Main);
 
-                return lval_err("Invalid escape sequence \\%c", s[*i]);
-            }
-        }
+    if (limage_load(l, (char*)image, (char**)paths, count)) return lispy_set_result(l, lval_sexpr());
 
-        // Append character to string
-        part = realloc(part, strlen(part) + 2);
-        part[strlen(part) + 0] = c;
-        part[strlen(part) + 1] = '\0';
+    // NOTE(daniel): read the files before loading them, so an image is never
+    // newer than what it was made from.
+    limage_source* sources = calloc(count, sizeof(limage_source));
+    bool fresh = true;
 
-        ++(*i);
+    for (size_t i = 0; i < count; ++i) {
+        if (!limage_source_of((char*)paths[i], &sources[i])) fresh = false;
     }
 
-    // Skip the final quote
-    ++(*i);
+    for (size_t i = 0; i < count; ++i) {
+        if (lispy_load(l, paths[i]) != 0) {
+            free(sources);
+            return -1;
+        }
+    }
 
-    lval* x = lval_str(part);
-    free(part);
+    if (fresh) limage_save(l, (char*)image, (char**)paths, sources, count);
+    free(sources);
 
-    return x;
+    return 0;
 }
 
-lval* lval_read(char* s, int* i) {
-    // Skip trailing whitespace and comments
-    while (strchr(" \t\v\r\n;", s[*i]) && s[*i] != '\0') {
-        if (s[*i] == ';') {
-            while (s[*i] != '\n' && s[*i] != '\0') ++(*i);
-        }
+const char* lispy_result(lispy* l) {
+    return l->Result ? l->Result : "";
+}
 
-        ++(*i);
-    }
+#ifndef LISPY_LIBRARY
 
-    lval* x = NULL;
+void load_file(lispy* l, char* filename) {
+    if (lispy_load(l, filename) != 0) fprintf(l->Out, "%s\n", lispy_result(l));
+}
 
-    if (s[*i] == '\0') return lval_err("Unexpected end of input");
-
-    if (s[*i] == '(') {
-        ++(*i);
-        x = lval_read_expr(s, i, ')');
-    } else if (s[*i] == '{') {
-        ++(*i);
-        x = lval_read_expr(s, i, '}');
-    } else if (strchr(lval_str_sym_characters, s[*i])) {
-        x = lval_read_sym(s, i);
-    } else if (strchr("\"", s[*i])) {
-        x = lval_read_str(s, i);
-    } else {
-        x = lval_err("Unexpected character %c", s[*i]);
+// Parses a size with an optional K, M or G suffix.
+size_t parse_size(char* s) {
+    char* end = NULL;
+    size_t n = strtoull(s, &end, 10);
+
+    switch (*end) {
+        case 'k': case 'K': return n << 10;
+        case 'm': case 'M': return n << 20;
+        case 'g': case 'G': return n << 30;
+        default: return n;
     }
+}
 
-    // Skip trailing whitespace and comments
-    while (strchr(" \t\v\r\n;", s[*i]) && s[*i] != '\0') {
-        if (s[*i] == ';') {
-            while (s[*i] != '\n' && s[*i] != '\0') ++(*i);
-        }
+int main(int argc, char** argv) {
+    lispy* l = lispy_new();
+
+#ifndef _WIN32
+    // NOTE(daniel): output that no one watches is written in large chunks.
+    if (!isatty(STDOUT_FILENO)) setvbuf(stdout, NULL, _IOFBF, 1 << 16);
+#endif
 
-        ++(*i);
+    // Parse options, everything else is a file to load.
+    int files = 1;
+
+    char* image = NULL;
+    size_t preludes = 1;
+    const char** sources = calloc(argc + 1, sizeof(char*));
+    sources[0] = "stdlib.lisp";
+
+    for (int i = 1; i < argc; ++i) {
+        if (strncmp(argv[i], "--heap-size=", 12) == 0) {
+            lheap_reserve(parse_size(argv[i] + 12));
+        } else if (strncmp(argv[i], "--gc-threshold=", 15) == 0) {
+            heap->Threshold = parse_size(argv[i] + 15);
+        } else if (strcmp(argv[i], "--tree-walk") == 0) {
+            l->TreeWalk = true;
+        } else if (strncmp(argv[i], "--profile=", 10) == 0) {
+            lprof_start(argv[i] + 10);
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            atexit(lstats_print);
+        } else if (strncmp(argv[i], "--threads=", 10) == 0) {
+            l->Par->Threads = strtoul(argv[i] + 10, NULL, 10);
+        } else if (strcmp(argv[i], "--load-cache") == 0) {
+            lispy_load_cache(l, "");
+        } else if (strncmp(argv[i], "--load-cache=", 13) == 0) {
+            lispy_load_cache(l, argv[i] + 13);
+        } else if (strncmp(argv[i], "--image=", 8) == 0) {
+            image = argv[i] + 8;
+        } else if (strncmp(argv[i], "--prelude=", 10) == 0) {
+            sources[preludes++] = argv[i] + 10;
+        } else if (strncmp(argv[i], "--", 2) == 0) {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            fputs("Usage: lispy [--heap-size=BYTES] [--gc-threshold=OBJECTS] [--tree-walk] [--stats] [--profile=FILE] [--threads=N] [--load-cache[=DIR]] [--prelude=FILE]... [--image=FILE] [file|-]...\n", stderr);
+            return 1;
+        } else {
+            argv[files++] = argv[i];
+        }
     }
 
-    return x;
-}
+    argc = files;
 
-int main(int argc, char** argv) {
-    (void)argc;
-    (void)argv;
+    lenv* env = l->Root;
+
+    // NOTE(daniel): the standard library and the preludes make up the image.
+    if (image) {
+        if (lispy_load_image(l, image, sources, preludes) != 0) fprintf(l->Out, "%s\n", lispy_result(l));
+    } else {
+        for (size_t i = 0; i < preludes; ++i) load_file(l, (char*)sources[i]);
+    }
 
-    lenv* env = lenv_new();
-    lenv_add_builtins(env);
-    load_file(env, "stdlib.lisp");
+    free(sources);
 
     if (argc == 1) {
         // Print version and exit information
@@ -1250,6 +7662,8 @@ int main(int argc, char** argv) {
 
         // REPL
         for (;;) {
+            lheap_safepoint(env);
+
             // Output prompt and get input
             char* input = readline("lispy> ");
 
@@ -1257,8 +7671,7 @@ int main(int argc, char** argv) {
             add_history(input);
 
             // Read from input to create an S-Expression
-            int pos = 0;
-            lval* expr = lval_read_expr(input, &pos, '\0');
+            lval* expr = lval_read_all(input, strlen(input));
 
             lval* result = lval_eval(env, expr);
             lval_println(result);
@@ -1269,9 +7682,11 @@ int main(int argc, char** argv) {
     } else {
         // Load files
         for (size_t i = 1; i < (size_t)argc; ++i) {
-            load_file(env, argv[i]);
+            load_file(l, argv[i]);
         }
     }
 
     return 0;
 }
+
+#endif
@@ -29,64 +29,6 @@
 (fun {trd l}
      {eval (head (tail (tail l)))})
 
-; Length of list
-(fun {len l} 
-     {if (== l nil)
-        {0}
-        {+ 1 (len (tail l))}})
-
-; Nth item in a list
-(fun {nth n l}
-     {if (== n 0)
-        {fst l}
-        {nth (- n 1) (tail l)}})
-
-; Last item in a list (rather inefficiently)
-(fun {last l}
-     {nth (- (len l) 1) l})
-
-; Take N items
-(fun {take n l}
-     {if (== n 0)
-        {nil}
-        {join (head l) (take (- n 1) (tail l))}})
-
-; Drop N items
-(fun {drop n l}
-     {if (== n 0)
-        {l}
-        {drop (- n 1) (tail l)}})
-
-; Split at N (rather inefficiently)
-(fun {split n l}
-     {list (take n l) (drop n l)})
-
-; Element of list
-(fun {elem x l}
-     {if (== l nil)
-        {false}
-        {if (== x (fst l))
-            {true}
-            {elem x (tail l)}}})
-
-; Map
-(fun {map f l}
-     {if (== l nil)
-        {nil}
-        {join 
-            (list (f (fst l))) 
-            (map f (tail l))}})
-
-; Filter
-(fun {filter f l}
-     {if (== l nil)
-        {nil}
-        {join 
-            (if (f (fst l))
-                {head l}
-                {nil})
-            (filter f (tail l))}})
-
 ; Sequence
 (fun {do & l}
      {if (== l nil)
@@ -113,17 +55,6 @@
 (fun {comp f g x}   ; Compose two functions
      {f (g x)})
 
-; Fold
-(fun {foldl f z l}
-     {if (== l nil)
-        {z}
-        {foldl f (f z (fst l)) (tail l)}})
-
-(fun {sum l}
-     {foldl + 0 l})
-(fun {product l}
-     {foldl * 1 l})
-
 ; Select
 (fun {select & cs}
      {if (== cs nil)
@@ -140,3 +71,69 @@
         {if (== x (fst (fst cs)))
             {snd (fst cs)}
             {unpack case (join (list x) (tail cs))}}})
+
+; Reference definitions of the list functions that are now builtins, kept
+; to check the builtins against (see test/builtins.lisp).
+(fun {len-lisp l}
+     {if (== l nil)
+        {0}
+        {+ 1 (len-lisp (tail l))}})
+
+(fun {nth-lisp n l}
+     {if (== n 0)
+        {fst l}
+        {nth-lisp (- n 1) (tail l)}})
+
+(fun {last-lisp l}
+     {nth-lisp (- (len-lisp l) 1) l})
+
+(fun {take-lisp n l}
+     {if (== n 0)
+        {nil}
+        {join (head l) (take-lisp (- n 1) (tail l))}})
+
+(fun {drop-lisp n l}
+     {if (== n 0)
+        {l}
+        {drop-lisp (- n 1) (tail l)}})
+
+(fun {split-lisp n l}
+     {list (take-lisp n l) (drop-lisp n l)})
+
+(fun {elem-lisp x l}
+     {if (== l nil)
+        {false}
+        {if (== x (fst l))
+            {true}
+            {elem-lisp x (tail l)}}})
+
+(fun {map-lisp f l}
+     {if (== l nil)
+        {nil}
+        {join 
+            (list (f (fst l))) 
+            (map-lisp f (tail l))}})
+
+(fun {filter-lisp f l}
+     {if (== l nil)
+        {nil}
+        {join 
+            (if (f (fst l))
+                {head l}
+                {nil})
+            (filter-lisp f (tail l))}})
+
+(fun {foldl-lisp f z l}
+     {if (== l nil)
+        {z}
+        {foldl-lisp f (f z (fst l)) (tail l)}})
+
+(fun {sum-lisp l}
+     {foldl-lisp + 0 l})
+(fun {product-lisp l}
+     {foldl-lisp * 1 l})
+
+(fun {reverse-lisp l}
+     {if (== l nil)
+        {nil}
+        {join (reverse-lisp (tail l)) (head l)}})
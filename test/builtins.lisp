@@ -0,0 +1,65 @@
+; Checks the list builtins against their reference definitions in the
+; stdlib: every case is run through both and a FAIL line is printed when
+; the results differ. See test/lib/check.lisp.
+(def {short} {1 2 3 4 5})
+(def {nested} {1 {2 3} {+ 1 2} {}})
+(def {long} (map (\ {x} {* x 7}) (vlist (vrange 1000))))
+
+(check "len" len len-lisp
+       {{nil} {{1}} {short} {nested} {long} {(tail short)}})
+
+(check "nth" nth nth-lisp
+       {{0 short} {4 short} {2 nested} {1 nested} {999 long} {1 (tail short)}})
+
+(check "last" last last-lisp
+       {{{1}} {short} {nested} {long} {(take 3 short)}})
+
+(check "take" take take-lisp
+       {{0 short} {1 short} {5 short} {3 nested} {500 long} {2 (tail short)}})
+
+(check "drop" drop drop-lisp
+       {{0 short} {1 short} {5 short} {3 nested} {500 long} {2 (tail short)}})
+
+(check "split" split split-lisp
+       {{0 short} {2 short} {5 short} {2 nested} {999 long}})
+
+(check "elem" elem elem-lisp
+       {{1 nil} {3 short} {9 short} {3 nested} {{2 3} nested} {6993 long} {5 long}})
+
+(check "map" map map-lisp
+       {{(\ {x} {* x x}) nil}
+        {(\ {x} {* x x}) short}
+        {(\ {x} {list x x}) nested}
+        {(\ {x} {- x}) long}})
+
+(check "filter" filter filter-lisp
+       {{(\ {x} {> x 2}) nil}
+        {(\ {x} {> x 2}) short}
+        {(\ {x} {== x x}) nested}
+        {(\ {x} {== 0 (- x (* 2 (/ x 2)))}) long}})
+
+(check "foldl" foldl foldl-lisp
+       {{+ 0 nil}
+        {+ 0 short}
+        {* 1 short}
+        {(\ {z x} {join z (list x)}) nil nested}
+        {- 0 long}
+        {(\ {z x} {join (list x) z}) nil short}})
+
+(check "sum" sum sum-lisp
+       {{nil} {short} {long} {(drop 2 short)}})
+
+(check "product" product product-lisp
+       {{nil} {short} {(take 10 long)}})
+
+(check "reverse" reverse reverse-lisp
+       {{nil} {{1}} {short} {nested} {long} {(drop 1 short)}})
+
+; Partial applications of the builtins have to behave like the lambdas'.
+(check "map partial" (map (\ {x} {+ x 1})) (map-lisp (\ {x} {+ x 1}))
+       {{short} {long}})
+
+(check "foldl partial" (foldl +) (foldl-lisp +)
+       {{0 short} {5 long}})
+
+(print "checked" checked "failed" failed)
@@ -0,0 +1,29 @@
+; Helpers for the tests in test/, loaded as a prelude by test/run.sh. Each
+; check that fails prints a FAIL line, and every test ends by printing the
+; counts with (print "checked" checked "failed" failed).
+(def {checked} 0)
+(def {failed} 0)
+
+(fun {expect name x y}
+     {do
+        (def {checked} (+ checked 1))
+        (if (== x y)
+            {nil}
+            {do
+                (def {failed} (+ failed 1))
+                (print "FAIL" name x y)})})
+
+; Runs the function `f` and its reference `g` on the argument list `args`,
+; a list of unevaluated arguments.
+(fun {check-case name f g args}
+     {expect (list name args)
+        (eval (join (list f) args))
+        (eval (join (list g) args))})
+
+; `cases` is a list of argument lists.
+(fun {check name f g cases}
+     {if (== cases nil)
+        {nil}
+        {do
+            (check-case name f g (fst cases))
+            (check name f g (tail cases))}})
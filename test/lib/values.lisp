@@ -0,0 +1,17 @@
+; Values of every type, loaded as a prelude by test/run.sh, so they also come
+; from the load cache and from images. test/load.lisp checks them against a
+; fresh load of this file.
+(fun {add x y} {+ x y})
+(def {sym-map} (hash-map {{a} 1 {b} {2 3} "c" "three" 4 {d}}))
+
+(fun {fill-map i m} {if (== i 0) {m} {fill-map (- i 1) (map-put m i (list i "x"))}})
+
+(def {values} (list
+    0 -1 9223372036854775807 (- 0 9223372036854775807 1)
+    "" "text" "quote \" and \\ and \n"
+    (substr "shared string storage" 7 6)
+    {} {1 {2 {3 {}}} sym "str"}
+    (vec {}) (vec {1 -2 3 9223372036854775807})
+    sym-map (fill-map 300 (hash-map {}))
+    add (add 1) (\ {x & rest} {join (list x) rest})
+    + head))
@@ -0,0 +1,29 @@
+; Checks that the values in test/lib/values.lisp, which test/run.sh also
+; loads from the load cache and from images, are the ones read from the
+; file, which is loaded here again.
+(def {loaded} values)
+(def {loaded-sym-map} sym-map)
+
+(load "test/lib/values.lisp")
+
+(expect "values" loaded values)
+(expect "length" (len loaded) 19)
+(expect "sym-map a" (map-get loaded-sym-map {a}) 1)
+(expect "sym-map b" (map-get loaded-sym-map {b}) {2 3})
+(expect "sym-map c" (map-get loaded-sym-map "c") "three")
+(expect "sym-map put" (map-get (map-put loaded-sym-map {a} 5) {a}) 5)
+(expect "sym-map del" (map-len (map-del loaded-sym-map {b})) 3)
+(expect "big map" (map-get (nth 13 loaded) 123) {123 "x"})
+(expect "lambda" ((nth 14 loaded) 2 3) 5)
+(expect "partial" ((nth 15 loaded) 41) 42)
+(expect "rest" ((nth 16 loaded) 1 2 3) {1 2 3})
+(expect "builtin" ((nth 17 loaded) 1 2) 3)
+(expect "head" ((nth 18 loaded) {1 2}) {1})
+(expect "string" (nth 7 loaded) "string")
+(expect "vector" (vlist (nth 11 loaded)) {1 -2 3 9223372036854775807})
+
+; The values that print the same every run, which test/run.sh compares with
+; those of a fresh load.
+(print (take 12 loaded))
+
+(print "checked" checked "failed" failed)
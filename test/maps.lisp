@@ -0,0 +1,55 @@
+; Checks the hash maps against association lists, lists of {key value}
+; pairs, running the same random puts and deletes on both.
+(fun {alist-get k l}
+     {if (== l nil)
+        {nil}
+        {if (== (fst (fst l)) k) {snd (fst l)} {alist-get k (tail l)}}})
+
+(fun {alist-del k l} {filter (\ {p} {!= (fst p) k}) l})
+(fun {alist-put k v l} {join (list (list k v)) (alist-del k l)})
+
+(fun {mod x m} {- x (* (/ x m) m)})
+(fun {next-random x} {mod (+ (* x 1103515245) 12345) 2147483648})
+
+; Keys of several types, so they hash differently.
+(def {keys} (join (vlist (vrange 150)) {"a" "b" "" "150" {x} {y} {1 2} {}}))
+
+; Does `n` random operations on the map `m` and the list `l`, checking a
+; random key and the size after each.
+(fun {run n x m l}
+     {if (== n 0)
+        {list m l}
+        {let {do
+            (= {k} (nth (mod (/ x 7) (len keys)) keys))
+            (= {del} (== (mod x 3) 0))
+            (= {m} (if del {map-del m k} {map-put m k n}))
+            (= {l} (if del {alist-del k l} {alist-put k n l}))
+            (= {probe} (nth (mod (/ x 11) (len keys)) keys))
+            (if (== (map-get m probe nil) (alist-get probe l))
+                {nil}
+                {expect (list "map-get" probe) (map-get m probe nil) (alist-get probe l)})
+            (if (== (map-len m) (len l))
+                {nil}
+                {expect "map-len" (map-len m) (len l)})
+            (run (- n 1) (next-random x) m l)}}})
+
+(def {result} (run 3000 42 (hash-map {}) {}))
+(def {m} (fst result))
+(def {l} (snd result))
+
+(expect "size" (map-len m) (len l))
+(expect "every key" (map (\ {k} {map-get m k nil}) keys) (map (\ {k} {alist-get k l}) keys))
+(expect "has" (map (\ {k} {map-has m k}) keys) (map (\ {k} {if (== (alist-get k l) nil) {0} {1}}) keys))
+(expect "sum" (map-fold (\ {z k v} {+ z v}) 0 m) (sum (map snd l)))
+(expect "keys" (len (map-keys m)) (len l))
+(expect "pairs" (len (map-pairs m)) (len l))
+
+; Maps are persistent and compare by content.
+(def {old} (map-put m "a" "old"))
+(def {new} (map-put old "a" "new"))
+(expect "persistent" (list (map-get old "a") (map-get new "a")) {"old" "new"})
+(expect "equal" (foldl (\ {z p} {map-put z (fst p) (snd p)}) (hash-map {}) (reverse l)) m)
+(expect "not equal" (== old new) 0)
+(expect "deleted" (map-len (foldl (\ {z k} {map-del z k}) m keys)) 0)
+
+(print "checked" checked "failed" failed)
@@ -0,0 +1,19 @@
+; Checks that the arithmetic builtins wrap around like sum and product
+; instead of overflowing.
+(def {max} 9223372036854775807)
+(def {min} (- 0 max 1))
+
+(expect "+ wraps" (+ max 1) min)
+(expect "- wraps" (- min 1) max)
+(expect "* wraps" (* 4611686018427387904 2) min)
+(expect "negating min" (- min) min)
+(expect "min / -1" (/ min -1) min)
+(expect "+ like sum" (+ max 2 max) (sum (list max 2 max)))
+(expect "* like product" (* max max 3) (product (list max max 3)))
+
+(expect "+" (+ 1 2 3) 6)
+(expect "-" (- 10 4 3) 3)
+(expect "negate" (- 5) -5)
+(expect "/" (/ 7 -2) -3)
+
+(print "checked" checked "failed" failed)
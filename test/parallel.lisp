@@ -0,0 +1,44 @@
+; Checks pmap, pfilter and preduce against map, filter and foldl. test/run.sh
+; runs this at several thread counts, and each has to print the same.
+(def {l} (vlist (vrange 20000)))
+(def {short} {1 2 3 4 5 6 7 8 9})
+
+(check "pmap" pmap map
+       {{(\ {x} {* x x}) nil}
+        {(\ {x} {* x x}) short}
+        {(\ {x} {list x (- x)}) l}})
+
+(check "pfilter" pfilter filter
+       {{(\ {x} {> x 4}) nil}
+        {(\ {x} {> x 4}) short}
+        {(\ {x} {== (- x (* (/ x 3) 3)) 0}) l}})
+
+(check "preduce" preduce foldl
+       {{+ 0 nil} {+ 5 short} {+ 0 l} {* 1 short} {join {} (map list short)}})
+
+; preduce only equals foldl for an associative function, but whatever the
+; function, the chunks and the order they are combined in are always the same.
+(expect "preduce -" (preduce - 0 l) 0)
+(expect "preduce list" (preduce (\ {a b} {list a b}) 0 (take 9 l))
+        {0 {{{0 1} {2 3}} {{4 5} {6 {7 8}}}}})
+(expect "preduce 2a-b" (preduce (\ {a b} {- (* a 2) b}) 1 (take 200 l)) 195)
+
+; The globals are first used by the workers here, and have to stay what they
+; were when they are changed after.
+(def {g} {1 2 {3 4} "s"})
+(def {m} (hash-map {1 "one" 2 "two"}))
+(fun {scale x} {* x 3})
+
+(def {f} (\ {x} {list (scale x) g (map-get m 1)}))
+(def {r} (pmap f short))
+(expect "pmap globals" r (map f short))
+
+(def {g} 0)
+(def {m} (hash-map {1 "uno"}))
+(fun {scale x} {* x 4})
+
+(expect "pmap globals after" (pmap f short) (map f short))
+(expect "pmap result kept" (fst r) {3 {1 2 {3 4} "s"} "one"})
+(expect "pfilter globals" (pfilter (\ {x} {> x (* g (scale 1))}) short) short)
+
+(print "checked" checked "failed" failed)
@@ -0,0 +1,25 @@
+; Runs with --profile too, see test/run.sh, and the stacks it records for
+; run have to be the ones in test/profile.stacks.
+
+; outer is still running while the profiler's table of functions grows: each
+; lambda made here is profiled under its own name.
+(def {formals} {{a0} {a1} {a2} {a3} {a4} {a5} {a6} {a7} {a8} {a9}
+                {b0} {b1} {b2} {b3} {b4} {b5} {b6} {b7} {b8} {b9}
+                {c0} {c1} {c2} {c3} {c4} {c5} {c6} {c7} {c8} {c9}
+                {d0} {d1} {d2} {d3} {d4} {d5} {d6} {d7} {d8} {d9}})
+
+(fun {make-fun f} {eval (list \ f (join {+} f {1}))})
+(fun {outer l} {foldl (\ {acc f} {+ acc ((make-fun f) 1)}) 0 l})
+
+(expect "outer" (outer formals) 80)
+
+; Tail calls keep the entry of the lambda making them: oddp is profiled as
+; called from evenp, and a loop stays a single entry.
+(fun {loop n acc} {if (== n 0) {acc} {loop (- n 1) (+ acc n)}})
+(fun {evenp n} {if (== n 0) {1} {oddp (- n 1)}})
+(fun {oddp n} {if (== n 0) {0} {evenp (- n 1)}})
+(fun {run n} {list (loop n 0) (evenp (+ n 1))})
+
+(expect "run" (run 1000) {500500 0})
+
+(print "checked" checked "failed" failed)
@@ -0,0 +1,96 @@
+#!/bin/sh
+# Runs every test/*.lisp with the helpers in test/lib/check.lisp, the values
+# in test/lib/values.lisp and the long forms made below as preludes. A test fails if it prints a
+# FAIL or Error line, or doesn't get to print its "checked" line. A sanitizer
+# report fails it too, for builds with -fsanitize=undefined.
+# Usage: test/run.sh [LISPY]
+#
+# Each test then runs again in other ways, and has to print the same every
+# time: with every thread count in $threads, read from a pipe after the long
+# forms, with the preludes in an image and with the load cache, each once
+# writing it and once reading it back.
+#
+# A test with a .stacks file next to it runs again with --profile, and the
+# call stacks recorded under the functions named in it, in collapsed stack
+# format without the times, have to be the ones listed.
+lispy=${1:-./lispy}
+threads="1 2 3 8"
+out=$(mktemp -d)
+trap 'rm -rf "$out"' EXIT
+status=0
+
+# Forms far longer than the chunks files are read in (see lstream), with
+# brackets, quotes and semicolons in strings and comments, and many short
+# forms after them. test/stream.lisp checks what they define.
+awk 'BEGIN {
+    printf "(def {long-list} {"
+    for (i = 0; i < 30000; ++i) printf " %d", i
+    print "})"
+    print "; a comment with ( { \" in it"
+    printf "(def {long-string} \""
+    for (i = 0; i < 20000; ++i) printf "(\\\"{;}\\\\)"
+    print "\")"
+    print "(def {long-count} 0)"
+    for (i = 0; i < 5000; ++i) print "(def {long-count} (+ long-count 1)) ; )"
+}' > "$out/long.lisp"
+
+run() {
+    "$lispy" --prelude=test/lib/check.lisp --prelude=test/lib/values.lisp --prelude="$out/long.lisp" "$@" 2>&1
+}
+
+check() {
+    awk '{ print } /FAIL|Error|runtime error/ { bad = 1 } /^"checked"/ { done = 1 } END { exit bad || !done }'
+}
+
+# Runs lispy with the options after the description `how`, which has to
+# print what the test `t` did the first time.
+same() {
+    how=$1
+    shift
+
+    run "$@" > "$out/output"
+    cmp -s "$out/expected" "$out/output" || { echo "FAIL $t $how"; diff "$out/expected" "$out/output"; status=1; }
+}
+
+for t in test/*.lisp; do
+    echo "$t"
+
+    run "$t" > "$out/expected"
+    check < "$out/expected" || { status=1; continue; }
+
+    for n in $threads; do
+        same "with --threads=$n" --threads=$n "$t"
+    done
+
+    cat "$out/long.lisp" "$t" | same "from a pipe" -
+
+    rm -f "$out/image"
+    same "writing an image" --image="$out/image" "$t"
+    same "from an image" --image="$out/image" "$t"
+
+    rm -rf "$out/cache"
+    mkdir "$out/cache"
+    same "writing the load cache" --load-cache="$out/cache" "$t"
+    same "from the load cache" --load-cache="$out/cache" "$t"
+
+    if ! run --load-cache="$out/cache" --stats "$t" | grep -q '^load_cache_misses=0$'; then
+        echo "FAIL $t doesn't load from the load cache"
+        status=1
+    fi
+
+    stacks=${t%.lisp}.stacks
+    [ -f "$stacks" ] || continue
+
+    if ! run --profile="$out/profile" "$t" > /dev/null; then
+        echo "FAIL $t with --profile"
+        status=1
+        continue
+    fi
+
+    roots=$(cut -d';' -f1 "$stacks" | sort -u | paste -sd'|' -)
+
+    sed 's/ [0-9]*$//' "$out/profile" | grep -E "^($roots)(;|$)" | LC_ALL=C sort > "$out/stacks"
+    diff "$stacks" "$out/stacks" || { echo "FAIL $stacks"; status=1; }
+done
+
+exit $status
@@ -0,0 +1,11 @@
+; Checks the long forms test/run.sh makes, which are read in several chunks
+; from a file, a pipe, an image or the load cache.
+(expect "list" (len long-list) 30000)
+(expect "list sum" (sum long-list) 449985000)
+(expect "list last" (last long-list) 29999)
+(expect "string" (str-len long-string) 140000)
+(expect "string start" (substr long-string 0 14) "(\"{;}\\)(\"{;}\\)")
+(expect "string end" (substr long-string 139993 7) "(\"{;}\\)")
+(expect "short forms" long-count 5000)
+
+(print "checked" checked "failed" failed)
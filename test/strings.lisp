@@ -0,0 +1,38 @@
+; Checks the string builtins, which share characters between strings, see
+; builtin_substr and builtin_concat.
+(expect "str-len" (map str-len {"" "a" "hello world"}) {0 1 11})
+(expect "str->num" (map str->num {"0" "12" "-7" "9223372036854775807"}) {0 12 -7 9223372036854775807})
+
+(def {s} "hello world")
+(expect "substr" (substr s 6 5) "world")
+(expect "substr empty" (substr s 11 0) "")
+(expect "substr of substr" (substr (substr s 3 6) 1 4) "o wo")
+
+; Appending to a view must not write over the string it is a view of, nor to
+; what else was appended to it.
+(def {h} (substr s 0 5))
+(def {h1} (concat h "!!"))
+(def {h2} (concat h "??"))
+(expect "concat view" (list s h h1 h2) {"hello world" "hello" "hello!!" "hello??"})
+
+(def {a} (concat "ab" "cd"))
+(def {b} (concat a "ef"))
+(def {c} (concat a "gh"))
+(expect "concat shared" (list a b c) {"abcd" "abcdef" "abcdgh"})
+(expect "concat many" (concat "x" "" "y" "z") "xyz")
+
+(def {grow} (foldl (\ {acc x} {concat acc x}) "" (map (\ {i} {"ab"}) (vlist (vrange 1000)))))
+(expect "concat grow" (str-len grow) 2000)
+
+(expect "str-split" (str-split "a,,b," ",") {"a" "" "b" ""})
+(expect "str-split none" (str-split "abc" ";") {"abc"})
+(expect "str-split empty" (str-split "" ",") {""})
+(expect "str-split long separator" (str-split "1 :: 2 :: 3" " :: ") {"1" "2" "3"})
+
+; str-join is the inverse of str-split.
+(fun {round-trip x}
+     {expect (list "str-join" x) (str-join (str-split (fst x) (snd x)) (snd x)) (fst x)})
+
+(map round-trip {{"a,,b," ","} {"" ","} {",,," ","} {"a b c" " "} {"xyxyx" "yx"} {"hello world" "o"}})
+
+(print "checked" checked "failed" failed)
@@ -0,0 +1,41 @@
+; Checks the vector builtins against the same operations on lists, for
+; lengths around the four lanes of the kernels.
+(fun {zip-with f x y}
+     {if (== x nil)
+        {nil}
+        {join (list (f (fst x) (fst y))) (zip-with f (tail x) (tail y))}})
+
+(fun {scan l}
+     {snd (foldl (\ {acc x} {list (+ (fst acc) x) (join (snd acc) (list (+ (fst acc) x)))}) {0 {}} l)})
+
+(def {max} 9223372036854775807)
+
+(fun {check-vectors n}
+     {let {do
+        (= {xs} (map (\ {i} {- (* i 37) 500}) (vlist (vrange n))))
+        (= {ys} (map (\ {i} {+ (* i -11) 3}) (vlist (vrange n))))
+        (= {x} (vec xs))
+        (= {y} (vec ys))
+        (expect (list "vlist" n) (vlist x) xs)
+        (expect (list "vlen" n) (vlen x) (len xs))
+        (expect (list "v+" n) (vlist (v+ x y)) (zip-with + xs ys))
+        (expect (list "v-" n) (vlist (v- x y)) (zip-with - xs ys))
+        (expect (list "v*" n) (vlist (v* x y)) (zip-with * xs ys))
+        (expect (list "v/" n) (vlist (v/ x y)) (zip-with / xs ys))
+        (expect (list "v==" n) (vlist (v== x x)) (zip-with == xs xs))
+        (expect (list "v<" n) (vlist (v< x y)) (zip-with < xs ys))
+        (expect (list "v>=" n) (vlist (v>= x y)) (zip-with >= xs ys))
+        (expect (list "v+ number" n) (vlist (v+ x 7)) (map (\ {a} {+ a 7}) xs))
+        (expect (list "number v-" n) (vlist (v- 7 x)) (map (\ {a} {- 7 a}) xs))
+        (expect (list "v* wraps" n) (vlist (v* x max)) (map (\ {a} {* a max}) xs))
+        (expect (list "vdot" n) (vdot x y) (foldl + 0 (zip-with * xs ys)))
+        (expect (list "vsum" n) (vsum x) (sum xs))
+        (expect (list "vscan" n) (vlist (vscan x)) (scan xs))}})
+
+(map check-vectors {0 1 3 4 5 8 17 257})
+
+(expect "vmin" (vmin (vec {5 -3 9 -3 0})) -3)
+(expect "vmax" (vmax (vec {5 -3 9 -3 0})) 9)
+(expect "vrange" (vlist (vrange 5)) {0 1 2 3 4})
+
+(print "checked" checked "failed" failed)